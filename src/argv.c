@@ -12,6 +12,8 @@
 #include <stdlib.h>
 #include <errno.h>
 
+#include "argv.h"
+
 /*
  * Gets the next character from *src, and modifies
  * *src to point to the next-next character.
@@ -21,7 +23,7 @@
  * Returns the next character, or -1 if an error
  * (ie '\' at the end of a line)
  */
-static int next_char(const char **src)
+static int next_char(char **src)
 {
 	int c;
 
@@ -42,12 +44,14 @@ static int next_char(const char **src)
 }
 
 /* Packs quoted string into *pdst
+ *
+ * *pdst never passes *psrc, so this works in place.
  */
-static int pack_quote(char **pdst, const char **psrc, char token)
+static int pack_quote(char **pdst, char **psrc, char token)
 {
 	int err, c;
 	char *dst = *pdst;
-	const char *src = *psrc;
+	char *src = *psrc;
 
 	while (*src != 0 && *src != token) {
 		if (*src == '"' || *src == '\'') {
@@ -72,7 +76,6 @@ static int pack_quote(char **pdst, const char **psrc, char token)
 		return -EINVAL;
 	}
 
-	*dst = 0;
 	/* *src == token - skip */
 	src++;
 	*psrc = src;
@@ -81,93 +84,108 @@ static int pack_quote(char **pdst, const char **psrc, char token)
 	return 0;
 }
 
-
-int tokenizer_next(char **dst, const char **src)
+int argv_split(char *line, char **argv, int max)
 {
-	char *dp;
-	const char *s = *src;
-	int c, err;
+	char *src = line;
+	char *dst;
+	int argc = 0;
+	int c, err, more;
+
+	for (;;) {
+		/* Skip leading white space */
+		while (*src && isspace(*src)) {
+			src++;
+		}
 
-	/* Skip leading white space if token == 0 */
-	while (*s && isspace(*s)) {
-		s++;
-	}
+		if (*src == 0) {
+			break;
+		}
 
-	/* If nothing to do, indicate doneness.
-	 */
-	if (*s == 0 ) {
-		*dst = NULL;
-		return 0;
-	}
+		/* Leave room for the NULL */
+		if (argc >= max - 1) {
+			return -E2BIG;
+		}
 
-	*dst = strdup(*src);
-	dp = *dst;
+		dst = src;
+		argv[argc++] = dst;
+
+		while (*src != 0 && !isspace(*src)) {
+			/* Handle quoting
+			 */
+			if (*src == '"' || *src == '\'') {
+				c = *(src++);
+				err = pack_quote(&dst, &src, c);
+				if (err < 0) {
+					return -EINVAL;
+				}
+				continue;
+			}
 
-	while (*s != 0 && !isspace(*s)) {
-		/* Handle quoting
-		 */
-		if (*s == '"' || *s == '\'') {
-			c = *(s++);
-			err = pack_quote(&dp, &s, c);
-			if (err < 0) {
-				return -EINVAL;
+			c = next_char(&src);
+			if (c < 0) {
+				return c;
 			}
-			continue;
-		}
 
-		c = next_char(&s);
-		if (c < 0) {
-			return c;
+			*(dst++) = c;
 		}
 
-		*(dp++) = c;
+		more = (*src != 0);
+		*dst = 0;
+		if (more) {
+			src++;
+		}
 	}
 
-	if (isspace(*s)) {
-		s++;
+	if (max > 0) {
+		argv[argc] = NULL;
 	}
-	*src = s;
-	*dp = 0;
 
-	return 0;
+	return argc;
 }
 
-int argv_from(const char *src, int *pargc, char ***pargv)
+int argv_join(char *line, size_t len, int argc, char **argv)
 {
-	int argc=0;
-	char **argv;
-	char *cp;
-	int err;
-
-	argv = malloc(sizeof(char *));
-	argv[0] = NULL;
-	while (*src != 0) {
-		err = tokenizer_next(&cp, &src);
-		if (err < 0) {
-			return err;
+	size_t n = 0;
+	int i, j, c;
+
+	for (i = 0; i < argc; i++) {
+		/* Room for the separator, or the NUL */
+		if (n + 1 >= len) {
+			return -ENAMETOOLONG;
+		}
+		if (i > 0) {
+			line[n++] = ' ';
 		}
 
-		if (cp == NULL) {
-			break;
+		/* An empty argument would otherwise vanish */
+		if (argv[i][0] == 0) {
+			if (n + 3 >= len) {
+				return -ENAMETOOLONG;
+			}
+			line[n++] = '\'';
+			line[n++] = '\'';
+			continue;
 		}
 
-		argv[argc++] = strdup(cp);
-		argv = realloc(argv, sizeof(char *) * (argc + 1));
-		argv[argc] = NULL;
+		for (j = 0; argv[i][j] != 0; j++) {
+			c = (unsigned char)argv[i][j];
+			if (c == '\n') {
+				return -EINVAL;
+			}
+			if (n + 2 >= len) {
+				return -ENAMETOOLONG;
+			}
+			if (isspace(c) || c == '\\' || c == '"' || c == '\'') {
+				line[n++] = '\\';
+			}
+			line[n++] = c;
+		}
 	}
 
-	*pargc = argc;
-	*pargv = argv;
-
-	return 0;
-}
-
-void argv_free(int argc, char **argv)
-{
-	int i;
-	for (i = 0; i < argc; i++) {
-		free(argv[i]);
+	if (n >= len) {
+		return -ENAMETOOLONG;
 	}
-	free(argv);
-}
+	line[n] = 0;
 
+	return n;
+}
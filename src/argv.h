@@ -7,14 +7,30 @@
 #ifndef ARGV_H
 #define ARGV_H
 
+#include <stddef.h>
+
+/* Enough arguments for any ip-usbph command */
+#define ARGV_MAX	16
+
 /*
- * Get a Unix-quoting rules (", ', and \) next-whitepace-delimited
- * argc/argv array from *src.
+ * Split 'line' in place into Unix-quoting rules (", ', and \)
+ * whitespace-delimited arguments. argv[] has room for 'max'
+ * entries, including the terminating NULL. No memory is
+ * allocated - the arguments point into 'line'.
  *
- * Returns 0 on success, -1 if quoting rules are broken.
+ * Returns argc, -EINVAL if quoting rules are broken, or
+ * -E2BIG if there are too many arguments.
  */
-int argv_from(const char *src, int *pargc, char ***pargv);
+int argv_split(char *line, char **argv, int max);
 
-void argv_free(int argc, char **argv);
+/*
+ * Join 'argc' arguments into 'line', quoted so that argv_split()
+ * gives them back exactly. 'line' has room for 'len' bytes,
+ * including the terminating NUL.
+ *
+ * Returns the length of the line, -EINVAL for an argument with
+ * a newline in it, or -ENAMETOOLONG if the line would not fit.
+ */
+int argv_join(char *line, size_t len, int argc, char **argv);
 
 #endif /* ARGV_H */
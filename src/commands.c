@@ -0,0 +1,864 @@
+/*
+ * Copyright 2006, Jason McMullan
+ * Author: Jason McMullan <jason.mcmullan@gmail.com>
+ *
+ * Licensed under the LGPL v2
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include "commands.h"
+
+#define ARRAY_SIZE(x) (sizeof(x)/sizeof(x[0]))
+
+static const char *const keymap[0x20] = {
+	[IP_USBPH_KEY_0] = "0",
+	[IP_USBPH_KEY_1] = "1",
+	[IP_USBPH_KEY_2] = "2",
+	[IP_USBPH_KEY_3] = "3",
+	[IP_USBPH_KEY_4] = "4",
+	[IP_USBPH_KEY_5] = "5",
+	[IP_USBPH_KEY_6] = "6",
+	[IP_USBPH_KEY_7] = "7",
+	[IP_USBPH_KEY_8] = "8",
+	[IP_USBPH_KEY_9] = "9",
+	[IP_USBPH_KEY_YES] = "YES",
+	[IP_USBPH_KEY_NO] = "NO",
+	[IP_USBPH_KEY_VOL_UP] = "VOL+",
+	[IP_USBPH_KEY_VOL_DOWN] = "VOL-",
+	[IP_USBPH_KEY_UP] = "UP",
+	[IP_USBPH_KEY_DOWN] = "DOWN",
+	[IP_USBPH_KEY_S] = "S",
+	[IP_USBPH_KEY_C] = "C",
+	[IP_USBPH_KEY_ASTERISK] = "*",
+	[IP_USBPH_KEY_HASH] = "#",
+};
+
+static const struct {
+	const char *name;
+	ip_usbph_sym symbol;
+} symbols[] = {
+	{ .name = "Down", .symbol = IP_USBPH_SYMBOL_DOWN },
+	{ .name = "Up", .symbol = IP_USBPH_SYMBOL_UP },
+	{ .name = "Sat", .symbol = IP_USBPH_SYMBOL_SAT },
+	{ .name = "Colon", .symbol = IP_USBPH_SYMBOL_COLON },
+	{ .name = "Fri", .symbol = IP_USBPH_SYMBOL_FRI },
+	{ .name = "Thu", .symbol = IP_USBPH_SYMBOL_THU },
+	{ .name = "M_and_D", .symbol = IP_USBPH_SYMBOL_M_AND_D },
+	{ .name = "Tue", .symbol = IP_USBPH_SYMBOL_TUE },
+	{ .name = "Wed", .symbol = IP_USBPH_SYMBOL_WED },
+	{ .name = "Mon", .symbol = IP_USBPH_SYMBOL_MON },
+	{ .name = "Sun", .symbol = IP_USBPH_SYMBOL_SUN },
+	{ .name = "Out", .symbol = IP_USBPH_SYMBOL_OUT },
+	{ .name = "In", .symbol = IP_USBPH_SYMBOL_IN },
+	{ .name = "New", .symbol = IP_USBPH_SYMBOL_NEW },
+	{ .name = "Mute", .symbol = IP_USBPH_SYMBOL_MUTE },
+	{ .name = "Lock", .symbol = IP_USBPH_SYMBOL_LOCK },
+	{ .name = "Man", .symbol = IP_USBPH_SYMBOL_MAN },
+	{ .name = "Balance", .symbol = IP_USBPH_SYMBOL_BALANCE },
+	{ .name = "Decimal", .symbol = IP_USBPH_SYMBOL_DECIMAL },
+};
+
+static uint64_t now_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int session_update(struct session *s)
+{
+	s->dirty = 1;
+
+	if (s->batch) {
+		return 0;
+	}
+
+	if (s->coalesce_msec > 0) {
+		if (s->flush_msec == 0) {
+			s->flush_msec = now_msec() + s->coalesce_msec;
+		}
+		return 0;
+	}
+
+	return session_sync(s);
+}
+
+int session_sync(struct session *s)
+{
+	/* Let everyone's updates out again */
+	if (s->batch) {
+		s->batch = 0;
+		ip_usbph_flush_hold(s->ph, 0);
+	}
+
+	s->flush_msec = 0;
+
+	if (!s->dirty) {
+		return 0;
+	}
+
+	/* Never wait on the device - a flush held, rate capped, or
+	 * behind one in flight goes out from the library's timers,
+	 * run by the caller's event loop.
+	 */
+	s->dirty = 0;
+	return ip_usbph_flush_async(s->ph, NULL, NULL);
+}
+
+int session_timeout(struct session *s)
+{
+	uint64_t now;
+
+	if (s->batch || !s->dirty || s->flush_msec == 0) {
+		return -1;
+	}
+
+	now = now_msec();
+	return (s->flush_msec > now) ? s->flush_msec - now : 0;
+}
+
+int session_run(struct session *s)
+{
+	if (session_timeout(s) != 0) {
+		return 0;
+	}
+
+	return session_sync(s);
+}
+
+static int cmd_backlight(struct session *s, int argc, char **argv)
+{
+	if (argc > 1) {
+		return -EINVAL;
+	}
+
+	return ip_usbph_backlight(s->ph);
+}
+
+static int cmd_symbols(struct session *s, int argc, char **argv)
+{
+	int i;
+
+	if (argc > 1) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(symbols); i++) {
+		fprintf(s->out, "%s\n", symbols[i].name);
+	}
+
+	return 0;
+}
+
+static int cmd_symbol(struct session *s, int argc, char **argv)
+{
+	int onoff = -EINVAL;
+	int i;
+	int err;
+
+	if (argc != 3) {
+		return -EINVAL;
+	}
+
+	if (strcasecmp(argv[2],"on") == 0) {
+		onoff = 1;
+	}
+
+	if (strcasecmp(argv[2],"off") == 0) {
+		onoff = 0;
+	}
+
+	if (onoff < 0) {
+		return onoff;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(symbols); i++) {
+		if (strcasecmp(argv[1], symbols[i].name) == 0) {
+			err = ip_usbph_symbol(s->ph, symbols[i].symbol, onoff);
+			session_update(s);
+			return err;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static int cmd_blink(struct session *s, int argc, char **argv)
+{
+	char *end;
+	long msec;
+	int i;
+	int err;
+
+	if (argc != 3) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(symbols); i++) {
+		if (strcasecmp(argv[1], symbols[i].name) == 0) {
+			break;
+		}
+	}
+
+	if (i == ARRAY_SIZE(symbols)) {
+		return -EINVAL;
+	}
+
+	/* Setting the symbol stops the blinking */
+	if (strcasecmp(argv[2], "off") == 0) {
+		err = ip_usbph_symbol(s->ph, symbols[i].symbol, 0);
+		session_update(s);
+		return err;
+	}
+
+	msec = strtol(argv[2], &end, 0);
+	if (*end != 0 || msec <= 0 || msec > 10000) {
+		return -EINVAL;
+	}
+
+	err = ip_usbph_blink(s->ph, IP_USBPH_ANIM_SYMBOL, symbols[i].symbol, 1, msec, msec);
+	session_update(s);
+	return err;
+}
+
+static int cmd_digit(struct session *s, int argc, char **argv)
+{
+	int i, err;
+	char *cp = argv[1];
+
+	if (argc != 2) {
+		return -EINVAL;
+	}
+
+	for (i = 0; cp[i] != 0; i++) {
+		if (!isxdigit(cp[i]) && !isspace(cp[i])) {
+			return -EINVAL;
+		}
+	}
+
+	if (i > 11) {
+		return -ENAMETOOLONG;
+	}
+
+	err = ip_usbph_digit_text(s->ph, cp);
+	if (err < 0) {
+		return err;
+	}
+
+	return session_update(s);
+}
+
+static int cmd_top(struct session *s, int argc, char **argv)
+{
+	char *cp = argv[1];
+	int err;
+
+	if (argc != 2) {
+		return -EINVAL;
+	}
+
+	if (strlen(cp) > 8) {
+		return -ENAMETOOLONG;
+	}
+
+	err = ip_usbph_top_text(s->ph, cp);
+	if (err < 0) {
+		return err;
+	}
+
+	return session_update(s);
+}
+
+static int cmd_bot(struct session *s, int argc, char **argv)
+{
+	char *cp = argv[1];
+	int err;
+
+	if (argc != 2) {
+		return -EINVAL;
+	}
+
+	if (strlen(cp) > 4) {
+		return -ENAMETOOLONG;
+	}
+
+	err = ip_usbph_bot_text(s->ph, cp);
+	if (err < 0) {
+		return err;
+	}
+
+	return session_update(s);
+}
+
+static int cmd_keys(struct session *s, int argc, char **argv)
+{
+	int i;
+
+	if (argc > 1) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(keymap); i++) {
+		if (keymap[i] == NULL) {
+			continue;
+		}
+		fprintf(s->out, "%s\n", keymap[i]);
+	}
+
+	return 0;
+}
+
+static int msec_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static int cmd_key(struct session *s, int argc, char **argv)
+{
+	int timeout = -1;
+	struct ip_usbph_key_event ev;
+	struct timespec start;
+	struct pollfd fds[16];
+
+	if (argc > 2) {
+		return -EINVAL;
+	}
+
+	if (argc == 2) {
+		timeout = strtol(argv[1], NULL, 0);
+	}
+
+	/* Show anything still pending before waiting */
+	if (!s->batch) {
+		session_sync(s);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (;;) {
+		int err, wait, n;
+
+		if (ip_usbph_handle_events_nonblocking(s->ph) < 0)
+			break;
+
+		while ((err = ip_usbph_keys_read(s->ph, &ev, 1)) == 1) {
+			if (ev.pressed) {
+				fprintf(s->out, "%s\n", keymap[ev.keycode & 0x1f]);
+				fflush(s->out);
+				return 0;
+			}
+		}
+
+		if (err < 0)
+			break;
+
+		wait = ip_usbph_next_timeout(s->ph);
+		if (timeout >= 0) {
+			int left = timeout - msec_since(&start);
+
+			if (left <= 0)
+				return -ETIMEDOUT;
+			if (wait < 0 || left < wait)
+				wait = left;
+		}
+
+		n = ip_usbph_get_pollfds(s->ph, fds, ARRAY_SIZE(fds));
+		if (n < 0)
+			break;
+
+		poll(fds, n, wait);
+	}
+
+	fprintf(s->out, "KEY: IO error\n");
+	fflush(s->out);
+	return -EIO;
+}
+
+/* Clear the display buffers, without flushing
+ */
+static void blank(struct session *s)
+{
+	int i;
+
+	ip_usbph_digit_text(s->ph, "");
+	ip_usbph_top_text(s->ph, "");
+	ip_usbph_bot_text(s->ph, "");
+	for (i = 0; i < ARRAY_SIZE(symbols); i++) {
+		ip_usbph_symbol(s->ph, symbols[i].symbol, 0);
+	}
+}
+
+static int cmd_clear(struct session *s, int argc, char **argv)
+{
+	if (argc > 1) {
+		return -EINVAL;
+	}
+
+	/* A deferred clear must not blank the display early */
+	if (s->batch || s->coalesce_msec > 0) {
+		blank(s);
+		return session_update(s);
+	}
+
+	s->dirty = 0;
+	return ip_usbph_clear(s->ph);
+}
+
+static const char *const usb_errors[IP_USBPH_STATS_ERRORS] = {
+	"OTHER", "IO", "INVALID_PARAM", "ACCESS", "NO_DEVICE",
+	"NOT_FOUND", "BUSY", "TIMEOUT", "OVERFLOW", "PIPE",
+	"INTERRUPTED", "NO_MEM", "NOT_SUPPORTED",
+};
+
+static void stats_histogram(FILE *out, const char *name, const uint64_t *hist)
+{
+	int i;
+
+	fprintf(out, "%s:", name);
+	for (i = 0; i < IP_USBPH_STATS_BUCKETS; i++) {
+		if (hist[i] != 0) {
+			fprintf(out, " %llu:%llu", 1ULL << i, (unsigned long long)hist[i]);
+		}
+	}
+	fprintf(out, "\n");
+}
+
+static int cmd_stats(struct session *s, int argc, char **argv)
+{
+	struct ip_usbph_stats st;
+	int i;
+
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset") != 0)) {
+		return -EINVAL;
+	}
+
+	if (argc == 2) {
+		ip_usbph_stats_reset(s->ph);
+		return 0;
+	}
+
+	ip_usbph_stats_get(s->ph, &st);
+
+	fprintf(s->out, "transport: %s\n", ip_usbph_transport_name(s->ph));
+	fprintf(s->out, "packets:");
+	for (i = 0; i < IP_USBPH_STATS_CODES; i++) {
+		fprintf(s->out, " %llu", (unsigned long long)st.packets[i]);
+	}
+	fprintf(s->out, "\n");
+	fprintf(s->out, "bytes: %llu\n", (unsigned long long)st.bytes);
+	fprintf(s->out, "flushes: %llu\n", (unsigned long long)st.flushes);
+	fprintf(s->out, "skipped: %llu\n", (unsigned long long)st.skipped);
+	fprintf(s->out, "deferred: %llu\n", (unsigned long long)st.deferred);
+	fprintf(s->out, "retries: %llu\n", (unsigned long long)st.retries);
+	fprintf(s->out, "key_reports: %llu\n", (unsigned long long)st.key_reports);
+
+	fprintf(s->out, "errors:");
+	for (i = 0; i < IP_USBPH_STATS_ERRORS; i++) {
+		if (st.errors[i] != 0) {
+			fprintf(s->out, " %s=%llu", usb_errors[i], (unsigned long long)st.errors[i]);
+		}
+	}
+	fprintf(s->out, "\n");
+
+	stats_histogram(s->out, "control_usec", st.control_usec);
+	stats_histogram(s->out, "key_usec", st.key_usec);
+
+	return 0;
+}
+
+/* Packet trace, spooled to a file */
+static struct ip_usbph_tracer *tracer;
+static int trace_fd = -1;
+
+void trace_stop(struct ip_usbph *ph)
+{
+	if (tracer == NULL) {
+		return;
+	}
+
+	ip_usbph_trace_set(ph, NULL, NULL);
+	ip_usbph_tracer_free(tracer);
+	close(trace_fd);
+	tracer = NULL;
+	trace_fd = -1;
+}
+
+static int cmd_trace(struct session *s, int argc, char **argv)
+{
+	if (argc != 2) {
+		return -EINVAL;
+	}
+
+	if (strcmp(argv[1], "off") == 0) {
+		trace_stop(s->ph);
+		return 0;
+	}
+
+	if (tracer != NULL) {
+		return -EBUSY;
+	}
+
+	trace_fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (trace_fd < 0) {
+		return -errno;
+	}
+
+	tracer = ip_usbph_tracer_new(4096, trace_fd);
+	if (tracer == NULL) {
+		close(trace_fd);
+		trace_fd = -1;
+		return -EIO;
+	}
+
+	ip_usbph_trace_set(s->ph, ip_usbph_tracer_sink, tracer);
+
+	return 0;
+}
+
+static int cmd_begin(struct session *s, int argc, char **argv)
+{
+	if (argc > 1 || s->batch) {
+		return -EINVAL;
+	}
+
+	/* Nothing half built goes out - not another client's flush,
+	 * nor a step of scrolling text
+	 */
+	s->batch = 1;
+	return ip_usbph_flush_hold(s->ph, 1);
+}
+
+static int cmd_commit(struct session *s, int argc, char **argv)
+{
+	if (argc > 1 || !s->batch) {
+		return -EINVAL;
+	}
+
+	return session_sync(s);
+}
+
+static int cmd_coalesce(struct session *s, int argc, char **argv)
+{
+	char *end;
+	long msec;
+
+	if (argc != 2) {
+		return -EINVAL;
+	}
+
+	msec = strtol(argv[1], &end, 0);
+	if (*end != 0 || msec < 0 || msec > 10000) {
+		return -EINVAL;
+	}
+
+	s->coalesce_msec = msec;
+
+	/* Turning it off flushes whatever was waiting */
+	if (msec == 0 && !s->batch) {
+		return session_sync(s);
+	}
+
+	return 0;
+}
+
+static int cmd_rate(struct session *s, int argc, char **argv)
+{
+	char *end;
+	long hz;
+
+	if (argc != 2) {
+		return -EINVAL;
+	}
+
+	hz = strtol(argv[1], &end, 0);
+	if (*end != 0 || hz < 0 || hz > 1000) {
+		return -EINVAL;
+	}
+
+	return ip_usbph_flush_rate(s->ph, hz);
+}
+
+static int cmd_retry(struct session *s, int argc, char **argv)
+{
+	struct ip_usbph_retry retry;
+	int *field[] = { &retry.timeout_msec, &retry.retries,
+	                 &retry.backoff_msec, &retry.backoff_max_msec };
+	char *end;
+	int i;
+
+	if (argc < 2 || argc > 5) {
+		return -EINVAL;
+	}
+
+	/* Fields not given keep their current value */
+	ip_usbph_retry_get(s->ph, &retry);
+
+	for (i = 1; i < argc; i++) {
+		*field[i - 1] = strtol(argv[i], &end, 0);
+		if (*end != 0) {
+			return -EINVAL;
+		}
+	}
+
+	return ip_usbph_retry_set(s->ph, &retry);
+}
+
+static int cmd_calibrate(struct session *s, int argc, char **argv)
+{
+	struct ip_usbph_profile p;
+	unsigned flags = 0;
+	int err;
+
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], "force") != 0)) {
+		return -EINVAL;
+	}
+
+	if (argc == 2) {
+		flags |= IP_USBPH_CALIBRATE_FORCE;
+	}
+
+	err = ip_usbph_calibrate(s->ph, flags);
+	if (err < 0) {
+		return err;
+	}
+
+	ip_usbph_profile_get(s->ph, &p);
+	fprintf(s->out, "control_usec: %u\n", p.control_usec);
+	fprintf(s->out, "flush_usec: %u\n", p.flush_usec);
+	fprintf(s->out, "max_hz: %u\n", p.max_hz);
+
+	return 0;
+}
+
+static const struct command cmds[] = {
+	{ .name = "backlight", .help = "backlight                 Turn the backlight on for 7 seconds",
+	  .cmd = cmd_backlight, },
+	{ .name = "clear",     .help = "clear                     Clear the display",
+	  .cmd = cmd_clear, },
+	{ .name = "symbols",   .help = "symbols                   List all symbols",
+	  .cmd = cmd_symbols, },
+	{ .name = "symbol",    .help = "symbol <name> on|off      Turn on/off a symbol",
+	  .cmd = cmd_symbol, },
+	{ .name = "blink",     .help = "blink <name> <msec>|off   Blink a symbol, msec on and msec off",
+	  .cmd = cmd_blink, },
+	{ .name = "digit",     .help = "digit <digits>            Display digits on the digit line",
+	  .cmd = cmd_digit, },
+	{ .name = "top",       .help = "top <string>              Display characters on the top character line",
+	  .cmd = cmd_top, },
+	{ .name = "bot",       .help = "bot <string>              Display characters on the top character line",
+	  .cmd = cmd_bot, },
+	{ .name = "key",       .help = "key [timeout]             Wait for a keystroke, optional timeout in msec",
+	  .cmd = cmd_key, },
+	{ .name = "keys",      .help = "keys                      List all key names",
+	  .cmd = cmd_keys },
+	{ .name = "stats",     .help = "stats [reset]             Show (or reset) transfer statistics",
+	  .cmd = cmd_stats, },
+	{ .name = "trace",     .help = "trace <file>|off          Record every packet to a trace file",
+	  .cmd = cmd_trace, },
+	{ .name = "begin",     .help = "begin                     Hold display updates until commit",
+	  .cmd = cmd_begin, },
+	{ .name = "commit",    .help = "commit                    Show all updates since begin at once",
+	  .cmd = cmd_commit, },
+	{ .name = "coalesce",  .help = "coalesce <msec>           Merge updates arriving within msec into one",
+	  .cmd = cmd_coalesce, },
+	{ .name = "rate",      .help = "rate <hz>                 Flush at most hz times a second, 0 for no limit",
+	  .cmd = cmd_rate, },
+	{ .name = "retry",     .help = "retry <ms> [n [ms [ms]]]  Transfer timeout, retries, backoff and its cap",
+	  .cmd = cmd_retry, },
+	{ .name = "calibrate", .help = "calibrate [force]         Measure (or show the cached) device profile",
+	  .cmd = cmd_calibrate, },
+};
+
+void rc_load(struct ip_usbph *ph)
+{
+	char rcfile[PATH_MAX];
+	char magic[4];
+	int fd, err, text;
+
+	snprintf(rcfile, sizeof(rcfile), "%s/.ip-usbphrc", getenv("HOME"));
+	fd = open(rcfile, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	/* Snapshots start "IPPH" - anything else is the old text format */
+	text = (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+	        memcmp(magic, "IPPH", sizeof(magic)) != 0);
+
+	err = ip_usbph_state_load(ph, fd);
+	close(fd);
+
+	if (err == -ENXIO)
+		fprintf(stderr, "%s: saved from another phone, not restored\n", rcfile);
+	else if (err < 0)
+		fprintf(stderr, "%s: %s, not restored\n", rcfile, strerror(-err));
+	else if (text)
+		rc_save(ph);
+}
+
+void rc_save(struct ip_usbph *ph)
+{
+	char rcfile[PATH_MAX];
+	char rcfile_new[PATH_MAX];
+	int fd;
+
+	snprintf(rcfile, sizeof(rcfile_new), "%s/.ip-usbphrc", getenv("HOME"));
+	snprintf(rcfile_new, sizeof(rcfile_new), "%s/.ip-usbphrc~", getenv("HOME"));
+	rename(rcfile, rcfile_new);
+	fd = open(rcfile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		rename(rcfile_new, rcfile);
+	} else {
+		ip_usbph_state_save(ph, fd);
+		close(fd);
+	}
+}
+
+static inline unsigned le16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+/* Apply one binary frame. Returns 1 if it changed the display.
+ */
+static int frame_run(struct session *s, uint8_t op, const uint8_t *arg, int len)
+{
+	int i;
+
+	switch (op) {
+	case OP_SYMBOL:
+		if (len != 2)
+			return 0;
+		return ip_usbph_symbol(s->ph, arg[0], arg[1]) == 0;
+	case OP_DIGIT:
+		if (len != 2)
+			return 0;
+		return ip_usbph_top_digit(s->ph, arg[0], arg[1]) == 0;
+	case OP_TOP_CHAR:
+		if (len != 3)
+			return 0;
+		return ip_usbph_top_char(s->ph, arg[0], le16(&arg[1])) == 0;
+	case OP_BOT_CHAR:
+		if (len != 3)
+			return 0;
+		return ip_usbph_bot_char(s->ph, arg[0], le16(&arg[1])) == 0;
+	case OP_DIGITS:
+		for (i = 0; i < len && i < IP_USBPH_TOP_DIGITS; i++)
+			ip_usbph_top_digit(s->ph, i, arg[i]);
+		return 1;
+	case OP_TOP:
+		for (i = 0; i < len / 2 && i < IP_USBPH_TOP_CHARS; i++)
+			ip_usbph_top_char(s->ph, i, le16(&arg[i * 2]));
+		return 1;
+	case OP_BOT:
+		for (i = 0; i < len / 2 && i < IP_USBPH_BOT_CHARS; i++)
+			ip_usbph_bot_char(s->ph, i, le16(&arg[i * 2]));
+		return 1;
+	case OP_CLEAR:
+		blank(s);
+		return 1;
+	case OP_BACKLIGHT:
+		ip_usbph_backlight(s->ph);
+		return 0;
+	case OP_COALESCE:
+		if (len == 2)
+			s->coalesce_msec = le16(arg);
+		return 0;
+	}
+
+	/* Unknown - skipped */
+	return 0;
+}
+
+size_t command_frames(struct session *s, const uint8_t *buff, size_t len)
+{
+	size_t pos = 0;
+	int updated = 0;
+
+	while (pos < len && pos + 1 + buff[pos] <= len) {
+		const uint8_t *frame = &buff[pos + 1];
+		int n = buff[pos];
+
+		pos += 1 + n;
+		if (n == 0)
+			continue;
+
+		if (frame[0] == OP_FLUSH) {
+			s->dirty |= updated;
+			updated = 0;
+			session_sync(s);
+			continue;
+		}
+
+		updated |= frame_run(s, frame[0], frame + 1, n - 1);
+	}
+
+	/* Everything this batch changed goes out together */
+	if (updated)
+		session_update(s);
+
+	return pos;
+}
+
+const struct command *command_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(cmds); i++) {
+		if (strcmp(name, cmds[i].name) == 0) {
+			return &cmds[i];
+		}
+	}
+
+	return NULL;
+}
+
+void command_usage(FILE *out)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(cmds); i++) {
+		fprintf(out, "%s\n", cmds[i].help);
+	}
+}
+
+const char *command_keyname(uint8_t keycode)
+{
+	return keymap[keycode & 0x1f];
+}
+
+/* Daemon socket: $IP_USBPH_SOCKET, or ip-usbph.sock in
+ * $XDG_RUNTIME_DIR, or a per-user name in /tmp
+ */
+void command_socket(char *path, size_t len)
+{
+	const char *env;
+
+	env = getenv("IP_USBPH_SOCKET");
+	if (env != NULL) {
+		snprintf(path, len, "%s", env);
+		return;
+	}
+
+	env = getenv("XDG_RUNTIME_DIR");
+	if (env != NULL)
+		snprintf(path, len, "%s/ip-usbph.sock", env);
+	else
+		snprintf(path, len, "/tmp/ip-usbph-%u.sock", (unsigned)getuid());
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright 2008, Jason McMullan <jason.mcmullan@gmail.com>
+ *
+ * Licensed under the LGPL v2
+ */
+
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "ip-usbph.h"
+
+/*
+ * A stream of commands - the utility's, or one daemon client's.
+ *
+ * Display updates are flushed at once, unless held by 'begin'
+ * until 'commit', or merged over a 'coalesce' window. Either
+ * way, only the newest content of each region goes out.
+ *
+ * The display is shared, so 'begin' holds every flush with
+ * ip_usbph_flush_hold(), including the other sessions', until
+ * its 'commit'.
+ */
+struct session {
+	struct ip_usbph *ph;
+	FILE *out;		/* Command output */
+	int batch;		/* Between begin and commit */
+	int dirty;		/* Updates not flushed yet */
+	int coalesce_msec;	/* 0 to flush every update */
+	uint64_t flush_msec;	/* When the pending flush is due */
+};
+
+/* Note an update, and flush it or hold it */
+int session_update(struct session *s);
+
+/* Flush anything pending now, ending any batch. The flush
+ * is asynchronous: the caller's loop must run the device's
+ * events and timers (ip_usbph_handle_events_nonblocking()).
+ */
+int session_sync(struct session *s);
+
+/* Milliseconds until session_run() is due, or -1 */
+int session_timeout(struct session *s);
+
+/* Flush if the coalescing window has closed */
+int session_run(struct session *s);
+
+/*
+ * ip-usbph command set, shared by the utility and the daemon.
+ *
+ * Commands write any output to s->out, and return 0 or -errno.
+ */
+struct command {
+	const char *name;
+	const char *help;
+	int (*cmd)(struct session *s, int argc, char **argv);
+};
+
+const struct command *command_find(const char *name);
+
+/*
+ * Binary frames, for 'pipe --binary'. Each frame is a length
+ * byte, counting what follows, then an opcode and its payload.
+ * 16 bit values are little endian. Glyphs are raw
+ * ip_usbph_digit/ip_usbph_char values.
+ */
+typedef enum {
+	OP_SYMBOL = 0x01,	/* symbol, on */
+	OP_DIGIT,		/* index, digit */
+	OP_TOP_CHAR,		/* index, char16 */
+	OP_BOT_CHAR,		/* index, char16 */
+	OP_DIGITS,		/* digit... from index 0 */
+	OP_TOP,			/* char16... from index 0 */
+	OP_BOT,			/* char16... from index 0 */
+	OP_CLEAR,
+	OP_BACKLIGHT,
+	OP_FLUSH,		/* Show everything now */
+	OP_COALESCE,		/* msec16 */
+} pipe_op;
+
+/* Apply every complete frame in 'buff'. The changes of one call
+ * are flushed together, as by session_update().
+ *
+ * Returns the number of bytes used.
+ */
+size_t command_frames(struct session *s, const uint8_t *buff, size_t len);
+void command_usage(FILE *out);
+const char *command_keyname(uint8_t keycode);
+
+/* Path of the daemon's UNIX socket
+ */
+void command_socket(char *path, size_t len);
+
+/* Load/save display state in ~/.ip-usbphrc. An rc file in
+ * the old text format is rewritten as a snapshot once loaded.
+ */
+void rc_load(struct ip_usbph *ph);
+void rc_save(struct ip_usbph *ph);
+
+/* Stop any 'trace' command, writing out what it has
+ */
+void trace_stop(struct ip_usbph *ph);
+
+#endif /* COMMANDS_H */
@@ -0,0 +1,438 @@
+/*
+ * Copyright 2009, Jason McMullan
+ * Author: Jason McMullan <jason.mcmullan@gmail.com>
+ *
+ * Licensed under the LGPL v2
+ */
+
+/*
+ * ip-usbphd - holds the phone open, and serves the ip-usbph
+ * command set over a UNIX socket.
+ *
+ * Protocol, per command: the client sends one line, quoted as
+ * for the ip-usbph shell. The daemon replies with the output of
+ * the command, a NUL, and the decimal result and a newline.
+ *
+ * After a "binary" line, the client sends only binary frames
+ * (see commands.h), and gets no replies.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "argv.h"
+#include "commands.h"
+
+#define ARRAY_SIZE(x) (sizeof(x)/sizeof(x[0]))
+
+#define CLIENTS		32	/* Most clients at once */
+#define USB_FDS		16	/* Most libusb file descriptors */
+
+struct client {
+	int fd;		/* -1 if the slot is free */
+	size_t len;
+	char line[1024];
+	int binary;	/* Sending binary frames, not lines */
+	int key_wait;	/* Waiting for a key press */
+	uint64_t key_deadline;	/* msec, 0 to wait forever */
+	struct session session;
+};
+
+static struct client clients[CLIENTS];
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static uint64_t now_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void client_close(struct client *c)
+{
+	/* Don't lose what it left held */
+	session_sync(&c->session);
+
+	close(c->fd);
+	c->fd = -1;
+}
+
+static void reply(struct client *c, const char *out, size_t len, int err)
+{
+	char status[16];
+	int n;
+
+	n = snprintf(status, sizeof(status), "%c%d\n", 0, err);
+
+	if ((len > 0 && send(c->fd, out, len, MSG_NOSIGNAL) != len) ||
+	    send(c->fd, status, n, MSG_NOSIGNAL) != n) {
+		client_close(c);
+	}
+}
+
+static void run(struct ip_usbph *ph, struct client *c, char *line)
+{
+	const struct command *cmd;
+	int argc, err;
+	char *argv[ARGV_MAX];
+	char *buff = NULL;
+	size_t size = 0;
+	FILE *out;
+
+	argc = argv_split(line, argv, ARGV_MAX);
+	if (argc < 0) {
+		reply(c, NULL, 0, -EINVAL);
+		return;
+	}
+
+	/* The rest of the connection is binary frames */
+	if (argc == 1 && strcmp(argv[0], "binary") == 0) {
+		c->binary = 1;
+		reply(c, NULL, 0, 0);
+		return;
+	}
+
+	cmd = (argc > 0) ? command_find(argv[0]) : NULL;
+	if (cmd == NULL) {
+		reply(c, NULL, 0, -EINVAL);
+	} else if (strcmp(cmd->name, "key") == 0) {
+		/* Never block the other clients - park this one
+		 * until a key comes in.
+		 */
+		if (argc > 2) {
+			reply(c, NULL, 0, -EINVAL);
+		} else {
+			int timeout = (argc == 2) ? strtol(argv[1], NULL, 0) : -1;
+
+			if (!c->session.batch)
+				session_sync(&c->session);
+
+			c->key_wait = 1;
+			c->key_deadline = (timeout >= 0) ? now_msec() + timeout : 0;
+		}
+	} else {
+		out = open_memstream(&buff, &size);
+		if (out == NULL) {
+			reply(c, NULL, 0, -ENOMEM);
+		} else {
+			c->session.out = out;
+			err = cmd->cmd(&c->session, argc, argv);
+			fclose(out);
+			c->session.out = NULL;
+			reply(c, buff, size, err);
+			free(buff);
+		}
+	}
+}
+
+/* Run every complete line the client has sent
+ */
+static void client_lines(struct ip_usbph *ph, struct client *c)
+{
+	char *nl;
+	size_t used;
+
+	while (c->fd >= 0 && !c->key_wait) {
+		if (c->binary) {
+			used = command_frames(&c->session, (uint8_t *)c->line, c->len);
+		} else {
+			nl = memchr(c->line, '\n', c->len);
+			if (nl == NULL)
+				break;
+
+			used = nl - c->line + 1;
+			*nl = 0;
+			run(ph, c, c->line);
+		}
+
+		c->len -= used;
+		memmove(c->line, c->line + used, c->len);
+
+		if (c->binary)
+			break;
+	}
+}
+
+static void client_read(struct ip_usbph *ph, struct client *c)
+{
+	ssize_t n;
+
+	n = read(c->fd, c->line + c->len, sizeof(c->line) - c->len);
+	if (n <= 0) {
+		client_close(c);
+		return;
+	}
+
+	c->len += n;
+	client_lines(ph, c);
+
+	/* A line that can't fit is a broken client */
+	if (c->fd >= 0 && c->len == sizeof(c->line))
+		client_close(c);
+}
+
+static void client_accept(struct ip_usbph *ph, int sock)
+{
+	int i, fd;
+
+	fd = accept(sock, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	for (i = 0; i < CLIENTS; i++) {
+		if (clients[i].fd < 0) {
+			memset(&clients[i], 0, sizeof(clients[i]));
+			clients[i].fd = fd;
+			clients[i].session.ph = ph;
+			return;
+		}
+	}
+
+	close(fd);
+}
+
+/* Hand key presses to everyone waiting for one, and
+ * expire the waits that have timed out.
+ */
+static void keys(struct ip_usbph *ph)
+{
+	struct ip_usbph_key_event ev[16];
+	uint64_t now;
+	int i, j, n;
+
+	do {
+		n = ip_usbph_keys_read(ph, ev, ARRAY_SIZE(ev));
+		for (i = 0; i < n; i++) {
+			char name[16];
+			int len;
+
+			if (!ev[i].pressed)
+				continue;
+
+			len = snprintf(name, sizeof(name), "%s\n", command_keyname(ev[i].keycode));
+			for (j = 0; j < CLIENTS; j++) {
+				if (clients[j].fd >= 0 && clients[j].key_wait) {
+					clients[j].key_wait = 0;
+					reply(&clients[j], name, len, 0);
+				}
+			}
+		}
+	} while (n == ARRAY_SIZE(ev));
+
+	now = now_msec();
+	for (j = 0; j < CLIENTS; j++) {
+		struct client *c = &clients[j];
+
+		if (c->fd < 0 || !c->key_wait)
+			continue;
+
+		if (n < 0) {
+			c->key_wait = 0;
+			reply(c, NULL, 0, -EIO);
+		} else if (c->key_deadline != 0 && now >= c->key_deadline) {
+			c->key_wait = 0;
+			reply(c, NULL, 0, -ETIMEDOUT);
+		}
+
+		/* Anything sent while it was waiting */
+		if (!c->key_wait)
+			client_lines(ph, c);
+	}
+}
+
+/* Milliseconds to the next key wait timeout or held
+ * update, or -1
+ */
+static int client_timeout(void)
+{
+	uint64_t now = now_msec();
+	int i, wait = -1;
+
+	for (i = 0; i < CLIENTS; i++) {
+		struct client *c = &clients[i];
+		int left;
+
+		if (c->fd < 0)
+			continue;
+
+		left = session_timeout(&c->session);
+		if (left >= 0 && (wait < 0 || left < wait))
+			wait = left;
+
+		if (!c->key_wait || c->key_deadline == 0)
+			continue;
+
+		left = (c->key_deadline > now) ? c->key_deadline - now : 0;
+		if (wait < 0 || left < wait)
+			wait = left;
+	}
+
+	return wait;
+}
+
+static int listen_on(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int sock;
+
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -errno;
+
+	/* Only replace a socket nobody is answering on */
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		close(sock);
+		return -EADDRINUSE;
+	}
+	unlink(path);
+
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    chmod(path, 0600) < 0 ||
+	    listen(sock, CLIENTS) < 0) {
+		int err = -errno;
+		close(sock);
+		return err;
+	}
+
+	return sock;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage:\n"
+			"%s [-d] [-s <socket>]\n\n"
+			"-d                        Detach from the terminal\n"
+			"-s <socket>               Listen on <socket>\n",
+			prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct pollfd fds[1 + CLIENTS + USB_FDS];
+	struct sigaction sa = { .sa_handler = on_signal };
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	struct ip_usbph *ph;
+	int detach = 0;
+	int i, c, sock;
+
+	command_socket(path, sizeof(path));
+
+	while ((c = getopt(argc, argv, "ds:")) != -1) {
+		switch (c) {
+		case 'd':
+			detach = 1;
+			break;
+		case 's':
+			snprintf(path, sizeof(path), "%s", optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	sock = listen_on(path);
+	if (sock < 0) {
+		errno = -sock;
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	/* Before the device is opened - the child would not
+	 * inherit libusb's threads.
+	 */
+	if (detach && daemon(1, 0) < 0) {
+		perror("daemon");
+		return EXIT_FAILURE;
+	}
+
+	ph = ip_usbph_acquire(0);
+	if (ph == NULL) {
+		fprintf(stderr, "Can't find the IP-USBPH device. Is it plugged in?\n");
+		close(sock);
+		unlink(path);
+		return EXIT_FAILURE;
+	}
+
+	rc_load(ph);
+	ip_usbph_flush(ph);
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < CLIENTS; i++)
+		clients[i].fd = -1;
+
+	while (!stop) {
+		int n, nusb, wait, left;
+
+		n = 0;
+		fds[n].fd = sock;
+		fds[n++].events = POLLIN;
+		for (i = 0; i < CLIENTS; i++) {
+			fds[n].fd = clients[i].fd;
+			fds[n++].events = POLLIN;
+		}
+
+		nusb = ip_usbph_get_pollfds(ph, &fds[n], USB_FDS);
+		if (nusb > 0)
+			n += nusb;
+
+		wait = ip_usbph_next_timeout(ph);
+		left = client_timeout();
+		if (left >= 0 && (wait < 0 || left < wait))
+			wait = left;
+
+		if (poll(fds, n, wait) < 0 && errno != EINTR)
+			break;
+
+		ip_usbph_handle_events_nonblocking(ph);
+		keys(ph);
+
+		for (i = 0; i < CLIENTS; i++) {
+			if (clients[i].fd >= 0)
+				session_run(&clients[i].session);
+		}
+
+		for (i = 0; i < CLIENTS; i++) {
+			if (clients[i].fd >= 0 && (fds[1 + i].revents & (POLLIN | POLLHUP | POLLERR)))
+				client_read(ph, &clients[i]);
+		}
+
+		if (fds[0].revents & POLLIN)
+			client_accept(ph, sock);
+	}
+
+	for (i = 0; i < CLIENTS; i++) {
+		if (clients[i].fd >= 0)
+			client_close(&clients[i]);
+	}
+
+	close(sock);
+	unlink(path);
+
+	trace_stop(ph);
+	rc_save(ph);
+	ip_usbph_release(ph);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,604 @@
+/*
+ * Copyright 2009, Jason McMullan
+ * Author: Jason McMullan <jason.mcmullan@gmail.com>
+ *
+ * Licensed under the LGPL v2
+ */
+
+/*
+ * hidraw transport - the phone through the kernel's HID driver,
+ * which stays bound, with plain file descriptor I/O.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+
+#include "ip-usbph.h"
+#include "ip-usbph-private.h"
+
+#define HIDRAW_MAX	64	/* The kernel's HIDRAW_MAX_DEVICES */
+
+struct hid {
+	struct transport t;
+	int fd;			/* -1 while the device is away */
+	int wake[2];		/* interrupt() pipe */
+	int notify;		/* Report fd changes with ph_pollfd() */
+
+	/* Reports waiting to be written, or to complete */
+	struct {
+		int busy;
+		int done;	/* Written, or failed with 'err' */
+		int err;
+		uint64_t due_ns;
+		uint8_t packet[8];
+	} out[SLOTS];
+	struct {
+		int busy;
+		int err;	/* -ECANCELED once cancelled */
+	} read;
+};
+
+#define to_hid(tp)	((struct hid *)(tp))
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* When a report still not written gives up - never, without a timeout */
+static uint64_t hid_timeout(int timeout_msec)
+{
+	if (timeout_msec == 0)
+		return UINT64_MAX;
+
+	return now_ns() + timeout_msec * 1000000ULL;
+}
+
+/* A phone that has gone away fails writes with ENODEV - or, for
+ * a stand-in whose other end has closed, EPIPE.
+ */
+static int hid_errno(int err)
+{
+	switch (err) {
+	case ENODEV:
+	case ENXIO:
+	case EPIPE:
+	case ECONNRESET:
+		return -ENODEV;
+	default:
+		return -err;
+	}
+}
+
+/* Path of the phone behind a hidraw node's sysfs device, which
+ * resolves to ".../<bus>-<port>.<port>:<config>.<interface>/
+ * 0003:04D9:0602.<n>" - a USB HID device, with our vendor and
+ * product, on interface 3. -ENODEV for anything else.
+ */
+static int hid_sysfs_path(const char *device, char *path, size_t len)
+{
+	unsigned bus, vendor, product, config, iface;
+	char real[PATH_MAX], *dev, *intf, *colon;
+
+	if (realpath(device, real) == NULL)
+		return -ENODEV;
+
+	dev = strrchr(real, '/');
+	if (dev == NULL || sscanf(dev + 1, "%x:%x:%x.", &bus, &vendor, &product) != 3 ||
+	    bus != 0x0003 || vendor != 0x04d9 || product != 0x0602)
+		return -ENODEV;
+	*dev = 0;
+
+	intf = strrchr(real, '/');
+	if (intf == NULL)
+		return -ENODEV;
+	intf++;
+
+	colon = strchr(intf, ':');
+	if (colon == NULL || sscanf(colon + 1, "%u.%u", &config, &iface) != 2 || iface != 3)
+		return -ENODEV;
+
+	if (colon - intf >= len)
+		return -ENAMETOOLONG;
+
+	memcpy(path, intf, colon - intf);
+	path[colon - intf] = 0;
+
+	return 0;
+}
+
+/* Path of the phone at /dev/hidraw<n>, if it is one
+ */
+static int hid_node_path(int n, char *path, size_t len)
+{
+	char device[64];
+
+	snprintf(device, sizeof(device), "/sys/class/hidraw/hidraw%d/device", n);
+
+	return hid_sysfs_path(device, path, len);
+}
+
+static int hid_node_open(int n)
+{
+	char node[32];
+	int fd;
+
+	snprintf(node, sizeof(node), "/dev/hidraw%d", n);
+
+	fd = open(node, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+	return (fd < 0) ? -errno : fd;
+}
+
+static void hid_attach(struct hid *h, int fd)
+{
+	h->fd = fd;
+	if (h->notify)
+		ph_pollfd(h->t.ph, fd, POLLIN);
+}
+
+static void hid_close(struct hid *h)
+{
+	if (h->fd < 0)
+		return;
+
+	if (h->notify)
+		ph_pollfd(h->t.ph, h->fd, 0);
+	close(h->fd);
+	h->fd = -1;
+
+	memset(h->out, 0, sizeof(h->out));
+	memset(&h->read, 0, sizeof(h->read));
+}
+
+static void hid_free(struct transport *t)
+{
+	struct hid *h = to_hid(t);
+
+	hid_close(h);
+	close(h->wake[0]);
+	close(h->wake[1]);
+	free(h);
+}
+
+/* Find the phone at our path again
+ */
+static int hid_reopen(struct transport *t)
+{
+	struct hid *h = to_hid(t);
+	const char *want = ip_usbph_path(t->ph);
+	char path[IP_USBPH_PATH_MAX];
+	int i, fd;
+
+	hid_close(h);
+
+	for (i = 0; i < HIDRAW_MAX; i++) {
+		if (hid_node_path(i, path, sizeof(path)) < 0 || strcmp(path, want) != 0)
+			continue;
+
+		fd = hid_node_open(i);
+		if (fd < 0)
+			return (fd == -ENOENT) ? -ENODEV : fd;
+
+		hid_attach(h, fd);
+		return 0;
+	}
+
+	return -ENODEV;
+}
+
+/* A report is an output report of its own, the first byte being
+ * its report ID - the same SET_REPORT the USB transport sends.
+ */
+static int hid_control(struct transport *t, const uint8_t packet[8], int timeout_msec)
+{
+	struct hid *h = to_hid(t);
+	struct pollfd pfd;
+	ssize_t len;
+
+	if (h->fd < 0)
+		return -ENODEV;
+
+	pfd.fd = h->fd;
+	pfd.events = POLLOUT;
+
+	for (;;) {
+		len = write(h->fd, packet, 8);
+		if (len == 8)
+			return 0;
+		if (len >= 0)
+			return -EIO;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN)
+			return hid_errno(errno);
+
+		if (poll(&pfd, 1, (timeout_msec == 0) ? -1 : timeout_msec) == 0)
+			return -ETIMEDOUT;
+	}
+}
+
+/* Queued, and written by the next handle_events(), together with
+ * whatever else was submitted before it.
+ */
+static int hid_submit(struct transport *t, int code, const uint8_t packet[8], int timeout_msec)
+{
+	struct hid *h = to_hid(t);
+
+	if (h->fd < 0)
+		return -ENODEV;
+
+	h->out[code].busy = 1;
+	h->out[code].done = 0;
+	h->out[code].err = 0;
+	h->out[code].due_ns = hid_timeout(timeout_msec);
+	memcpy(h->out[code].packet, packet, 8);
+
+	return 0;
+}
+
+static void hid_cancel(struct transport *t, int code)
+{
+	struct hid *h = to_hid(t);
+
+	if (h->out[code].busy && !h->out[code].done) {
+		h->out[code].done = 1;
+		h->out[code].err = -ECANCELED;
+	}
+}
+
+static int hid_read(struct transport *t)
+{
+	struct hid *h = to_hid(t);
+
+	if (h->fd < 0)
+		return -ENODEV;
+
+	h->read.busy = 1;
+	h->read.err = 0;
+
+	return 0;
+}
+
+static void hid_read_cancel(struct transport *t)
+{
+	struct hid *h = to_hid(t);
+
+	if (h->read.busy)
+		h->read.err = -ECANCELED;
+}
+
+/* Write every queued report with one writev() - hidraw takes
+ * each iovec as a report of its own. It sends each before
+ * returning, O_NONBLOCK or not, so this blocks for as long as
+ * the driver takes; the transfer timeout can't interrupt it.
+ */
+static void hid_write(struct hid *h)
+{
+	struct iovec iov[SLOTS];
+	int code[SLOTS];
+	uint64_t now = now_ns();
+	ssize_t len;
+	int i, n, err;
+
+	for (i = n = 0; i < SLOTS; i++) {
+		if (!h->out[i].busy || h->out[i].done)
+			continue;
+
+		if (now >= h->out[i].due_ns) {
+			h->out[i].done = 1;
+			h->out[i].err = -ETIMEDOUT;
+			continue;
+		}
+
+		iov[n].iov_base = h->out[i].packet;
+		iov[n].iov_len = 8;
+		code[n++] = i;
+	}
+
+	if (n == 0)
+		return;
+
+	len = writev(h->fd, iov, n);
+	err = (len < 0) ? errno : 0;
+
+	for (i = 0; i < n; i++) {
+		if (len >= (i + 1) * 8) {
+			h->out[code[i]].done = 1;
+		} else if (len < 0 && err != EAGAIN && err != EINTR) {
+			h->out[code[i]].done = 1;
+			h->out[code[i]].err = hid_errno(err);
+		}
+	}
+}
+
+/* Complete whatever is done. A completion may start another
+ * transfer, so each is cleared before it is called.
+ * Returns the number completed.
+ */
+static int hid_complete(struct hid *h)
+{
+	uint8_t report[8];
+	ssize_t len;
+	int i, err, n = 0;
+
+	if (h->fd >= 0)
+		hid_write(h);
+
+	for (i = 0; i < SLOTS; i++) {
+		if (!h->out[i].busy || !h->out[i].done)
+			continue;
+
+		h->out[i].busy = 0;
+		ph_flush_done(h->t.ph, i, h->out[i].err);
+		n++;
+	}
+
+	if (!h->read.busy)
+		return n;
+
+	err = h->read.err;
+	len = 8;
+	if (err == 0) {
+		len = read(h->fd, report, sizeof(report));
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			return n;
+
+		/* An unplugged node reads EIO, and a stand-in EOF */
+		if (len < 0)
+			err = (errno == EIO) ? -ENODEV : hid_errno(errno);
+		else if (len == 0)
+			err = -ENODEV;
+	}
+
+	h->read.busy = 0;
+	ph_key_done(h->t.ph, err, (err == 0 && len == 8) ? report : NULL);
+
+	return n + 1;
+}
+
+static int hid_handle_events(struct transport *t, int timeout_msec, int *completed)
+{
+	struct hid *h = to_hid(t);
+	uint64_t deadline = 0;
+	char drain[16];
+
+	if (timeout_msec >= 0)
+		deadline = now_ns() + timeout_msec * 1000000ULL;
+
+	for (;;) {
+		struct pollfd fds[2];
+		uint64_t now, due = UINT64_MAX;
+		int i, wait;
+
+		if (hid_complete(h) > 0)
+			break;
+
+		if (completed != NULL && __atomic_load_n(completed, __ATOMIC_ACQUIRE))
+			break;
+
+		now = now_ns();
+		if (timeout_msec >= 0 && now >= deadline)
+			break;
+
+		fds[0].fd = -1;
+		fds[0].events = 0;
+		for (i = 0; i < SLOTS; i++) {
+			if (h->out[i].busy) {
+				fds[0].events |= POLLOUT;
+				if (h->out[i].due_ns < due)
+					due = h->out[i].due_ns;
+			}
+		}
+		if (h->read.busy)
+			fds[0].events |= POLLIN;
+		if (fds[0].events != 0)
+			fds[0].fd = h->fd;
+
+		fds[1].fd = h->wake[0];
+		fds[1].events = POLLIN;
+
+		if (timeout_msec >= 0 && deadline < due)
+			due = deadline;
+		if (due == UINT64_MAX)
+			wait = -1;
+		else if (due <= now)
+			wait = 0;
+		else
+			wait = (due - now + 999999) / 1000000;
+
+		if (poll(fds, 2, wait) < 0 && errno != EINTR)
+			return -errno;
+
+		if (fds[1].revents & POLLIN) {
+			while (read(h->wake[0], drain, sizeof(drain)) > 0)
+				;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static void hid_interrupt(struct transport *t)
+{
+	if (write(to_hid(t)->wake[1], "", 1) < 0) {
+		/* Full - a wakeup is already pending */
+	}
+}
+
+static int hid_get_pollfds(struct transport *t, struct pollfd *fds, int max)
+{
+	struct hid *h = to_hid(t);
+
+	if (h->fd < 0)
+		return 0;
+
+	if (fds == NULL)
+		return 1;
+
+	if (max < 1)
+		return -ENOSPC;
+
+	fds[0].fd = h->fd;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+
+	return 1;
+}
+
+static void hid_set_pollfd_notifier(struct transport *t, int enable)
+{
+	to_hid(t)->notify = enable;
+}
+
+/* Queued reports go out on the next handle_events(), at once
+ */
+static int hid_next_timeout(struct transport *t)
+{
+	struct hid *h = to_hid(t);
+	int i;
+
+	for (i = 0; i < SLOTS; i++) {
+		if (h->out[i].busy)
+			return 0;
+	}
+
+	return (h->read.busy && h->read.err != 0) ? 0 : -1;
+}
+
+static const struct transport_ops hid_ops = {
+	.name = "hidraw",
+	.free = hid_free,
+	.reopen = hid_reopen,
+	.control = hid_control,
+	.submit = hid_submit,
+	.cancel = hid_cancel,
+	.read = hid_read,
+	.read_cancel = hid_read_cancel,
+	.handle_events = hid_handle_events,
+	.interrupt = hid_interrupt,
+	.get_pollfds = hid_get_pollfds,
+	.set_pollfd_notifier = hid_set_pollfd_notifier,
+	.next_timeout = hid_next_timeout,
+};
+
+/* A descriptor that is not a phone's node stands in for one, so
+ * there is no device to profile.
+ */
+static const struct transport_ops hid_fd_ops = {
+	.name = "hidraw",
+	.simulated = 1,
+	.free = hid_free,
+	.reopen = hid_reopen,
+	.control = hid_control,
+	.submit = hid_submit,
+	.cancel = hid_cancel,
+	.read = hid_read,
+	.read_cancel = hid_read_cancel,
+	.handle_events = hid_handle_events,
+	.interrupt = hid_interrupt,
+	.get_pollfds = hid_get_pollfds,
+	.set_pollfd_notifier = hid_set_pollfd_notifier,
+	.next_timeout = hid_next_timeout,
+};
+
+/* On failure, 'fd' is still the caller's
+ */
+static struct ip_usbph *hid_new(const struct transport_ops *ops, int fd,
+                                const char *path)
+{
+	struct ip_usbph *ph;
+	struct hid *h;
+
+	h = calloc(1, sizeof(*h));
+	if (h == NULL)
+		return NULL;
+
+	if (pipe(h->wake) < 0) {
+		free(h);
+		return NULL;
+	}
+	fcntl(h->wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(h->wake[1], F_SETFL, O_NONBLOCK);
+	fcntl(h->wake[0], F_SETFD, FD_CLOEXEC);
+	fcntl(h->wake[1], F_SETFD, FD_CLOEXEC);
+
+	h->t.ops = ops;
+	h->fd = fd;
+
+	ph = ph_new(&h->t, path);
+	if (ph == NULL) {
+		h->fd = -1;
+		hid_free(&h->t);
+	}
+
+	return ph;
+}
+
+struct ip_usbph *ip_usbph_hidraw_new(int fd)
+{
+	const struct transport_ops *ops = &hid_fd_ops;
+	char device[64], path[IP_USBPH_PATH_MAX] = "fd";
+	struct stat st;
+	int flags;
+
+	if (fstat(fd, &st) < 0)
+		return NULL;
+
+	/* A device node must be a phone's; anything else stands in */
+	if (S_ISCHR(st.st_mode)) {
+		snprintf(device, sizeof(device), "/sys/dev/char/%u:%u/device",
+		         major(st.st_rdev), minor(st.st_rdev));
+		if (hid_sysfs_path(device, path, sizeof(path)) < 0)
+			return NULL;
+		ops = &hid_ops;
+	}
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return NULL;
+
+	return hid_new(ops, fd, path);
+}
+
+struct ip_usbph *ip_usbph_hidraw_acquire(int index)
+{
+	char path[IP_USBPH_PATH_MAX];
+	struct ip_usbph *ph = NULL;
+	int i, fd;
+
+	for (i = 0; i < HIDRAW_MAX; i++) {
+		if (hid_node_path(i, path, sizeof(path)) < 0)
+			continue;
+
+		if (index > 0) {
+			index--;
+			continue;
+		}
+
+		fd = hid_node_open(i);
+		if (fd < 0)
+			continue;
+
+		ph = hid_new(&hid_ops, fd, path);
+		if (ph != NULL)
+			break;
+		close(fd);
+	}
+
+	return ph;
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright 2007, Jason McMullan
+ * Author: Jason McMullan <jason.mcmullan@gmail.com>
+ *
+ * Licensed under the LGPL v2
+ */
+
+/*
+ * Library internals - not installed.
+ */
+
+#ifndef IP_USBPH_PRIVATE_H
+#define IP_USBPH_PRIVATE_H
+
+#include <stdint.h>
+
+/* Display packets, by their header bytes
+ */
+typedef enum {
+	CODE_C1_40 = 1,
+	CODE_C1_45,
+	CODE_C1_4A,
+	CODE_C1_4F,
+	CODE_C1_54,
+	CODE_C1_59,
+	CODE_61_5E,
+	CODE_MAX,
+} code_id;
+
+#define CODES	(CODE_MAX - 1)
+
+/* Transfer slots: one per display code, then one for any other
+ * packet, such as the init packet sent on reconnect.
+ */
+#define SLOT_RAW	CODES
+#define SLOTS		(CODES + 1)
+
+/* Every display packet, with a blank payload
+ */
+static const uint8_t code_set[CODES][8] = {
+	{ 0x02, 0xC1, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, },
+	{ 0x02, 0xC1, 0x45, 0x00, 0x00, 0x00, 0x00, 0x00, },
+	{ 0x02, 0xC1, 0x4A, 0x00, 0x00, 0x00, 0x00, 0x00, },
+	{ 0x02, 0xC1, 0x4F, 0x00, 0x00, 0x00, 0x00, 0x00, },
+	{ 0x02, 0xC1, 0x54, 0x00, 0x00, 0x00, 0x00, 0x00, },
+	{ 0x02, 0xC1, 0x59, 0x00, 0x00, 0x00, 0x00, 0x00, },
+	{ 0x02, 0x61, 0x5E, 0x00, 0x00, 0x00, 0x00, 0x00, },
+};
+
+/* A display packet, loaded as a little-endian 64 bit word.
+ * Payload bit 'bit' (byte 3 + bit/8, bit % 8) is word bit 24 + bit.
+ */
+#define PACKET_BIT(bit)	(1ULL << (24 + (bit)))
+
+/*
+ * Glyph lookup table for one digit or character position.
+ *
+ * A position is spread over at most two packets. For each one,
+ * 'clear' holds every bit the position owns, and 'set' holds the
+ * bits to light for each nibble value of the glyph.
+ *
+ * The tables are generated at build time by mkglyphtab.
+ */
+struct glyph_lut {
+	uint8_t code[2];	/* code_id, or 0 if unused */
+	uint64_t clear[2];
+	uint64_t set[2][4][16];
+};
+
+/*
+ * Transports - how packets get to the phone.
+ *
+ * All calls return 0 or a -errno, and are made from the thread
+ * handling events, except interrupt(), which may be made from
+ * any thread.
+ *
+ * control() sends a packet and waits for it. submit() puts the
+ * packet for display code 'code' (0 to 6), or any other packet
+ * for SLOT_RAW, on the wire, with at most one in flight per slot,
+ * and completes with ph_flush_done().
+ * Both give up on the device after 'timeout_msec' (0 is never),
+ * with -ETIMEDOUT.
+ * read() starts a read of one key report, which completes with
+ * ph_key_done(). Completions are only ever called from within
+ * handle_events(), never from the call that started the
+ * transfer, and cancelled transfers still complete, with
+ * -ECANCELED.
+ *
+ * handle_events() runs completions, waiting up to 'timeout_msec'
+ * (-1 is forever) for one, or until '*completed' is set or
+ * interrupt() is called. next_timeout() is the msec until the
+ * transport needs handle_events() without any fd being ready,
+ * or -1.
+ *
+ * reopen() finds the device at the handle's path again, after
+ * it was lost.
+ *
+ * 'simulated' transports have no device to profile, so their
+ * profiles are never cached.
+ */
+struct ip_usbph;
+struct pollfd;
+struct transport;
+
+struct transport_ops {
+	const char *name;
+	int simulated;	/* No real device behind the path */
+	void (*free)(struct transport *t);
+	int (*reopen)(struct transport *t);
+	int (*control)(struct transport *t, const uint8_t packet[8], int timeout_msec);
+	int (*submit)(struct transport *t, int code, const uint8_t packet[8], int timeout_msec);
+	void (*cancel)(struct transport *t, int code);
+	int (*read)(struct transport *t);
+	void (*read_cancel)(struct transport *t);
+	int (*handle_events)(struct transport *t, int timeout_msec, int *completed);
+	void (*interrupt)(struct transport *t);
+	int (*get_pollfds)(struct transport *t, struct pollfd *fds, int max);
+	void (*set_pollfd_notifier)(struct transport *t, int enable);
+	int (*next_timeout)(struct transport *t);
+};
+
+struct transport {
+	const struct transport_ops *ops;
+	struct ip_usbph *ph;
+	int shared;	/* Events handled with other handles' */
+};
+
+/* Core side of a transport.
+ *
+ * ph_new() wraps a transport in a new handle, and sets up the
+ * device. The handle frees the transport on release; if ph_new()
+ * fails, the transport is still the caller's. 'report' is NULL
+ * for a read that completed without a whole report.
+ */
+struct ip_usbph *ph_new(struct transport *t, const char *path);
+struct transport *ph_transport(struct ip_usbph *ph);
+void ph_flush_done(struct ip_usbph *ph, int code, int err);
+void ph_key_done(struct ip_usbph *ph, int err, const uint8_t *report);
+void ph_pollfd(struct ip_usbph *ph, int fd, short events);
+
+#endif /* IP_USBPH_PRIVATE_H */
@@ -0,0 +1,272 @@
+/*
+ * Copyright 2007, Jason McMullan
+ * Author: Jason McMullan <jason.mcmullan@gmail.com>
+ *
+ * Licensed under the LGPL v2
+ */
+
+/*
+ * Where each symbol, digit and character segment lives in the
+ * display packets. The digit and character maps build the glyph
+ * lookup tables (see mkglyphtab.c), and decode them again in the
+ * simulated phone.
+ */
+
+#ifndef IP_USBPH_SEGMAP_H
+#define IP_USBPH_SEGMAP_H
+
+#include "ip-usbph.h"
+#include "ip-usbph-private.h"
+
+static const struct {
+	int code;
+	int bit;
+} font_symbol[] = {
+	[IP_USBPH_SYMBOL_DOWN] = { .code = CODE_C1_40, .bit = 21 },
+	[IP_USBPH_SYMBOL_UP] =   { .code = CODE_C1_40, .bit = 22 },
+	[IP_USBPH_SYMBOL_SAT] =  { .code = CODE_C1_45, .bit =  7 },
+	[IP_USBPH_SYMBOL_COLON] = {.code = CODE_C1_4A, .bit =  5 },
+	[IP_USBPH_SYMBOL_FRI] =  { .code = CODE_C1_4A, .bit =  6 },
+	[IP_USBPH_SYMBOL_THU] =  { .code = CODE_C1_4A, .bit =  7 },
+	[IP_USBPH_SYMBOL_M_AND_D]={.code = CODE_C1_4F, .bit =  5 },
+	[IP_USBPH_SYMBOL_TUE] =  { .code = CODE_C1_4F, .bit =  6 },
+	[IP_USBPH_SYMBOL_WED] =  { .code = CODE_C1_4F, .bit =  7 },
+	[IP_USBPH_SYMBOL_MON] =  { .code = CODE_C1_4F, .bit = 30 },
+	[IP_USBPH_SYMBOL_SUN] =  { .code = CODE_C1_4F, .bit = 31 },
+	[IP_USBPH_SYMBOL_OUT] =  { .code = CODE_C1_54, .bit = 29 },
+	[IP_USBPH_SYMBOL_IN] =   { .code = CODE_C1_54, .bit = 30 },
+	[IP_USBPH_SYMBOL_NEW] =  { .code = CODE_C1_54, .bit = 39 },
+	[IP_USBPH_SYMBOL_MUTE] = { .code = CODE_C1_59, .bit =  7 },
+	[IP_USBPH_SYMBOL_LOCK] = { .code = CODE_C1_59, .bit = 15 },
+	[IP_USBPH_SYMBOL_MAN]  = { .code = CODE_C1_59, .bit = 23 },
+	[IP_USBPH_SYMBOL_BALANCE]={.code = CODE_C1_59, .bit = 31 },
+	[IP_USBPH_SYMBOL_DECIMAL]={.code = CODE_61_5E, .bit =  7 },
+};
+
+#define SEG_T	0
+#define SEG_B	1
+#define SEG_TL	2
+#define SEG_TR	3
+#define SEG_BL	4
+#define SEG_BR	5
+#define SEG_M	6
+#define SEG_E	7
+
+static const struct {
+	code_id code;
+	int bit;
+} xref_digit_segment[11][8] = {
+	[0] = {
+		[SEG_E] = { .code = CODE_C1_54, .bit = 31 },
+	},
+	[1] = {
+		[SEG_BR] = { .code = CODE_C1_54, .bit = 13 },
+		[SEG_M] = { .code = CODE_C1_54, .bit = 14 },
+		[SEG_TR] = { .code = CODE_C1_54, .bit = 15 },
+		[SEG_T] = { .code = CODE_C1_54, .bit = 16 },
+		[SEG_B] = { .code = CODE_C1_54, .bit = 21 },
+		[SEG_BL] = { .code = CODE_C1_54, .bit = 22 },
+		[SEG_TL] = { .code = CODE_C1_54, .bit = 23 },
+	},
+	[2] = {
+		[SEG_T] = { .code = CODE_C1_4F, .bit = 32 },
+		[SEG_B] = { .code = CODE_C1_4F, .bit = 37 },
+		[SEG_BR] = { .code = CODE_C1_4F, .bit = 38 },
+		[SEG_TR] = { .code = CODE_C1_4F, .bit = 39 },
+		[SEG_BL] = { .code = CODE_C1_54, .bit = 5 },
+		[SEG_M] = { .code = CODE_C1_54, .bit = 6 },
+		[SEG_TL] = { .code = CODE_C1_54, .bit = 7 },
+	},
+	[3] = {
+		[SEG_E] = { .code = CODE_C1_4F, .bit = 29 },
+	},
+	[4] = {
+		[SEG_T] = { .code = CODE_C1_4F, .bit = 8 },
+		[SEG_B] = { .code = CODE_C1_4F, .bit = 13 },
+		[SEG_BR] = { .code = CODE_C1_4F, .bit = 14 },
+		[SEG_TR] = { .code = CODE_C1_4F, .bit = 15 },
+		[SEG_BL] = { .code = CODE_C1_4F, .bit = 21 },
+		[SEG_M] = { .code = CODE_C1_4F, .bit = 22 },
+		[SEG_TL] = { .code = CODE_C1_4F, .bit = 23 },
+	},
+	[5] = {
+		[SEG_BL] = { .code = CODE_C1_40, .bit = 5 },
+		[SEG_M] = { .code = CODE_C1_40, .bit = 6 },
+		[SEG_TL] = { .code = CODE_C1_40, .bit = 7 },
+		[SEG_T] = { .code = CODE_C1_40, .bit = 8 },
+		[SEG_B] = { .code = CODE_C1_40, .bit = 13 },
+		[SEG_BR] = { .code = CODE_C1_40, .bit = 14 },
+		[SEG_TR] = { .code = CODE_C1_40, .bit = 15 },
+	},
+	[6] = {
+		[SEG_BL] = { .code = CODE_C1_40, .bit = 29 },
+		[SEG_M] = { .code = CODE_C1_40, .bit = 30 },
+		[SEG_TL] = { .code = CODE_C1_40, .bit = 31 },
+		[SEG_T] = { .code = CODE_C1_40, .bit = 32 },
+		[SEG_B] = { .code = CODE_C1_40, .bit = 37 },
+		[SEG_BR] = { .code = CODE_C1_40, .bit = 38 },
+		[SEG_TR] = { .code = CODE_C1_40, .bit = 39 },
+	},
+	[7] = {
+		[SEG_T] = { .code = CODE_C1_4A, .bit = 24 },
+		[SEG_B] = { .code = CODE_C1_4A, .bit = 29 },
+		[SEG_BR] = { .code = CODE_C1_4A, .bit = 30 },
+		[SEG_TR] = { .code = CODE_C1_4A, .bit = 31 },
+		[SEG_BL] = { .code = CODE_C1_4A, .bit = 37 },
+		[SEG_M] = { .code = CODE_C1_4A, .bit = 38 },
+		[SEG_TL] = { .code = CODE_C1_4A, .bit = 39 },
+	},
+	[8] = {
+		[SEG_T] = { .code = CODE_C1_4A, .bit = 8 },
+		[SEG_B] = { .code = CODE_C1_4A, .bit = 13 },
+		[SEG_BR] = { .code = CODE_C1_4A, .bit = 14 },
+		[SEG_TR] = { .code = CODE_C1_4A, .bit = 15 },
+		[SEG_BL] = { .code = CODE_C1_4A, .bit = 21 },
+		[SEG_M] = { .code = CODE_C1_4A, .bit = 22 },
+		[SEG_TL] = { .code = CODE_C1_4A, .bit = 23 },
+	},
+	[9] = {
+		[SEG_T] = { .code = CODE_C1_45, .bit = 24 },
+		[SEG_B] = { .code = CODE_C1_45, .bit = 29 },
+		[SEG_BR] = { .code = CODE_C1_45, .bit = 30 },
+		[SEG_TR] = { .code = CODE_C1_45, .bit = 31 },
+		[SEG_BL] = { .code = CODE_C1_45, .bit = 37 },
+		[SEG_M] = { .code = CODE_C1_45, .bit = 38 },
+		[SEG_TL] = { .code = CODE_C1_45, .bit = 39 },
+	},
+	[10] = {
+		[SEG_T] = { .code = CODE_C1_45, .bit = 6 },
+		[SEG_B] = { .code = CODE_C1_45, .bit = 13 },
+		[SEG_BR] = { .code = CODE_C1_45, .bit = 14 },
+		[SEG_TR] = { .code = CODE_C1_45, .bit = 15 },
+		[SEG_BL] = { .code = CODE_C1_45, .bit = 21 },
+		[SEG_M] = { .code = CODE_C1_45, .bit = 22 },
+		[SEG_TL] = { .code = CODE_C1_45, .bit = 23 },
+	},
+};
+
+/*
+ * SEG0 - B  / BC  / TC / T
+ * SEG1 - BR / BRX / RC / TRX / TR
+ * SEG2 - BL / BLX / LC / TLX / TL
+ */
+static const struct {
+	code_id code;
+	int bit;
+} top_char_seg[][3] = {
+	[0] = {
+		{ .code = CODE_C1_54, .bit = 17 },
+		{ .code = CODE_C1_54, .bit = 8 },
+		{ .code = CODE_C1_54, .bit = 24 },
+	},
+	[1] = {
+		{ .code = CODE_C1_4F, .bit = 33 },
+		{ .code = CODE_C1_4F, .bit = 24 },
+		{ .code = CODE_C1_54, .bit =  0 },
+	},
+	[2] = {
+		{ .code = CODE_C1_4F, .bit =  9 },
+		{ .code = CODE_C1_4F, .bit =  0 },
+		{ .code = CODE_C1_4F, .bit = 16 },
+	},
+	[3] = {
+		{ .code = CODE_C1_40, .bit =  9 },
+		{ .code = CODE_C1_40, .bit = 16 },
+		{ .code = CODE_C1_40, .bit =  0 },
+	},
+	[4] = {
+		{ .code = CODE_C1_40, .bit = 33 },
+		{ .code = CODE_C1_4A, .bit = 32 },
+		{ .code = CODE_C1_40, .bit = 24 },
+	},
+	[5] = {
+		{ .code = CODE_C1_4A, .bit = 25 },
+		{ .code = CODE_C1_4A, .bit = 16 },
+		{ .code = CODE_C1_45, .bit =  0 },
+	},
+	[6] = {
+		{ .code = CODE_C1_4A, .bit =  9 },
+		{ .code = CODE_C1_4A, .bit =  0 },
+		{ .code = CODE_C1_45, .bit =  8 },
+	},
+	[7] = {
+		{ .code = CODE_C1_45, .bit = 25 },
+		{ .code = CODE_C1_45, .bit = 16 },
+		{ .code = CODE_C1_45, .bit = 32 },
+	},
+};
+
+/*
+ * SEG0 - B  / BC  / TC / T
+ * SEG1 - BR / BRX / RC / TRX / TR
+ * SEG2 - BL / BLX / LC / TLX / TL
+ */
+static const struct {
+	ip_usbph_char mask;
+	int seg;
+	int bit;
+} top_seg_map[14] = {
+	{ .mask = IP_USBPH_SEG_B,   .seg = 0, .bit = 0 },
+	{ .mask = IP_USBPH_SEG_BC,  .seg = 0, .bit = 1 },
+	{ .mask = IP_USBPH_SEG_TC,  .seg = 0, .bit = 2 },
+	{ .mask = IP_USBPH_SEG_T,   .seg = 0, .bit = 3 },
+	{ .mask = IP_USBPH_SEG_BR,  .seg = 1, .bit = 0 },
+	{ .mask = IP_USBPH_SEG_BRX, .seg = 1, .bit = 1 },
+	{ .mask = IP_USBPH_SEG_RC,  .seg = 1, .bit = 2 },
+	{ .mask = IP_USBPH_SEG_TRX, .seg = 1, .bit = 3 },
+	{ .mask = IP_USBPH_SEG_TR,  .seg = 1, .bit = 4 },
+	{ .mask = IP_USBPH_SEG_BL,  .seg = 2, .bit = 0 },
+	{ .mask = IP_USBPH_SEG_BLX, .seg = 2, .bit = 1 },
+	{ .mask = IP_USBPH_SEG_LC,  .seg = 2, .bit = 2 },
+	{ .mask = IP_USBPH_SEG_TLX, .seg = 2, .bit = 3 },
+	{ .mask = IP_USBPH_SEG_TL,  .seg = 2, .bit = 4 },
+};
+
+/*
+ * SEG0 - T  / TL  / TLX / LC / BC  / BLX / BL
+ * SEG1 - TR / TRX / TC  / RC / BRC / BR  / B
+ */
+static const struct {
+	ip_usbph_char mask;
+	int seg;
+	int bit;
+} bot_seg_map[14] = {
+	{ .mask = IP_USBPH_SEG_T,   .seg = 0, .bit = 0 },
+	{ .mask = IP_USBPH_SEG_TL,  .seg = 0, .bit = 1 },
+	{ .mask = IP_USBPH_SEG_TLX, .seg = 0, .bit = 2 },
+	{ .mask = IP_USBPH_SEG_LC,  .seg = 0, .bit = 3 },
+	{ .mask = IP_USBPH_SEG_BC,  .seg = 0, .bit = 4 },
+	{ .mask = IP_USBPH_SEG_BLX, .seg = 0, .bit = 5 },
+	{ .mask = IP_USBPH_SEG_BL,  .seg = 0, .bit = 6 },
+	{ .mask = IP_USBPH_SEG_TR,  .seg = 1, .bit = 0 },
+	{ .mask = IP_USBPH_SEG_TRX, .seg = 1, .bit = 1 },
+	{ .mask = IP_USBPH_SEG_TC,  .seg = 1, .bit = 2 },
+	{ .mask = IP_USBPH_SEG_RC,  .seg = 1, .bit = 3 },
+	{ .mask = IP_USBPH_SEG_BRX, .seg = 1, .bit = 4 },
+	{ .mask = IP_USBPH_SEG_BR,  .seg = 1, .bit = 5 },
+	{ .mask = IP_USBPH_SEG_B,   .seg = 1, .bit = 6 },
+};
+
+static const struct {
+	code_id code;
+	int bit;
+} bot_char_seg[][2] = {
+	[0] = {
+		{ .code = CODE_C1_54, .bit = 32 },
+		{ .code = CODE_C1_59, .bit =  0 },
+	},
+	[1] = {
+		{ .code = CODE_C1_59, .bit =  8 },
+		{ .code = CODE_C1_59, .bit = 16 },
+	},
+	[2] = {
+		{ .code = CODE_C1_59, .bit = 24 },
+		{ .code = CODE_C1_59, .bit = 32 },
+	},
+	[3] = {
+		{ .code = CODE_61_5E, .bit =  0 },
+		{ .code = CODE_61_5E, .bit =  8 },
+	},
+};
+
+#endif /* IP_USBPH_SEGMAP_H */
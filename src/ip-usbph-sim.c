@@ -0,0 +1,593 @@
+/*
+ * Copyright 2009, Jason McMullan
+ * Author: Jason McMullan <jason.mcmullan@gmail.com>
+ *
+ * Licensed under the LGPL v2
+ */
+
+/*
+ * Transports without a phone: null, which completes everything
+ * at once, and a simulated phone, which decodes what it is sent.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ip-usbph.h"
+#include "ip-usbph-private.h"
+#include "ip-usbph-segmap.h"
+
+#define ARRAY_SIZE(x) (sizeof(x)/sizeof(x[0]))
+
+#define SIM_KEYS	64	/* Scripted key ring, power of two */
+
+struct sim {
+	struct transport t;
+	int phone;		/* Simulated phone, not null */
+	pthread_mutex_t lock;	/* All of the below */
+	pthread_cond_t wake;
+	int interrupted;
+
+	unsigned latency_usec;	/* Per transfer, on the bus */
+	unsigned turnaround_usec; /* Per transfer, off it */
+	uint64_t bus_ns;	/* When the bus is next free */
+
+	/* Injected failures */
+	struct {
+		int code;	/* Display code, or -1 for any transfer */
+		int count;
+		int err;
+	} fail;
+
+	/* Transfers in flight */
+	struct {
+		int busy;
+		int err;
+		uint64_t due_ns;
+		uint8_t packet[8];
+	} out[SLOTS];
+	struct {
+		int busy;
+		int err;	/* -ECANCELED once cancelled */
+	} read;
+
+	/* Scripted key reports, each due at an absolute time */
+	unsigned key_head;
+	unsigned key_tail;
+	uint64_t key_last_ns;
+	struct {
+		uint64_t due_ns;
+		uint8_t key;
+	} key[SIM_KEYS];
+
+	/* What the phone shows */
+	uint8_t display[CODES][8];
+};
+
+#define to_sim(tp)	((struct sim *)(tp))
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Transfers share the bus - each starts once the one before
+ * it is done. Called with the lock held.
+ */
+static uint64_t sim_bus(struct sim *sim)
+{
+	uint64_t now = now_ns();
+
+	if (sim->bus_ns < now)
+		sim->bus_ns = now;
+	sim->bus_ns += sim->latency_usec * 1000ULL;
+
+	return sim->bus_ns;
+}
+
+/* When a transfer put on the bus now completes: once it has had
+ * its turn on the bus, and the phone has answered it. Answers
+ * overlap, so pipelined transfers wait for one turnaround, not
+ * one each. Called with the lock held.
+ */
+static uint64_t sim_done(struct sim *sim)
+{
+	return sim_bus(sim) + sim->turnaround_usec * 1000ULL;
+}
+
+/* Does this transfer fail? 'code' is -1 for a control transfer.
+ * Called with the lock held.
+ */
+static int sim_fail(struct sim *sim, int code)
+{
+	if (sim->fail.count == 0 ||
+	    (sim->fail.code >= 0 && sim->fail.code != code))
+		return 0;
+
+	sim->fail.count--;
+	return sim->fail.err;
+}
+
+/* When a timed out transfer gives up - never, without a timeout */
+static uint64_t sim_timeout(int timeout_msec)
+{
+	if (timeout_msec == 0)
+		return UINT64_MAX;
+
+	return now_ns() + timeout_msec * 1000000ULL;
+}
+
+static void sim_show(struct sim *sim, const uint8_t packet[8])
+{
+	int i;
+
+	if (!sim->phone)
+		return;
+
+	for (i = 0; i < CODES; i++) {
+		if (memcmp(packet, code_set[i], 3) == 0) {
+			memcpy(sim->display[i], packet, 8);
+			return;
+		}
+	}
+}
+
+static void sim_sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ULL,
+		.tv_nsec = ns % 1000000000ULL,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static void sim_free(struct transport *t)
+{
+	struct sim *sim = to_sim(t);
+
+	pthread_cond_destroy(&sim->wake);
+	pthread_mutex_destroy(&sim->lock);
+	free(sim);
+}
+
+static int sim_reopen(struct transport *t)
+{
+	return 0;
+}
+
+static int sim_control(struct transport *t, const uint8_t packet[8], int timeout_msec)
+{
+	struct sim *sim = to_sim(t);
+	uint64_t due;
+	int err;
+
+	pthread_mutex_lock(&sim->lock);
+	err = sim_fail(sim, -1);
+	due = (err == -ETIMEDOUT) ? sim_timeout(timeout_msec) : sim_done(sim);
+	pthread_mutex_unlock(&sim->lock);
+
+	sim_sleep_until(due);
+	if (err < 0)
+		return err;
+
+	pthread_mutex_lock(&sim->lock);
+	sim_show(sim, packet);
+	pthread_mutex_unlock(&sim->lock);
+
+	return 0;
+}
+
+static int sim_submit(struct transport *t, int code, const uint8_t packet[8], int timeout_msec)
+{
+	struct sim *sim = to_sim(t);
+	int err;
+
+	pthread_mutex_lock(&sim->lock);
+	err = sim_fail(sim, (code == SLOT_RAW) ? -1 : code);
+	sim->out[code].busy = 1;
+	sim->out[code].err = err;
+	sim->out[code].due_ns = (err == -ETIMEDOUT) ? sim_timeout(timeout_msec) : sim_done(sim);
+	memcpy(sim->out[code].packet, packet, 8);
+	pthread_mutex_unlock(&sim->lock);
+
+	return 0;
+}
+
+static void sim_cancel(struct transport *t, int code)
+{
+	struct sim *sim = to_sim(t);
+
+	pthread_mutex_lock(&sim->lock);
+	if (sim->out[code].busy) {
+		sim->out[code].err = -ECANCELED;
+		sim->out[code].due_ns = 0;
+	}
+	pthread_mutex_unlock(&sim->lock);
+}
+
+static int sim_read(struct transport *t)
+{
+	struct sim *sim = to_sim(t);
+
+	pthread_mutex_lock(&sim->lock);
+	sim->read.busy = 1;
+	sim->read.err = 0;
+	pthread_mutex_unlock(&sim->lock);
+
+	return 0;
+}
+
+static void sim_read_cancel(struct transport *t)
+{
+	struct sim *sim = to_sim(t);
+
+	pthread_mutex_lock(&sim->lock);
+	if (sim->read.busy)
+		sim->read.err = -ECANCELED;
+	pthread_mutex_unlock(&sim->lock);
+}
+
+/* Next completion due, as its transfer slot, SLOTS for the key
+ * read, or -1 if none. Called with the lock held.
+ */
+static int sim_next(struct sim *sim, uint64_t *due_ns)
+{
+	int i, next = -1;
+
+	for (i = 0; i < SLOTS; i++) {
+		if (sim->out[i].busy && (next < 0 || sim->out[i].due_ns < *due_ns)) {
+			*due_ns = sim->out[i].due_ns;
+			next = i;
+		}
+	}
+
+	if (sim->read.busy) {
+		uint64_t due = 0;
+
+		if (sim->read.err == 0) {
+			if (sim->key_head == sim->key_tail)
+				return next;
+			due = sim->key[sim->key_tail % SIM_KEYS].due_ns;
+		}
+		if (next < 0 || due < *due_ns) {
+			*due_ns = due;
+			next = SLOTS;
+		}
+	}
+
+	return next;
+}
+
+/* Complete one transfer. Called with the lock held, which is
+ * dropped around the completion, as that may start another.
+ */
+static void sim_complete(struct sim *sim, int next)
+{
+	uint8_t report[8] = { 0x02, 0x61, 0x90 };
+	int err;
+
+	if (next < SLOTS) {
+		err = sim->out[next].err;
+		if (err == 0)
+			sim_show(sim, sim->out[next].packet);
+		sim->out[next].busy = 0;
+
+		pthread_mutex_unlock(&sim->lock);
+		ph_flush_done(sim->t.ph, next, err);
+	} else {
+		err = sim->read.err;
+		if (err == 0)
+			report[3] = sim->key[sim->key_tail++ % SIM_KEYS].key;
+		sim->read.busy = 0;
+
+		pthread_mutex_unlock(&sim->lock);
+		ph_key_done(sim->t.ph, err, (err == 0) ? report : NULL);
+	}
+
+	pthread_mutex_lock(&sim->lock);
+}
+
+static int sim_handle_events(struct transport *t, int timeout_msec, int *completed)
+{
+	struct sim *sim = to_sim(t);
+	uint64_t deadline = 0;
+	int handled = 0;
+
+	if (timeout_msec >= 0)
+		deadline = now_ns() + timeout_msec * 1000000ULL;
+
+	pthread_mutex_lock(&sim->lock);
+	for (;;) {
+		uint64_t now = now_ns(), due = 0;
+		struct timespec ts;
+		int next;
+
+		next = sim_next(sim, &due);
+		if (next >= 0 && due <= now) {
+			sim_complete(sim, next);
+			handled = 1;
+			continue;
+		}
+
+		if (handled || sim->interrupted ||
+		    (completed != NULL && __atomic_load_n(completed, __ATOMIC_ACQUIRE)) ||
+		    (timeout_msec >= 0 && now >= deadline))
+			break;
+
+		if (next < 0 || (timeout_msec >= 0 && deadline < due))
+			due = deadline;
+
+		if (due == 0) {
+			pthread_cond_wait(&sim->wake, &sim->lock);
+		} else {
+			ts.tv_sec = due / 1000000000ULL;
+			ts.tv_nsec = due % 1000000000ULL;
+			pthread_cond_timedwait(&sim->wake, &sim->lock, &ts);
+		}
+	}
+	sim->interrupted = 0;
+	pthread_mutex_unlock(&sim->lock);
+
+	return 0;
+}
+
+static void sim_interrupt(struct transport *t)
+{
+	struct sim *sim = to_sim(t);
+
+	pthread_mutex_lock(&sim->lock);
+	sim->interrupted = 1;
+	pthread_cond_broadcast(&sim->wake);
+	pthread_mutex_unlock(&sim->lock);
+}
+
+/* Nothing to poll - completions are all timed
+ */
+static int sim_get_pollfds(struct transport *t, struct pollfd *fds, int max)
+{
+	return 0;
+}
+
+static void sim_set_pollfd_notifier(struct transport *t, int enable)
+{
+}
+
+static int sim_next_timeout(struct transport *t)
+{
+	struct sim *sim = to_sim(t);
+	uint64_t now, due = 0;
+	int next;
+
+	pthread_mutex_lock(&sim->lock);
+	next = sim_next(sim, &due);
+	pthread_mutex_unlock(&sim->lock);
+
+	if (next < 0)
+		return -1;
+
+	now = now_ns();
+	if (due <= now)
+		return 0;
+
+	return (due - now + 999999) / 1000000;
+}
+
+static const struct transport_ops null_ops = {
+	.name = "null",
+	.simulated = 1,
+	.free = sim_free,
+	.reopen = sim_reopen,
+	.control = sim_control,
+	.submit = sim_submit,
+	.cancel = sim_cancel,
+	.read = sim_read,
+	.read_cancel = sim_read_cancel,
+	.handle_events = sim_handle_events,
+	.interrupt = sim_interrupt,
+	.get_pollfds = sim_get_pollfds,
+	.set_pollfd_notifier = sim_set_pollfd_notifier,
+	.next_timeout = sim_next_timeout,
+};
+
+static const struct transport_ops sim_ops = {
+	.name = "sim",
+	.simulated = 1,
+	.free = sim_free,
+	.reopen = sim_reopen,
+	.control = sim_control,
+	.submit = sim_submit,
+	.cancel = sim_cancel,
+	.read = sim_read,
+	.read_cancel = sim_read_cancel,
+	.handle_events = sim_handle_events,
+	.interrupt = sim_interrupt,
+	.get_pollfds = sim_get_pollfds,
+	.set_pollfd_notifier = sim_set_pollfd_notifier,
+	.next_timeout = sim_next_timeout,
+};
+
+static struct ip_usbph *sim_new(const struct transport_ops *ops)
+{
+	pthread_condattr_t attr;
+	struct ip_usbph *ph;
+	struct sim *sim;
+
+	sim = calloc(1, sizeof(*sim));
+	if (sim == NULL)
+		return NULL;
+
+	sim->t.ops = ops;
+	sim->phone = (ops == &sim_ops);
+	memcpy(sim->display, code_set, sizeof(code_set));
+
+	pthread_mutex_init(&sim->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sim->wake, &attr);
+	pthread_condattr_destroy(&attr);
+
+	ph = ph_new(&sim->t, ops->name);
+	if (ph == NULL)
+		sim_free(&sim->t);
+
+	return ph;
+}
+
+struct ip_usbph *ip_usbph_null_new(void)
+{
+	return sim_new(&null_ops);
+}
+
+struct ip_usbph *ip_usbph_sim_new(void)
+{
+	return sim_new(&sim_ops);
+}
+
+static struct sim *sim_get(struct ip_usbph *ph)
+{
+	struct transport *t = ph_transport(ph);
+
+	return (t->ops == &sim_ops) ? to_sim(t) : NULL;
+}
+
+int ip_usbph_sim_latency(struct ip_usbph *ph, unsigned usec)
+{
+	struct sim *sim = sim_get(ph);
+
+	if (sim == NULL)
+		return -EINVAL;
+
+	pthread_mutex_lock(&sim->lock);
+	sim->latency_usec = usec;
+	pthread_mutex_unlock(&sim->lock);
+
+	return 0;
+}
+
+int ip_usbph_sim_turnaround(struct ip_usbph *ph, unsigned usec)
+{
+	struct sim *sim = sim_get(ph);
+
+	if (sim == NULL)
+		return -EINVAL;
+
+	pthread_mutex_lock(&sim->lock);
+	sim->turnaround_usec = usec;
+	pthread_mutex_unlock(&sim->lock);
+
+	return 0;
+}
+
+int ip_usbph_sim_fail(struct ip_usbph *ph, int code, int count, int err)
+{
+	struct sim *sim = sim_get(ph);
+
+	if (sim == NULL || code < -1 || code >= CODES || count < 0 || err >= 0)
+		return -EINVAL;
+
+	pthread_mutex_lock(&sim->lock);
+	sim->fail.code = code;
+	sim->fail.count = count;
+	sim->fail.err = err;
+	pthread_mutex_unlock(&sim->lock);
+
+	return 0;
+}
+
+int ip_usbph_sim_keys(struct ip_usbph *ph, const struct ip_usbph_sim_key *keys, int n)
+{
+	struct sim *sim = sim_get(ph);
+	uint64_t now;
+	int i;
+
+	if (sim == NULL || n < 0)
+		return -EINVAL;
+
+	pthread_mutex_lock(&sim->lock);
+	if (n > SIM_KEYS - (sim->key_head - sim->key_tail)) {
+		pthread_mutex_unlock(&sim->lock);
+		return -ENOSPC;
+	}
+
+	/* A script starts now, or after the keys still to come */
+	now = now_ns();
+	if (sim->key_head == sim->key_tail || sim->key_last_ns < now)
+		sim->key_last_ns = now;
+
+	for (i = 0; i < n; i++) {
+		sim->key_last_ns += keys[i].delay_msec * 1000000ULL;
+		sim->key[sim->key_head % SIM_KEYS].due_ns = sim->key_last_ns;
+		sim->key[sim->key_head % SIM_KEYS].key = keys[i].key;
+		sim->key_head++;
+	}
+
+	pthread_cond_broadcast(&sim->wake);
+	pthread_mutex_unlock(&sim->lock);
+
+	return 0;
+}
+
+static inline int sim_bit(const uint8_t display[CODES][8], code_id code, int bit)
+{
+	return (display[code - 1][3 + bit / 8] >> (bit % 8)) & 1;
+}
+
+int ip_usbph_sim_frame(struct ip_usbph *ph, struct ip_usbph_frame *frame)
+{
+	struct sim *sim = sim_get(ph);
+	uint8_t display[CODES][8];
+	int i, j;
+
+	if (sim == NULL)
+		return -EINVAL;
+
+	pthread_mutex_lock(&sim->lock);
+	memcpy(display, sim->display, sizeof(display));
+	pthread_mutex_unlock(&sim->lock);
+
+	memset(frame, 0, sizeof(*frame));
+
+	for (i = 0; i < IP_USBPH_TOP_DIGITS; i++) {
+		for (j = 0; j < 8; j++) {
+			if (xref_digit_segment[i][j].code != 0 &&
+			    sim_bit(display, xref_digit_segment[i][j].code,
+			                     xref_digit_segment[i][j].bit))
+				frame->digit[i] |= 1 << j;
+		}
+	}
+
+	for (i = 0; i < IP_USBPH_TOP_CHARS; i++) {
+		for (j = 0; j < ARRAY_SIZE(top_seg_map); j++) {
+			int seg = top_seg_map[j].seg;
+
+			if (sim_bit(display, top_char_seg[i][seg].code,
+			                     top_char_seg[i][seg].bit + top_seg_map[j].bit))
+				frame->top[i] |= top_seg_map[j].mask;
+		}
+	}
+
+	for (i = 0; i < IP_USBPH_BOT_CHARS; i++) {
+		for (j = 0; j < ARRAY_SIZE(bot_seg_map); j++) {
+			int seg = bot_seg_map[j].seg;
+
+			if (sim_bit(display, bot_char_seg[i][seg].code,
+			                     bot_char_seg[i][seg].bit + bot_seg_map[j].bit))
+				frame->bot[i] |= bot_seg_map[j].mask;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(font_symbol); i++) {
+		if (sim_bit(display, font_symbol[i].code, font_symbol[i].bit))
+			frame->symbols |= IP_USBPH_SYMBOL_BIT(i);
+	}
+
+	return 0;
+}
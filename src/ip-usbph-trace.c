@@ -0,0 +1,180 @@
+/*
+ * Copyright 2009, Jason McMullan
+ * Author: Jason McMullan <jason.mcmullan@gmail.com>
+ *
+ * Licensed under the LGPL v2
+ */
+
+/*
+ * Packet trace ring, and the trace file format
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <endian.h>
+#include <pthread.h>
+
+#include "ip-usbph.h"
+
+#define TRACE_MAGIC	"IPTR"
+#define TRACE_VERSION	1
+
+struct ip_usbph_tracer {
+	pthread_mutex_t lock;
+	int fd;
+	unsigned size;		/* Ring entries, power of two */
+	uint64_t head;		/* Records ever added */
+	uint64_t synced;	/* Records written to fd */
+	uint64_t dropped;	/* Overwritten before being written */
+	struct ip_usbph_trace *ring;
+};
+
+static void trace_encode(uint8_t raw[IP_USBPH_TRACE_RECORD], const struct ip_usbph_trace *rec)
+{
+	uint64_t ns = htole64(rec->monotonic_ns);
+
+	memset(raw, 0, IP_USBPH_TRACE_RECORD);
+	memcpy(&raw[0], &ns, 8);
+	raw[8] = rec->dir;
+	raw[9] = rec->code;
+	memcpy(&raw[16], rec->packet, 8);
+}
+
+void ip_usbph_trace_decode(const uint8_t raw[IP_USBPH_TRACE_RECORD], struct ip_usbph_trace *rec)
+{
+	uint64_t ns;
+
+	memcpy(&ns, &raw[0], 8);
+	rec->monotonic_ns = le64toh(ns);
+	rec->dir = raw[8];
+	rec->code = raw[9];
+	memcpy(rec->packet, &raw[16], 8);
+}
+
+int ip_usbph_trace_check(const uint8_t header[IP_USBPH_TRACE_HEADER])
+{
+	if (memcmp(header, TRACE_MAGIC, 4) != 0 || header[4] != TRACE_VERSION)
+		return -EINVAL;
+
+	return 0;
+}
+
+struct ip_usbph_tracer *ip_usbph_tracer_new(unsigned records, int fd)
+{
+	struct ip_usbph_tracer *tracer;
+	unsigned size = 16;
+
+	while (size < records)
+		size <<= 1;
+
+	tracer = calloc(1, sizeof(*tracer));
+	if (tracer == NULL)
+		return NULL;
+
+	tracer->ring = calloc(size, sizeof(*tracer->ring));
+	if (tracer->ring == NULL) {
+		free(tracer);
+		return NULL;
+	}
+
+	if (fd >= 0) {
+		uint8_t header[IP_USBPH_TRACE_HEADER] = { 0 };
+
+		memcpy(header, TRACE_MAGIC, 4);
+		header[4] = TRACE_VERSION;
+		if (write(fd, header, sizeof(header)) != sizeof(header)) {
+			free(tracer->ring);
+			free(tracer);
+			return NULL;
+		}
+	}
+
+	pthread_mutex_init(&tracer->lock, NULL);
+	tracer->fd = fd;
+	tracer->size = size;
+
+	return tracer;
+}
+
+/* Write out everything not yet written. Called locked.
+ */
+static int tracer_spool(struct ip_usbph_tracer *tracer)
+{
+	uint8_t buff[64 * IP_USBPH_TRACE_RECORD];
+	int n = 0;
+
+	if (tracer->fd < 0) {
+		tracer->synced = tracer->head;
+		return 0;
+	}
+
+	if (tracer->head - tracer->synced > tracer->size) {
+		tracer->dropped += tracer->head - tracer->synced - tracer->size;
+		tracer->synced = tracer->head - tracer->size;
+	}
+
+	while (tracer->synced != tracer->head) {
+		trace_encode(&buff[n * IP_USBPH_TRACE_RECORD],
+		             &tracer->ring[tracer->synced % tracer->size]);
+		tracer->synced++;
+		if (++n == 64 || tracer->synced == tracer->head) {
+			ssize_t len = n * IP_USBPH_TRACE_RECORD;
+
+			if (write(tracer->fd, buff, len) != len)
+				return -EIO;
+			n = 0;
+		}
+	}
+
+	return 0;
+}
+
+void ip_usbph_tracer_sink(const struct ip_usbph_trace *rec, void *priv)
+{
+	struct ip_usbph_tracer *tracer = priv;
+
+	pthread_mutex_lock(&tracer->lock);
+	tracer->ring[tracer->head % tracer->size] = *rec;
+	tracer->head++;
+
+	if (tracer->head - tracer->synced >= tracer->size / 2)
+		tracer_spool(tracer);
+	pthread_mutex_unlock(&tracer->lock);
+}
+
+int ip_usbph_tracer_sync(struct ip_usbph_tracer *tracer)
+{
+	int err;
+
+	pthread_mutex_lock(&tracer->lock);
+	err = tracer_spool(tracer);
+	pthread_mutex_unlock(&tracer->lock);
+
+	return err;
+}
+
+int ip_usbph_tracer_read(struct ip_usbph_tracer *tracer, struct ip_usbph_trace *recs, int max)
+{
+	uint64_t first;
+	int n;
+
+	pthread_mutex_lock(&tracer->lock);
+	first = tracer->head;
+	for (n = 0; n < max && n < tracer->size && first > 0; n++)
+		first--;
+	for (n = 0; first != tracer->head; n++, first++)
+		recs[n] = tracer->ring[first % tracer->size];
+	pthread_mutex_unlock(&tracer->lock);
+
+	return n;
+}
+
+void ip_usbph_tracer_free(struct ip_usbph_tracer *tracer)
+{
+	ip_usbph_tracer_sync(tracer);
+	pthread_mutex_destroy(&tracer->lock);
+	free(tracer->ring);
+	free(tracer);
+}
@@ -0,0 +1,829 @@
+/*
+ * Copyright 2007, Jason McMullan
+ * Author: Jason McMullan <jason.mcmullan@gmail.com>
+ *
+ * Licensed under the LGPL v2
+ */
+
+/*
+ * libusb transport, and device discovery
+ */
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <libusb.h>
+
+#include "ip-usbph.h"
+#include "ip-usbph-private.h"
+
+/* Shared libusb context, and the phones it has seen
+ */
+struct ip_usbph_ctx {
+	libusb_context *usb_context;
+	libusb_hotplug_callback_handle hotplug;
+	int has_hotplug;
+	pthread_mutex_t lock;	/* Protects the device table */
+	int devices;
+	int devices_max;
+	struct ctx_device {
+		libusb_device *dev;
+		char path[IP_USBPH_PATH_MAX];
+	} *device;
+	ip_usbph_hotplug_cb callback;
+	void *priv;
+};
+
+struct usb {
+	struct transport t;
+	struct ip_usbph_ctx *ctx;	/* NULL if the context is our own */
+	libusb_context *usb_context;
+	libusb_device_handle *usb;
+	struct libusb_transfer *xfer[SLOTS];	/* One per transfer slot */
+	struct libusb_transfer *keys;		/* Key report reads */
+	uint8_t out;		/* Interrupt OUT endpoint, or 0 to use control transfers */
+};
+
+#define to_usb(tp)	((struct usb *)(tp))
+
+static int is_ip_usbph(libusb_device *dev)
+{
+	struct libusb_device_descriptor desc;
+	int err;
+
+	err = libusb_get_device_descriptor(dev, &desc);
+	if (err < 0)
+		return 0;
+
+	return (desc.idVendor == 0x04d9 &&
+	        desc.idProduct == 0x0602 &&
+	        desc.iManufacturer == 1 &&
+	        desc.iProduct == 2 &&
+	        desc.iSerialNumber == 0 &&
+	        desc.bNumConfigurations == 1);
+}
+
+/* Physical path of a device - "bus-port.port..." - which,
+ * unlike its index or address, survives replugging.
+ */
+static void device_path(libusb_device *dev, char *path, size_t len)
+{
+	uint8_t port[7];
+	int i, n, pos;
+
+	n = libusb_get_port_numbers(dev, port, sizeof(port));
+	pos = snprintf(path, len, "%d", libusb_get_bus_number(dev));
+	for (i = 0; i < n && pos < len; i++)
+		pos += snprintf(path + pos, len - pos, "%c%d", (i == 0) ? '-' : '.', port[i]);
+}
+
+
+static int usb_errno(int err)
+{
+	switch (err) {
+	case LIBUSB_SUCCESS:		return 0;
+	case LIBUSB_ERROR_INVALID_PARAM: return -EINVAL;
+	case LIBUSB_ERROR_ACCESS:	return -EACCES;
+	case LIBUSB_ERROR_NO_DEVICE:	return -ENODEV;
+	case LIBUSB_ERROR_NOT_FOUND:	return -ENOENT;
+	case LIBUSB_ERROR_BUSY:		return -EBUSY;
+	case LIBUSB_ERROR_TIMEOUT:	return -ETIMEDOUT;
+	case LIBUSB_ERROR_OVERFLOW:	return -EOVERFLOW;
+	case LIBUSB_ERROR_PIPE:		return -EPIPE;
+	case LIBUSB_ERROR_INTERRUPTED:	return -EINTR;
+	case LIBUSB_ERROR_NO_MEM:	return -ENOMEM;
+	case LIBUSB_ERROR_NOT_SUPPORTED: return -ENOSYS;
+	default:			return -EIO;
+	}
+}
+
+static int usb_status_errno(enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:	return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:	return -ETIMEDOUT;
+	case LIBUSB_TRANSFER_CANCELLED:	return -ECANCELED;
+	case LIBUSB_TRANSFER_STALL:	return -EPIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:	return -ENODEV;
+	case LIBUSB_TRANSFER_OVERFLOW:	return -EOVERFLOW;
+	default:			return -EIO;
+	}
+}
+
+static void usb_flush_complete(struct libusb_transfer *xfer)
+{
+	struct usb *u = xfer->user_data;
+	int code, err;
+
+	for (code = 0; code < SLOTS; code++) {
+		if (u->xfer[code] == xfer)
+			break;
+	}
+	assert(code < SLOTS);
+
+	err = usb_status_errno(xfer->status);
+	if (err == 0 && xfer->actual_length != 8)
+		err = -EIO;
+
+	ph_flush_done(u->t.ph, code, err);
+}
+
+static void usb_keys_complete(struct libusb_transfer *xfer)
+{
+	struct usb *u = xfer->user_data;
+
+	ph_key_done(u->t.ph, usb_status_errno(xfer->status),
+	            (xfer->actual_length == 8) ? xfer->buffer : NULL);
+}
+
+static void usb_close(struct usb *u)
+{
+	int i;
+
+	for (i = 0; i < SLOTS; i++) {
+		if (u->xfer[i] != NULL) {
+			libusb_free_transfer(u->xfer[i]);
+			u->xfer[i] = NULL;
+		}
+	}
+
+	if (u->keys != NULL) {
+		libusb_free_transfer(u->keys);
+		u->keys = NULL;
+	}
+
+	if (u->usb != NULL) {
+		libusb_close(u->usb);
+		u->usb = NULL;
+	}
+}
+
+/* Interrupt OUT endpoint of interface 3, if it has one. Reports
+ * sent there skip endpoint 0's setup and status stages.
+ */
+static uint8_t usb_out_endpoint(libusb_device *dev)
+{
+	const char *env = getenv("IP_USBPH_OUT");
+	struct libusb_config_descriptor *config;
+	uint8_t out = 0;
+	int i, j;
+
+	if (env != NULL && strcmp(env, "control") == 0)
+		return 0;
+
+	if (libusb_get_active_config_descriptor(dev, &config) < 0)
+		return 0;
+
+	for (i = 0; i < config->bNumInterfaces && out == 0; i++) {
+		const struct libusb_interface_descriptor *alt;
+
+		if (config->interface[i].num_altsetting < 1)
+			continue;
+
+		alt = &config->interface[i].altsetting[0];
+		if (alt->bInterfaceNumber != 3)
+			continue;
+
+		for (j = 0; j < alt->bNumEndpoints; j++) {
+			const struct libusb_endpoint_descriptor *ep = &alt->endpoint[j];
+
+			if ((ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT &&
+			    (ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) == LIBUSB_TRANSFER_TYPE_INTERRUPT) {
+				out = ep->bEndpointAddress;
+				break;
+			}
+		}
+	}
+
+	libusb_free_config_descriptor(config);
+
+	return out;
+}
+
+static const struct transport_ops usb_ops, usb_out_ops;
+
+/* Open and claim the device, and set up its transfers
+ */
+static int usb_open(struct usb *u, libusb_device *dev)
+{
+	uint8_t *buff;
+	int i, err;
+
+	u->out = usb_out_endpoint(dev);
+	u->t.ops = u->out ? &usb_out_ops : &usb_ops;
+
+	err = libusb_open(dev, &u->usb);
+	if (err < 0) {
+		u->usb = NULL;
+		return (err == LIBUSB_ERROR_NO_DEVICE) ? -ENODEV : -EIO;
+	}
+
+	err = libusb_detach_kernel_driver(u->usb, 3);
+	if (err < 0 && err != LIBUSB_ERROR_NOT_FOUND) {
+		usb_close(u);
+		return -EBUSY;
+	}
+
+	err = libusb_claim_interface(u->usb, 3);
+	if (err < 0) {
+		usb_close(u);
+		return -EBUSY;
+	}
+
+	for (i = 0; i < SLOTS; i++) {
+		struct libusb_transfer *xfer;
+
+		xfer = libusb_alloc_transfer(0);
+		if (xfer == NULL)
+			goto nomem;
+		u->xfer[i] = xfer;
+
+		if (u->out) {
+			buff = calloc(1, 8);
+			if (buff == NULL)
+				goto nomem;
+
+			libusb_fill_interrupt_transfer(xfer, u->usb, u->out, buff, 8,
+			                               usb_flush_complete, u, 0);
+		} else {
+			buff = calloc(1, LIBUSB_CONTROL_SETUP_SIZE + 8);
+			if (buff == NULL)
+				goto nomem;
+
+			libusb_fill_control_setup(buff,
+			                      LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+			                      LIBUSB_REQUEST_SET_CONFIGURATION,
+			                      0x202,
+			                      0x03,
+			                      8);
+			libusb_fill_control_transfer(xfer, u->usb, buff,
+			                             usb_flush_complete, u, 0);
+		}
+		xfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	}
+
+	u->keys = libusb_alloc_transfer(0);
+	if (u->keys == NULL)
+		goto nomem;
+
+	buff = calloc(1, 8);
+	if (buff == NULL)
+		goto nomem;
+
+	libusb_fill_interrupt_transfer(u->keys, u->usb, 0x81, buff, 8,
+	                               usb_keys_complete, u, 0);
+	u->keys->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+	return 0;
+
+nomem:
+	usb_close(u);
+	return -ENOMEM;
+}
+
+static void usb_free(struct transport *t)
+{
+	struct usb *u = to_usb(t);
+
+	usb_close(u);
+	if (u->ctx == NULL)
+		libusb_exit(u->usb_context);
+	free(u);
+}
+
+/* Find the device at our path again
+ */
+static int usb_reopen(struct transport *t)
+{
+	struct usb *u = to_usb(t);
+	const char *want = ip_usbph_path(t->ph);
+	libusb_device *dev = NULL;
+	char path[IP_USBPH_PATH_MAX];
+	int i, err;
+
+	usb_close(u);
+
+	if (u->ctx != NULL && u->ctx->has_hotplug) {
+		struct ip_usbph_ctx *ctx = u->ctx;
+
+		pthread_mutex_lock(&ctx->lock);
+		for (i = 0; i < ctx->devices; i++) {
+			if (strcmp(ctx->device[i].path, want) == 0) {
+				dev = libusb_ref_device(ctx->device[i].dev);
+				break;
+			}
+		}
+		pthread_mutex_unlock(&ctx->lock);
+	} else {
+		libusb_device **usb_list;
+		ssize_t usb_devices;
+
+		usb_devices = libusb_get_device_list(u->usb_context, &usb_list);
+		for (i = 0; i < usb_devices; i++) {
+			if (!is_ip_usbph(usb_list[i]))
+				continue;
+			device_path(usb_list[i], path, sizeof(path));
+			if (strcmp(path, want) == 0) {
+				dev = libusb_ref_device(usb_list[i]);
+				break;
+			}
+		}
+		if (usb_devices >= 0)
+			libusb_free_device_list(usb_list, 1);
+	}
+
+	if (dev == NULL)
+		return -ENODEV;
+
+	err = usb_open(u, dev);
+	libusb_unref_device(dev);
+
+	return err;
+}
+
+static int usb_control(struct transport *t, const uint8_t packet[8], int timeout_msec)
+{
+	struct usb *u = to_usb(t);
+	int err;
+
+	if (u->usb == NULL)
+		return -ENODEV;
+
+	err = libusb_control_transfer(u->usb, 
+	                      LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+	                      LIBUSB_REQUEST_SET_CONFIGURATION,
+	                      0x202,
+	                      0x03,
+	                      (uint8_t *)packet, 8, timeout_msec);
+
+	return (err < 0) ? usb_errno(err) : 0;
+}
+
+static int usb_submit(struct transport *t, int code, const uint8_t packet[8], int timeout_msec)
+{
+	struct usb *u = to_usb(t);
+
+	if (u->xfer[code] == NULL)
+		return -ENODEV;
+
+	memcpy(libusb_control_transfer_get_data(u->xfer[code]), packet, 8);
+	u->xfer[code]->timeout = timeout_msec;
+
+	return usb_errno(libusb_submit_transfer(u->xfer[code]));
+}
+
+static int usb_out_control(struct transport *t, const uint8_t packet[8], int timeout_msec)
+{
+	struct usb *u = to_usb(t);
+	int err, len;
+
+	if (u->usb == NULL)
+		return -ENODEV;
+
+	err = libusb_interrupt_transfer(u->usb, u->out, (uint8_t *)packet, 8, &len, timeout_msec);
+	if (err < 0)
+		return usb_errno(err);
+
+	return (len == 8) ? 0 : -EIO;
+}
+
+static int usb_out_submit(struct transport *t, int code, const uint8_t packet[8], int timeout_msec)
+{
+	struct usb *u = to_usb(t);
+
+	if (u->xfer[code] == NULL)
+		return -ENODEV;
+
+	memcpy(u->xfer[code]->buffer, packet, 8);
+	u->xfer[code]->timeout = timeout_msec;
+
+	return usb_errno(libusb_submit_transfer(u->xfer[code]));
+}
+
+static void usb_cancel(struct transport *t, int code)
+{
+	libusb_cancel_transfer(to_usb(t)->xfer[code]);
+}
+
+static int usb_read(struct transport *t)
+{
+	struct usb *u = to_usb(t);
+
+	if (u->keys == NULL)
+		return -ENODEV;
+
+	return usb_errno(libusb_submit_transfer(u->keys));
+}
+
+static void usb_read_cancel(struct transport *t)
+{
+	libusb_cancel_transfer(to_usb(t)->keys);
+}
+
+static int usb_handle_events(struct transport *t, int timeout_msec, int *completed)
+{
+	struct usb *u = to_usb(t);
+	int err;
+
+	if (timeout_msec < 0) {
+		err = libusb_handle_events_completed(u->usb_context, completed);
+	} else {
+		struct timeval tv;
+
+		tv.tv_sec = timeout_msec / 1000;
+		tv.tv_usec = (timeout_msec % 1000) * 1000;
+		err = libusb_handle_events_timeout_completed(u->usb_context, &tv, completed);
+	}
+
+	return usb_errno(err);
+}
+
+static void usb_interrupt(struct transport *t)
+{
+	libusb_interrupt_event_handler(to_usb(t)->usb_context);
+}
+
+static int usb_get_pollfds(struct transport *t, struct pollfd *fds, int max)
+{
+	const struct libusb_pollfd **usb_fds;
+	int i, n;
+
+	usb_fds = libusb_get_pollfds(to_usb(t)->usb_context);
+	if (usb_fds == NULL)
+		return -ENOSYS;
+
+	for (n = 0; usb_fds[n] != NULL; n++)
+		;
+
+	if (fds == NULL) {
+		libusb_free_pollfds(usb_fds);
+		return n;
+	}
+
+	if (n > max) {
+		libusb_free_pollfds(usb_fds);
+		return -ENOSPC;
+	}
+
+	for (i = 0; i < n; i++) {
+		fds[i].fd = usb_fds[i]->fd;
+		fds[i].events = usb_fds[i]->events;
+		fds[i].revents = 0;
+	}
+
+	libusb_free_pollfds(usb_fds);
+
+	return n;
+}
+
+static void usb_pollfd_added(int fd, short events, void *priv)
+{
+	struct usb *u = priv;
+
+	ph_pollfd(u->t.ph, fd, events);
+}
+
+static void usb_pollfd_removed(int fd, void *priv)
+{
+	struct usb *u = priv;
+
+	ph_pollfd(u->t.ph, fd, 0);
+}
+
+static void usb_set_pollfd_notifier(struct transport *t, int enable)
+{
+	struct usb *u = to_usb(t);
+
+	if (enable)
+		libusb_set_pollfd_notifiers(u->usb_context, usb_pollfd_added, usb_pollfd_removed, u);
+	else
+		libusb_set_pollfd_notifiers(u->usb_context, NULL, NULL, NULL);
+}
+
+static int usb_next_timeout(struct transport *t)
+{
+	struct timeval tv;
+
+	if (libusb_get_next_timeout(to_usb(t)->usb_context, &tv) != 1)
+		return -1;
+
+	return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+}
+
+static const struct transport_ops usb_ops = {
+	.name = "usb",
+	.free = usb_free,
+	.reopen = usb_reopen,
+	.control = usb_control,
+	.submit = usb_submit,
+	.cancel = usb_cancel,
+	.read = usb_read,
+	.read_cancel = usb_read_cancel,
+	.handle_events = usb_handle_events,
+	.interrupt = usb_interrupt,
+	.get_pollfds = usb_get_pollfds,
+	.set_pollfd_notifier = usb_set_pollfd_notifier,
+	.next_timeout = usb_next_timeout,
+};
+
+/* Same phone, reports sent over its interrupt OUT endpoint
+ */
+static const struct transport_ops usb_out_ops = {
+	.name = "usb-interrupt",
+	.free = usb_free,
+	.reopen = usb_reopen,
+	.control = usb_out_control,
+	.submit = usb_out_submit,
+	.cancel = usb_cancel,
+	.read = usb_read,
+	.read_cancel = usb_read_cancel,
+	.handle_events = usb_handle_events,
+	.interrupt = usb_interrupt,
+	.get_pollfds = usb_get_pollfds,
+	.set_pollfd_notifier = usb_set_pollfd_notifier,
+	.next_timeout = usb_next_timeout,
+};
+
+static struct ip_usbph *usb_new(struct ip_usbph_ctx *ctx, libusb_context *usb_context,
+                                libusb_device *dev)
+{
+	char path[IP_USBPH_PATH_MAX];
+	struct ip_usbph *ph;
+	struct usb *u;
+
+	u = calloc(1, sizeof(*u));
+	if (u == NULL)
+		return NULL;
+
+	u->ctx = ctx;
+	u->usb_context = usb_context;
+	u->t.shared = (ctx != NULL);
+
+	if (usb_open(u, dev) < 0) {
+		free(u);
+		return NULL;
+	}
+
+	device_path(dev, path, sizeof(path));
+
+	ph = ph_new(&u->t, path);
+	if (ph == NULL) {
+		usb_close(u);
+		free(u);
+	}
+
+	return ph;
+}
+
+struct ip_usbph *ip_usbph_acquire(int index)
+{
+	const char *transport = getenv("IP_USBPH_TRANSPORT");
+	libusb_context *usb_context;
+	libusb_device **usb_list;
+	struct ip_usbph *ph;
+	int err, i;
+	ssize_t usb_devices;
+
+	if (transport != NULL && strcmp(transport, "null") == 0)
+		return ip_usbph_null_new();
+	if (transport != NULL && strcmp(transport, "sim") == 0)
+		return ip_usbph_sim_new();
+	if (transport != NULL && strcmp(transport, "hidraw") == 0)
+		return ip_usbph_hidraw_acquire(index);
+
+	err = libusb_init(&usb_context);
+	if (err < 0)
+		return NULL;
+
+	usb_devices = libusb_get_device_list(usb_context, &usb_list);
+
+	ph = NULL;
+	for (i = 0; i < usb_devices; i++) {
+		if (!is_ip_usbph(usb_list[i]))
+			continue;
+
+		if (index > 0) {
+			index--;
+			continue;
+		}
+
+		ph = usb_new(NULL, usb_context, usb_list[i]);
+		if (ph != NULL)
+			break;
+	}
+
+	if (usb_devices >= 0)
+		libusb_free_device_list(usb_list, 1);
+
+	if (ph == NULL)
+		libusb_exit(usb_context);
+
+	return ph;
+}
+
+static void ctx_add(struct ip_usbph_ctx *ctx, libusb_device *dev)
+{
+	char path[IP_USBPH_PATH_MAX];
+	int i;
+
+	if (!is_ip_usbph(dev))
+		return;
+
+	device_path(dev, path, sizeof(path));
+
+	pthread_mutex_lock(&ctx->lock);
+	for (i = 0; i < ctx->devices; i++) {
+		if (strcmp(ctx->device[i].path, path) == 0) {
+			pthread_mutex_unlock(&ctx->lock);
+			return;
+		}
+	}
+
+	if (ctx->devices == ctx->devices_max) {
+		int max = ctx->devices_max ? ctx->devices_max * 2 : 8;
+		struct ctx_device *device;
+
+		device = realloc(ctx->device, max * sizeof(*device));
+		if (device == NULL) {
+			pthread_mutex_unlock(&ctx->lock);
+			return;
+		}
+		ctx->device = device;
+		ctx->devices_max = max;
+	}
+
+	ctx->device[ctx->devices].dev = libusb_ref_device(dev);
+	strcpy(ctx->device[ctx->devices].path, path);
+	ctx->devices++;
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (ctx->callback != NULL)
+		ctx->callback(ctx, path, 1, ctx->priv);
+}
+
+static void ctx_remove(struct ip_usbph_ctx *ctx, libusb_device *dev)
+{
+	char path[IP_USBPH_PATH_MAX];
+	int i;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (i = 0; i < ctx->devices; i++) {
+		if (ctx->device[i].dev == dev)
+			break;
+	}
+
+	if (i == ctx->devices) {
+		pthread_mutex_unlock(&ctx->lock);
+		return;
+	}
+
+	strcpy(path, ctx->device[i].path);
+	libusb_unref_device(ctx->device[i].dev);
+	ctx->device[i] = ctx->device[--ctx->devices];
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (ctx->callback != NULL)
+		ctx->callback(ctx, path, 0, ctx->priv);
+}
+
+static int ctx_hotplug(libusb_context *usb_context, libusb_device *dev,
+                       libusb_hotplug_event event, void *priv)
+{
+	struct ip_usbph_ctx *ctx = priv;
+
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+		ctx_add(ctx, dev);
+	else
+		ctx_remove(ctx, dev);
+
+	return 0;
+}
+
+struct ip_usbph_ctx *ip_usbph_ctx_new(void)
+{
+	struct ip_usbph_ctx *ctx;
+	int err;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL)
+		return NULL;
+
+	err = libusb_init(&ctx->usb_context);
+	if (err < 0) {
+		free(ctx);
+		return NULL;
+	}
+
+	pthread_mutex_init(&ctx->lock, NULL);
+
+	/* Hotplug enumerates what is already there, then keeps
+	 * the table up to date - no rescans.
+	 */
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		err = libusb_hotplug_register_callback(ctx->usb_context,
+		                LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+		                LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		                LIBUSB_HOTPLUG_ENUMERATE,
+		                0x04d9, 0x0602, LIBUSB_HOTPLUG_MATCH_ANY,
+		                ctx_hotplug, ctx, &ctx->hotplug);
+		ctx->has_hotplug = (err == 0);
+	}
+
+	if (!ctx->has_hotplug) {
+		libusb_device **usb_list;
+		ssize_t i, usb_devices;
+
+		usb_devices = libusb_get_device_list(ctx->usb_context, &usb_list);
+		for (i = 0; i < usb_devices; i++)
+			ctx_add(ctx, usb_list[i]);
+		if (usb_devices >= 0)
+			libusb_free_device_list(usb_list, 1);
+	}
+
+	return ctx;
+}
+
+void ip_usbph_ctx_free(struct ip_usbph_ctx *ctx)
+{
+	int i;
+
+	assert(ctx != NULL);
+
+	if (ctx->has_hotplug)
+		libusb_hotplug_deregister_callback(ctx->usb_context, ctx->hotplug);
+
+	for (i = 0; i < ctx->devices; i++)
+		libusb_unref_device(ctx->device[i].dev);
+	free(ctx->device);
+
+	pthread_mutex_destroy(&ctx->lock);
+	libusb_exit(ctx->usb_context);
+	free(ctx);
+}
+
+int ip_usbph_ctx_devices(struct ip_usbph_ctx *ctx, char (*paths)[IP_USBPH_PATH_MAX], int max)
+{
+	int i, n;
+
+	pthread_mutex_lock(&ctx->lock);
+	n = ctx->devices;
+	for (i = 0; paths != NULL && i < n && i < max; i++)
+		strcpy(paths[i], ctx->device[i].path);
+	pthread_mutex_unlock(&ctx->lock);
+
+	return n;
+}
+
+void ip_usbph_ctx_set_hotplug(struct ip_usbph_ctx *ctx, ip_usbph_hotplug_cb callback, void *priv)
+{
+	ctx->callback = callback;
+	ctx->priv = priv;
+}
+
+int ip_usbph_ctx_handle_events(struct ip_usbph_ctx *ctx, int timeout_msec)
+{
+	struct timeval tv;
+	int err;
+
+	if (timeout_msec < 0)
+		timeout_msec = 0;
+
+	tv.tv_sec = timeout_msec / 1000;
+	tv.tv_usec = (timeout_msec % 1000) * 1000;
+
+	err = libusb_handle_events_timeout_completed(ctx->usb_context, &tv, NULL);
+	if (err < 0 && err != LIBUSB_ERROR_INTERRUPTED)
+		return -EIO;
+
+	return 0;
+}
+
+
+struct ip_usbph *ip_usbph_ctx_acquire(struct ip_usbph_ctx *ctx, const char *path)
+{
+	libusb_device *dev = NULL;
+	struct ip_usbph *ph;
+	int i;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (i = 0; i < ctx->devices; i++) {
+		if (strcmp(ctx->device[i].path, path) == 0) {
+			dev = libusb_ref_device(ctx->device[i].dev);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (dev == NULL)
+		return NULL;
+
+	ph = usb_new(ctx, ctx->usb_context, dev);
+
+	libusb_unref_device(dev);
+
+	return ph;
+}
@@ -7,594 +7,2631 @@
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <errno.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
 #include <malloc.h>
+#include <time.h>
+#include <endian.h>
+#include <pthread.h>
 
-#include <libusb.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 
 #include "ip-usbph.h"
+#include "ip-usbph-private.h"
+#include "ip-usbph-segmap.h"
+#include "ip-usbph-glyphtab.h"
 
 #define ARRAY_SIZE(x) (sizeof(x)/sizeof(x[0]))
 
+#define MARQUEE_MSEC	300	/* Default scroll step */
+#define MARQUEE_GAP	2	/* Blanks between repeats */
+
+typedef enum {
+	ROW_DIGIT,
+	ROW_TOP,
+	ROW_BOT,
+	ROWS,
+} row_id;
+
+#define IO_QUEUE	256	/* Command ring entries, power of two */
+#define KEY_QUEUE	256	/* Key event ring entries, power of two */
+#define FLUSH_WAITERS	16	/* Flush callbacks waiting at once */
+#define IO_IDLE_MSEC	500	/* Longest I/O thread sleep */
+#define RECONNECT_MSEC	250	/* Reconnect retry period */
+
+#define TIMEOUT_MSEC	1000	/* Default transfer timeout */
+#define RETRIES		3	/* Default retries per packet */
+#define BACKOFF_MSEC	20	/* Default first retry delay */
+#define BACKOFF_MAX_MSEC 500	/* Default longest retry delay */
+#define KEY_RETRY_SHIFT	16	/* Key read backoff doublings, at most */
+#define RETRIES_MAX	16
+
+#define CALIBRATE_SAMPLES 9	/* Per measurement, odd for the median */
+#define CALIBRATE_TRIES	4	/* Backoffs before giving up on a rate */
+#define PROFILE_VERSION	1
+
+/* Animation slots - the symbols, then every position of each row */
+#define ANIM_SLOTS	(ARRAY_SIZE(font_symbol) + IP_USBPH_TOP_DIGITS + \
+			 IP_USBPH_TOP_CHARS + IP_USBPH_BOT_CHARS)
+
+/* Commands queued to the I/O thread
+ */
+typedef enum {
+	IO_SYMBOL,
+	IO_TOP_DIGIT,
+	IO_TOP_CHAR,
+	IO_BOT_CHAR,
+	IO_TEXT,
+	IO_SCROLL_RATE,
+	IO_FLUSH_RATE,
+	IO_RETRY,
+	IO_ANIMATE,
+	IO_FRAME,
+	IO_CLEAR,
+	IO_BACKLIGHT,
+	IO_PACKET,
+	IO_FLUSH_HOLD,
+	IO_FLUSH,
+} io_op;
+
+/* Animation of one target, all keyframes precomputed like
+ * the steps of a marquee
+ */
+struct anim {
+	int steps;	/* 0 if not animated */
+	int step;
+	int loop;
+	uint64_t clear[CODES];	/* Bits owned by the target */
+	struct anim_key {
+		uint64_t word[CODES];
+		unsigned dirty;	/* Codes that change entering the keyframe */
+		uint64_t hold_ns;
+	} *key;
+	uint64_t next_ns;
+};
+
+struct io_cmd {
+	io_op op;
+	int index;
+	int value;
+	union {
+		char *text;	/* IO_TEXT, freed by the I/O thread */
+		struct anim *anim;	/* IO_ANIMATE, NULL to stop */
+		struct ip_usbph_retry retry;
+		struct ip_usbph_frame frame;
+		uint8_t packet[8];
+		struct {
+			ip_usbph_flush_cb callback;
+			void *priv;
+		} flush;
+	} u;
+};
+
 struct ip_usbph {
-	libusb_context *usb_context;
-	libusb_device_handle *usb;
+	struct transport *transport;
+	char path[IP_USBPH_PATH_MAX];
+	int lost;	/* Device gone, reconnect pending */
+	int attaching;	/* Reconnect's init packet in flight */
+	uint64_t reconnect_ns;	/* Next reconnect attempt */
 	unsigned code_mask;
 	uint8_t code_set[7][8];
+
+	/* Mirror of what the device has acknowledged, so that
+	 * flushes only send packets whose payload has changed.
+	 */
+	unsigned shadow_valid;
+	uint8_t shadow[7][8];
+
+	struct ip_usbph_retry retry;
+	int retry_fixed;	/* Set by the application */
+
+	/* Measured, or loaded from the cache */
+	struct ip_usbph_profile profile;
+	int profiled;
+
+	/* Pipelined flush - one control transfer per code,
+	 * all in flight at the same time. A code that fails
+	 * waits for its retry on its own, without holding up
+	 * the others.
+	 */
+	struct {
+		uint8_t sent[CODES][8];	/* As submitted */
+		unsigned busy;	/* Mask of codes still in flight */
+		unsigned waiting;	/* Mask of codes waiting to retry */
+		int tries[CODES];
+		uint64_t retry_ns[CODES];
+		int cancel;	/* Set by ip_usbph_flush_cancel() */
+		int done;
+		int err;
+		/* Callbacks, in call order: the first 'carried' are
+		 * for the flush in flight, the rest for the flush
+		 * that will carry their deferred update.
+		 */
+		struct {
+			ip_usbph_flush_cb callback;
+			void *priv;
+		} waiter[FLUSH_WAITERS];
+		int waiters;
+		int carried;
+		uint64_t first_ns;	/* First and last completion */
+		uint64_t last_ns;
+		uint64_t submit_ns[SLOTS];
+	} flush;
+
+	/* Flush rate cap. A flush inside the interval only marks
+	 * the display pending; whatever it shows by the next slot
+	 * is sent then, in one flush. The timers also leave their
+	 * updates pending while a flush is still in flight.
+	 */
+	struct {
+		uint64_t period_ns;	/* 0 if uncapped */
+		uint64_t next_ns;	/* Earliest next flush */
+		int pending;
+		int fixed;	/* Set by the application */
+	} rate;
+
+	/* Holds taken with ip_usbph_flush_hold(). While any is
+	 * taken, flushes only mark the display pending, as above.
+	 */
+	int hold;
+
+	/* Scrolling text, one per row. Every step is precomputed
+	 * as the row's bits in each packet.
+	 */
+	struct marquee {
+		int steps;	/* 0 if not scrolling */
+		int step;
+		uint64_t clear[CODES];	/* Bits owned by the row */
+		uint64_t (*word)[CODES];
+		unsigned *dirty;	/* Codes that change entering a step */
+		uint64_t next_ns;
+	} marquee[ROWS];
+	int marquee_msec;
+
+	/* Animations, one slot per symbol or position */
+	struct anim anim[ANIM_SLOTS];
+	uint64_t anim_mask;	/* Slots animated */
+
+	/* Optional I/O thread. The application thread is the only
+	 * producer of the ring, the I/O thread the only consumer.
+	 */
+	struct {
+		pthread_t thread;
+		int running;
+		int stop;
+		int err;	/* Last error seen by the I/O thread */
+		unsigned head;	/* Written by the producer */
+		unsigned tail;	/* Written by the consumer */
+		struct io_cmd ring[IO_QUEUE];
+	} io;
+
+	/* Key reports. A report read is always in flight, or
+	 * waiting out a backoff after a failed one, and its
+	 * completion is the only producer of the ring.
+	 */
+	struct {
+		int active;	/* Report read in flight, or to retry */
+		int stop;
+		int tries;	/* Failed reads since the last report */
+		uint64_t retry_ns;	/* Resubmit the read then, or 0 */
+		pthread_mutex_t lock;	/* Threaded mode: 'wake' is */
+		pthread_cond_t wake;	/* signalled on every completion */
+		int event;	/* Set on every completion */
+		unsigned dropped;	/* Events lost to a full ring */
+		unsigned head;	/* Written by the producer */
+		unsigned tail;	/* Written by the consumer */
+		struct ip_usbph_key_event ring[KEY_QUEUE];
+	} keys;
+
+	/* External event loop */
+	ip_usbph_pollfd_cb pollfd_cb;
+	void *pollfd_priv;
+
+	struct ip_usbph_stats stats;
+
+	ip_usbph_trace_cb trace_cb;
+	void *trace_priv;
 };
 
-typedef enum {
-	CODE_C1_40 = 1,
-	CODE_C1_45,
-	CODE_C1_4A,
-	CODE_C1_4F,
-	CODE_C1_54,
-	CODE_C1_59,
+/* Is this call to be queued for the I/O thread?
+ */
+static inline int io_queued(struct ip_usbph *ph)
+{
+	return ph->io.running && !pthread_equal(pthread_self(), ph->io.thread);
+}
+
+static int io_push(struct ip_usbph *ph, const struct io_cmd *cmd);
+
+/* Flush order. Codes that share a glyph are sent back to back,
+ * so that a glyph spanning two packets is torn for as short
+ * a time as possible.
+ */
+static const code_id flush_order[CODES] = {
+	CODE_C1_45, CODE_C1_4A, CODE_C1_40,
+	CODE_C1_4F, CODE_C1_54, CODE_C1_59,
 	CODE_61_5E,
-	CODE_MAX,
-} code_id;
-
-static const uint8_t code_set[7][8] = {
-	{ 0x02, 0xC1, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, },
-	{ 0x02, 0xC1, 0x45, 0x00, 0x00, 0x00, 0x00, 0x00, },
-	{ 0x02, 0xC1, 0x4A, 0x00, 0x00, 0x00, 0x00, 0x00, },
-	{ 0x02, 0xC1, 0x4F, 0x00, 0x00, 0x00, 0x00, 0x00, },
-	{ 0x02, 0xC1, 0x54, 0x00, 0x00, 0x00, 0x00, 0x00, },
-	{ 0x02, 0xC1, 0x59, 0x00, 0x00, 0x00, 0x00, 0x00, },
-	{ 0x02, 0x61, 0x5E, 0x00, 0x00, 0x00, 0x00, 0x00, },
 };
 
-static int ip_usbph_init(struct ip_usbph *ph);
+/* Sent to wake the phone up, before anything else */
+static const uint8_t init_packet[8] = { 0x02, 0x00, 0x00, 0x00,
+                                        0x00, 0x00, 0x00, 0x00 };
 
-struct ip_usbph *ip_usbph_acquire(int index)
+static uint64_t now_ns(void)
 {
-	libusb_context *usb_context;
-	libusb_device **usb_list;
-	libusb_device_handle *usb;
-	struct ip_usbph *ph;
-	int err, i;
-	ssize_t usb_devices;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ULL,
+		.tv_nsec = ns % 1000000000ULL,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static int ip_usbph_init(struct ip_usbph *ph);
+static void marquee_stop(struct ip_usbph *ph, row_id row);
+static int anim_slot(ip_usbph_anim_target target, int index, const struct glyph_lut **lut);
+static void anim_stop(struct ip_usbph *ph, int slot);
+static void anim_stop_all(struct ip_usbph *ph);
+static void flush_cancel(struct ip_usbph *ph);
+static void flush_notify(struct ip_usbph *ph, int n, int err);
+static int keys_start(struct ip_usbph *ph);
+static void keys_stop(struct ip_usbph *ph);
+static void keys_resubmit(struct ip_usbph *ph);
+static void keys_retry_cancel(struct ip_usbph *ph);
+static void ph_detach(struct ip_usbph *ph);
+static void profile_acquire(struct ip_usbph *ph);
+
+/* Set up the device behind the handle
+ */
+static int ph_attach(struct ip_usbph *ph)
+{
+	int err;
 
-	err = libusb_init(&usb_context);
+	ph->flush.done = 1;
+
+	err = ip_usbph_init(ph);
+	if (err == 0)
+		err = keys_start(ph);
 	if (err < 0)
-		return NULL;
+		ph_detach(ph);
 
-	usb_devices = libusb_get_device_list(usb_context, &usb_list);
+	return err;
+}
 
-	ph = NULL;
-	for (i = 0; i < usb_devices; i++) {
-		struct libusb_device_descriptor desc;
+/* Stop everything in flight on the device
+ */
+static void ph_detach(struct ip_usbph *ph)
+{
+	keys_stop(ph);
+	flush_cancel(ph);
 
-		err = libusb_get_device_descriptor(usb_list[i], &desc);
-		if (err < 0)
-			continue;
+	if (ph->attaching) {
+		ph->transport->ops->cancel(ph->transport, SLOT_RAW);
+		while (ph->attaching)
+			ph->transport->ops->handle_events(ph->transport, -1, NULL);
+	}
+}
 
-		if (desc.idVendor == 0x04d9 &&
-		    desc.idProduct == 0x0602 &&
-		    desc.iManufacturer == 1 &&
-		    desc.iProduct == 2 &&
-		    desc.iSerialNumber == 0 &&
-		    desc.bNumConfigurations == 1) {
-		    	if (index > 0) {
-		    		index--;
-		    		continue;
-		    	}
-		    
-		    	err = libusb_open(usb_list[i], &usb);
-		    	if (err < 0)
-		    		continue;
-
-		    	err = libusb_detach_kernel_driver(usb, 3);
-		    	if (err < 0 && errno != ENODATA) {
-		    		libusb_close(usb);
-		    		continue;
-		    	}
-
-		    	err = libusb_claim_interface(usb, 3);
-		    	if (err < 0) {
-		    		libusb_close(usb);
-		    		continue;
-		    	}
-
-			ph = calloc(1, sizeof(*ph));
-			assert(ph != NULL);
-			ph->usb = usb;
-			ph->usb_context = usb_context;
-			memcpy(ph->code_set, code_set, sizeof(code_set));
-			err = ip_usbph_init(ph);
-			if (err < 0) {
-				libusb_close(ph->usb);
-				free(ph);
-				ph = NULL;
-			}
-			break;
-		}
+struct ip_usbph *ph_new(struct transport *t, const char *path)
+{
+	struct ip_usbph *ph;
+
+	pthread_condattr_t attr;
+
+	ph = calloc(1, sizeof(*ph));
+	assert(ph != NULL);
+
+	pthread_mutex_init(&ph->keys.lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ph->keys.wake, &attr);
+	pthread_condattr_destroy(&attr);
+
+	ph->transport = t;
+	t->ph = ph;
+	snprintf(ph->path, sizeof(ph->path), "%s", path);
+	memcpy(ph->code_set, code_set, sizeof(code_set));
+	ph->marquee_msec = MARQUEE_MSEC;
+	ph->retry.timeout_msec = TIMEOUT_MSEC;
+	ph->retry.retries = RETRIES;
+	ph->retry.backoff_msec = BACKOFF_MSEC;
+	ph->retry.backoff_max_msec = BACKOFF_MAX_MSEC;
+
+	if (ph_attach(ph) < 0) {
+		t->ph = NULL;
+		pthread_cond_destroy(&ph->keys.wake);
+		pthread_mutex_destroy(&ph->keys.lock);
+		free(ph);
+		return NULL;
 	}
 
-	libusb_free_device_list(usb_list, 1);
+	profile_acquire(ph);
 
 	return ph;
 }
 
-void ip_usbph_release(struct ip_usbph *ph)
+struct transport *ph_transport(struct ip_usbph *ph)
 {
-	assert(ph != NULL);
-	assert(ph->usb != NULL);
+	return ph->transport;
+}
 
-	libusb_close(ph->usb);
-	libusb_exit(ph->usb_context);
-	free(ph);
+/* The device has gone away - try to get it back later
+ */
+static void ph_lost(struct ip_usbph *ph)
+{
+	if (__atomic_load_n(&ph->lost, __ATOMIC_ACQUIRE))
+		return;
+
+	ph->reconnect_ns = now_ns() + RECONNECT_MSEC * 1000000ULL;
+	__atomic_store_n(&ph->lost, 1, __ATOMIC_RELEASE);
 }
 
-static int ip_usbph_raw(struct ip_usbph *ph, const uint8_t cmd[8])
+int ip_usbph_connected(struct ip_usbph *ph)
 {
-	int err;
-	err = libusb_control_transfer(ph->usb, 
-	                      LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
-	                      LIBUSB_REQUEST_SET_CONFIGURATION,
-	                      0x202,
-	                      0x03,
-	                      (uint8_t *)cmd, 8, 0);
+	return !__atomic_load_n(&ph->lost, __ATOMIC_ACQUIRE);
+}
 
-	return (err < 0) ? err : 0;
+const char *ip_usbph_path(struct ip_usbph *ph)
+{
+	return ph->path;
 }
 
-static int ip_usbph_init(struct ip_usbph *ph)
+const char *ip_usbph_transport_name(struct ip_usbph *ph)
 {
-	const uint8_t init[8] = { 0x02, 0x00, 0x00, 0x00,
-		               0x00, 0x00, 0x00, 0x00 };
-	return ip_usbph_raw(ph, init);
+	return ph->transport->ops->name;
 }
 
-/* Save state to a fd
- *
- * Returns length written
- */
-int ip_usbph_state_save(struct ip_usbph *ph, int fd)
+void ip_usbph_release(struct ip_usbph *ph)
 {
-	FILE *ouf = fdopen(dup(fd), "w");
-	int i, j;
+	int i;
 
-	if (ouf == NULL) {
-		return -ENXIO;
-	}
+	assert(ph != NULL);
 
-	for (i = 0; i < ARRAY_SIZE(ph->code_set); i++) {
-		for (j = 0; j < ARRAY_SIZE(ph->code_set[i]); j++) {
-			fprintf(ouf, "0x%.2x%c", ph->code_set[i][j], (j == (ARRAY_SIZE(ph->code_set[i])-1)) ? '\n' : ' ');
-		}
+	ip_usbph_thread_stop(ph);
+
+	for (i = 0; i < ROWS; i++)
+		marquee_stop(ph, i);
+	anim_stop_all(ph);
+
+	/* Don't lose the last update to the rate cap, or a hold */
+	ph->hold = 0;
+	ip_usbph_flush_wait(ph);
+	if (ph->rate.pending) {
+		sleep_until(ph->rate.next_ns);
+		ip_usbph_flush(ph);
 	}
 
-	fclose(ouf);
-	return 5 * ARRAY_SIZE(ph->code_set) * ARRAY_SIZE(ph->code_set[0]);
+	/* Callbacks of updates never sent - the device is away */
+	flush_notify(ph, ph->flush.waiters, -ENODEV);
+
+	ph_detach(ph);
+	ph->transport->ops->free(ph->transport);
+	pthread_cond_destroy(&ph->keys.wake);
+	pthread_mutex_destroy(&ph->keys.lock);
+	free(ph);
 }
 
-/* Restore state from a fd
+/* Log2 histogram of latencies, in usec
  */
-int ip_usbph_state_load(struct ip_usbph *ph, int fd)
+static void stats_latency(uint64_t hist[IP_USBPH_STATS_BUCKETS], uint64_t ns)
 {
-	FILE *ouf = fdopen(dup(fd), "r");
-	int i, j;
+	uint64_t usec = ns / 1000;
+	int n = 0;
 
-	if (ouf == NULL) {
-		return -ENXIO;
-	}
+	if (usec > 1)
+		n = 63 - __builtin_clzll(usec);
+	if (n >= IP_USBPH_STATS_BUCKETS)
+		n = IP_USBPH_STATS_BUCKETS - 1;
 
-	for (i = 0; i < ARRAY_SIZE(ph->code_set); i++) {
-		for (j = 0; j < ARRAY_SIZE(ph->code_set[i]); j++) {
-			int count;
-			count = fscanf(ouf, " 0x%hhx", &ph->code_set[i][j]);
-			if (count != 1) {
-				fclose(ouf);
-				return -EINVAL;
-			}
-		}
+	hist[n]++;
+}
+
+/* Errors are counted where the libusb_error of the same
+ * meaning would be, whichever transport they came from.
+ */
+static const int stats_errno[IP_USBPH_STATS_ERRORS] = {
+	[1] = EIO, [2] = EINVAL, [3] = EACCES, [4] = ENODEV,
+	[5] = ENOENT, [6] = EBUSY, [7] = ETIMEDOUT, [8] = EOVERFLOW,
+	[9] = EPIPE, [10] = EINTR, [11] = ENOMEM, [12] = ENOSYS,
+};
+
+static void stats_error(struct ip_usbph *ph, int err)
+{
+	int n;
+
+	if (err >= 0)
+		return;
+
+	for (n = IP_USBPH_STATS_ERRORS - 1; n > 0; n--) {
+		if (stats_errno[n] == -err)
+			break;
 	}
 
-	fclose(ouf);
-	return 5 * ARRAY_SIZE(ph->code_set) * ARRAY_SIZE(ph->code_set[0]);
+	ph->stats.errors[n]++;
 }
 
+static void trace(struct ip_usbph *ph, int dir, int code, const uint8_t packet[8])
+{
+	struct ip_usbph_trace rec;
 
-int ip_usbph_backlight(struct ip_usbph *ph)
+	if (ph->trace_cb == NULL)
+		return;
+
+	rec.monotonic_ns = now_ns();
+	rec.dir = dir;
+	rec.code = code;
+	memcpy(rec.packet, packet, 8);
+	ph->trace_cb(&rec, ph->trace_priv);
+}
+
+void ip_usbph_trace_set(struct ip_usbph *ph, ip_usbph_trace_cb callback, void *priv)
 {
-	const uint8_t backlight_on_7_sec[8] = { 0x02, 0x64, 0x12, 0x01, 0xFD, 0x00, 0x00, 0x00 };
-	return ip_usbph_raw(ph, backlight_on_7_sec);
+	ph->trace_cb = callback;
+	ph->trace_priv = priv;
 }
 
-int ip_usbph_clear(struct ip_usbph *ph)
+/* Delay before the retry after 'tries' failed tries
+ */
+static uint64_t retry_backoff_ns(struct ip_usbph *ph, int tries)
 {
-	int i;
+	uint64_t msec = (uint64_t)ph->retry.backoff_msec << tries;
 
-	for (i = 0; i < ARRAY_SIZE(ph->code_set); i++) {
-		memset(&ph->code_set[i][3], 0, 5);
-		ip_usbph_raw(ph, &ph->code_set[i][0]);
-	}
-}
+	if (msec > ph->retry.backoff_max_msec)
+		msec = ph->retry.backoff_max_msec;
 
-static const struct {
-	int code;
-	int bit;
-} font_symbol[] = {
-	[IP_USBPH_SYMBOL_DOWN] = { .code = CODE_C1_40, .bit = 21 },
-	[IP_USBPH_SYMBOL_UP] =   { .code = CODE_C1_40, .bit = 22 },
-	[IP_USBPH_SYMBOL_SAT] =  { .code = CODE_C1_45, .bit =  7 },
-	[IP_USBPH_SYMBOL_COLON] = {.code = CODE_C1_4A, .bit =  5 },
-	[IP_USBPH_SYMBOL_FRI] =  { .code = CODE_C1_4A, .bit =  6 },
-	[IP_USBPH_SYMBOL_THU] =  { .code = CODE_C1_4A, .bit =  7 },
-	[IP_USBPH_SYMBOL_M_AND_D]={.code = CODE_C1_4F, .bit =  5 },
-	[IP_USBPH_SYMBOL_TUE] =  { .code = CODE_C1_4F, .bit =  6 },
-	[IP_USBPH_SYMBOL_WED] =  { .code = CODE_C1_4F, .bit =  7 },
-	[IP_USBPH_SYMBOL_MON] =  { .code = CODE_C1_4F, .bit = 30 },
-	[IP_USBPH_SYMBOL_SUN] =  { .code = CODE_C1_4F, .bit = 31 },
-	[IP_USBPH_SYMBOL_OUT] =  { .code = CODE_C1_54, .bit = 29 },
-	[IP_USBPH_SYMBOL_IN] =   { .code = CODE_C1_54, .bit = 30 },
-	[IP_USBPH_SYMBOL_NEW] =  { .code = CODE_C1_54, .bit = 39 },
-	[IP_USBPH_SYMBOL_MUTE] = { .code = CODE_C1_59, .bit =  7 },
-	[IP_USBPH_SYMBOL_LOCK] = { .code = CODE_C1_59, .bit = 15 },
-	[IP_USBPH_SYMBOL_MAN]  = { .code = CODE_C1_59, .bit = 23 },
-	[IP_USBPH_SYMBOL_BALANCE]={.code = CODE_C1_59, .bit = 31 },
-	[IP_USBPH_SYMBOL_DECIMAL]={.code = CODE_61_5E, .bit =  7 },
-};
+	return msec * 1000000ULL;
+}
 
-static inline int code_bit(struct ip_usbph *ph, code_id code, int bit, int is_on)
+static int ip_usbph_raw(struct ip_usbph *ph, const uint8_t cmd[8])
 {
-	uint8_t *cmd;
+	uint64_t start;
+	int tries = 0;
+	int err;
 
-	if (code == 0 || code >= CODE_MAX) {
-		return -EINVAL;
-	}
+	for (;;) {
+		trace(ph, IP_USBPH_TRACE_OUT, 0, cmd);
 
-	cmd = &ph->code_set[code-1][0];
+		start = now_ns();
+		err = ph->transport->ops->control(ph->transport, cmd, ph->retry.timeout_msec);
+		if (err == -ENODEV)
+			ph_lost(ph);
 
-	if (is_on) {
-		cmd[3 + (bit/8)] |= 1 << (bit % 8);
-	} else {
-		cmd[3 + (bit/8)] &= ~(1 << (bit % 8));
+		stats_latency(ph->stats.control_usec, now_ns() - start);
+		stats_error(ph, err);
+		if (err >= 0) {
+			ph->stats.packets[IP_USBPH_STATS_CODES - 1]++;
+			ph->stats.bytes += 8;
+			break;
+		}
+
+		if (err == -ENODEV || tries == ph->retry.retries)
+			break;
+
+		if (__atomic_exchange_n(&ph->flush.cancel, 0, __ATOMIC_ACQ_REL)) {
+			err = -ECANCELED;
+			break;
+		}
+
+		/* Back off before trying again */
+		sleep_until(now_ns() + retry_backoff_ns(ph, tries++));
+		ph->stats.retries++;
 	}
 
-	ph->code_mask |= (1 << (code-1));
+	return err;
+}
+
+/* Wait for the flush that carries the update, or -EAGAIN if
+ * too many callbacks already are
+ */
+static int flush_waiter(struct ip_usbph *ph, ip_usbph_flush_cb callback, void *priv)
+{
+	if (callback == NULL)
+		return 0;
+
+	if (ph->flush.waiters == FLUSH_WAITERS)
+		return -EAGAIN;
+
+	ph->flush.waiter[ph->flush.waiters].callback = callback;
+	ph->flush.waiter[ph->flush.waiters].priv = priv;
+	ph->flush.waiters++;
 
 	return 0;
 }
 
-int ip_usbph_flush(struct ip_usbph *ph)
+/* Call the first 'n' callbacks with 'err'. They are taken off
+ * first, as any of them may flush again.
+ */
+static void flush_notify(struct ip_usbph *ph, int n, int err)
 {
+	typeof(ph->flush.waiter[0]) waiter[FLUSH_WAITERS];
 	int i;
-	int err = 0;
 
-	for (i = 0; i < CODE_MAX && err == 0; i++) {
-		if (ph->code_mask & (1 << i)) {
-			err = ip_usbph_raw(ph, &ph->code_set[i][0]);
-		}
-	}
+	if (n == 0)
+		return;
 
-	ph->code_mask = 0;
+	memcpy(waiter, ph->flush.waiter, n * sizeof(waiter[0]));
+	ph->flush.waiters -= n;
+	memmove(&ph->flush.waiter[0], &ph->flush.waiter[n],
+	        ph->flush.waiters * sizeof(waiter[0]));
+	ph->flush.carried = 0;
 
-	return err;
+	for (i = 0; i < n; i++)
+		waiter[i].callback(ph, err, waiter[i].priv);
 }
 
-int ip_usbph_symbol(struct ip_usbph *ph, ip_usbph_sym sym, int is_on)
+/* Complete the flush, once nothing is in flight or waiting
+ */
+static void flush_complete(struct ip_usbph *ph)
 {
-	return code_bit(ph, font_symbol[sym].code, font_symbol[sym].bit, is_on);
+	if (ph->flush.done || ph->flush.busy != 0 || ph->flush.waiting != 0)
+		return;
+
+	ph->flush.done = 1;
+	flush_notify(ph, ph->flush.carried, ph->flush.err);
 }
 
-#define SEG_T	0
-#define SEG_B	1
-#define SEG_TL	2
-#define SEG_TR	3
-#define SEG_BL	4
-#define SEG_BR	5
-#define SEG_M	6
-#define SEG_E	7
+/* A transfer of code 'i' failed. It stays dirty, and is tried
+ * again later, or left for the next flush.
+ */
+static void flush_failed(struct ip_usbph *ph, int i, int err)
+{
+	/* No idea what the device has now */
+	ph->shadow_valid &= ~(1 << i);
+	ph->code_mask |= (1 << i);
+
+	if (err == -ENODEV)
+		ph_lost(ph);
+
+	if (err != -ENODEV && err != -ECANCELED &&
+	    ph->flush.tries[i] < ph->retry.retries) {
+		ph->flush.retry_ns[i] = now_ns() + retry_backoff_ns(ph, ph->flush.tries[i]++);
+		ph->flush.waiting |= (1 << i);
+		return;
+	}
 
-static const struct {
-	code_id code;
-	int bit;
-} xref_digit_segment[11][8] = {
-	[0] = {
-		[SEG_E] = { .code = CODE_C1_54, .bit = 31 },
-	},
-	[1] = {
-		[SEG_BR] = { .code = CODE_C1_54, .bit = 13 },
-		[SEG_M] = { .code = CODE_C1_54, .bit = 14 },
-		[SEG_TR] = { .code = CODE_C1_54, .bit = 15 },
-		[SEG_T] = { .code = CODE_C1_54, .bit = 16 },
-		[SEG_B] = { .code = CODE_C1_54, .bit = 21 },
-		[SEG_BL] = { .code = CODE_C1_54, .bit = 22 },
-		[SEG_TL] = { .code = CODE_C1_54, .bit = 23 },
-	},
-	[2] = {
-		[SEG_T] = { .code = CODE_C1_4F, .bit = 32 },
-		[SEG_B] = { .code = CODE_C1_4F, .bit = 37 },
-		[SEG_BR] = { .code = CODE_C1_4F, .bit = 38 },
-		[SEG_TR] = { .code = CODE_C1_4F, .bit = 39 },
-		[SEG_BL] = { .code = CODE_C1_54, .bit = 5 },
-		[SEG_M] = { .code = CODE_C1_54, .bit = 6 },
-		[SEG_TL] = { .code = CODE_C1_54, .bit = 7 },
-	},
-	[3] = {
-		[SEG_E] = { .code = CODE_C1_4F, .bit = 29 },
-	},
-	[4] = {
-		[SEG_T] = { .code = CODE_C1_4F, .bit = 8 },
-		[SEG_B] = { .code = CODE_C1_4F, .bit = 13 },
-		[SEG_BR] = { .code = CODE_C1_4F, .bit = 14 },
-		[SEG_TR] = { .code = CODE_C1_4F, .bit = 15 },
-		[SEG_BL] = { .code = CODE_C1_4F, .bit = 21 },
-		[SEG_M] = { .code = CODE_C1_4F, .bit = 22 },
-		[SEG_TL] = { .code = CODE_C1_4F, .bit = 23 },
-	},
-	[5] = {
-		[SEG_BL] = { .code = CODE_C1_40, .bit = 5 },
-		[SEG_M] = { .code = CODE_C1_40, .bit = 6 },
-		[SEG_TL] = { .code = CODE_C1_40, .bit = 7 },
-		[SEG_T] = { .code = CODE_C1_40, .bit = 8 },
-		[SEG_B] = { .code = CODE_C1_40, .bit = 13 },
-		[SEG_BR] = { .code = CODE_C1_40, .bit = 14 },
-		[SEG_TR] = { .code = CODE_C1_40, .bit = 15 },
-	},
-	[6] = {
-		[SEG_BL] = { .code = CODE_C1_40, .bit = 29 },
-		[SEG_M] = { .code = CODE_C1_40, .bit = 30 },
-		[SEG_TL] = { .code = CODE_C1_40, .bit = 31 },
-		[SEG_T] = { .code = CODE_C1_40, .bit = 32 },
-		[SEG_B] = { .code = CODE_C1_40, .bit = 37 },
-		[SEG_BR] = { .code = CODE_C1_40, .bit = 38 },
-		[SEG_TR] = { .code = CODE_C1_40, .bit = 39 },
-	},
-	[7] = {
-		[SEG_T] = { .code = CODE_C1_4A, .bit = 24 },
-		[SEG_B] = { .code = CODE_C1_4A, .bit = 29 },
-		[SEG_BR] = { .code = CODE_C1_4A, .bit = 30 },
-		[SEG_TR] = { .code = CODE_C1_4A, .bit = 31 },
-		[SEG_BL] = { .code = CODE_C1_4A, .bit = 37 },
-		[SEG_M] = { .code = CODE_C1_4A, .bit = 38 },
-		[SEG_TL] = { .code = CODE_C1_4A, .bit = 39 },
-	},
-	[8] = {
-		[SEG_T] = { .code = CODE_C1_4A, .bit = 8 },
-		[SEG_B] = { .code = CODE_C1_4A, .bit = 13 },
-		[SEG_BR] = { .code = CODE_C1_4A, .bit = 14 },
-		[SEG_TR] = { .code = CODE_C1_4A, .bit = 15 },
-		[SEG_BL] = { .code = CODE_C1_4A, .bit = 21 },
-		[SEG_M] = { .code = CODE_C1_4A, .bit = 22 },
-		[SEG_TL] = { .code = CODE_C1_4A, .bit = 23 },
-	},
-	[9] = {
-		[SEG_T] = { .code = CODE_C1_45, .bit = 24 },
-		[SEG_B] = { .code = CODE_C1_45, .bit = 29 },
-		[SEG_BR] = { .code = CODE_C1_45, .bit = 30 },
-		[SEG_TR] = { .code = CODE_C1_45, .bit = 31 },
-		[SEG_BL] = { .code = CODE_C1_45, .bit = 37 },
-		[SEG_M] = { .code = CODE_C1_45, .bit = 38 },
-		[SEG_TL] = { .code = CODE_C1_45, .bit = 39 },
-	},
-	[10] = {
-		[SEG_T] = { .code = CODE_C1_45, .bit = 6 },
-		[SEG_B] = { .code = CODE_C1_45, .bit = 13 },
-		[SEG_BR] = { .code = CODE_C1_45, .bit = 14 },
-		[SEG_TR] = { .code = CODE_C1_45, .bit = 15 },
-		[SEG_BL] = { .code = CODE_C1_45, .bit = 21 },
-		[SEG_M] = { .code = CODE_C1_45, .bit = 22 },
-		[SEG_TL] = { .code = CODE_C1_45, .bit = 23 },
-	},
-};
+	if (ph->flush.err == 0)
+		ph->flush.err = err;
+}
 
-int ip_usbph_top_digit(struct ip_usbph *ph, int index, ip_usbph_digit digit)
+/* Put the content of code 'i' on the wire. While flushes are
+ * held, a retry resends what it sent before, and the code stays
+ * dirty for the flush after the hold.
+ */
+static int flush_submit(struct ip_usbph *ph, int i)
 {
-	int i;
+	int err;
 
-	if (index != 0 && index != 3) {
-		for (i = 0; i < 7; i++) {
-			code_bit(ph,
-				 xref_digit_segment[index][i].code,
-			         xref_digit_segment[index][i].bit,
-			         digit & (1 << i));
-		}
-	} else if (index >= 0 && index < 11) {
-		i = 7;
+	if (!ph->hold)
+		memcpy(&ph->flush.sent[i][0], &ph->code_set[i][0], 8);
+	trace(ph, IP_USBPH_TRACE_OUT, i + 1, &ph->flush.sent[i][0]);
+	ph->flush.submit_ns[i] = now_ns();
+	err = ph->transport->ops->submit(ph->transport, i, &ph->flush.sent[i][0],
+	                                 ph->retry.timeout_msec);
+	stats_error(ph, err);
+	if (err < 0)
+		return err;
 
-		code_bit(ph,
-			 xref_digit_segment[index][i].code,
-		         xref_digit_segment[index][i].bit,
-		         digit & (1 << i));
-	} else {
-		return -EINVAL;
-	}
+	ph->flush.busy |= (1 << i);
+	if (!ph->hold)
+		ph->code_mask &= ~(1 << i);
+	ph->stats.packets[i]++;
+	ph->stats.bytes += 8;
 
 	return 0;
 }
 
-/*
- * SEG0 - B  / BC  / TC / T
- * SEG1 - BR / BRX / RC / TRX / TR
- * SEG2 - BL / BLX / LC / TLX / TL
+/* Send the codes whose retry is due, with whatever they show now
  */
-static const struct {
-	code_id code;
-	int bit;
-} top_char_seg[][3] = {
-	[0] = {
-		{ .code = CODE_C1_54, .bit = 17 },
-		{ .code = CODE_C1_54, .bit = 8 },
-		{ .code = CODE_C1_54, .bit = 24 },
-	},
-	[1] = {
-		{ .code = CODE_C1_4F, .bit = 33 },
-		{ .code = CODE_C1_4F, .bit = 24 },
-		{ .code = CODE_C1_54, .bit =  0 },
-	},
-	[2] = {
-		{ .code = CODE_C1_4F, .bit =  9 },
-		{ .code = CODE_C1_4F, .bit =  0 },
-		{ .code = CODE_C1_4F, .bit = 16 },
-	},
-	[3] = {
-		{ .code = CODE_C1_40, .bit =  9 },
-		{ .code = CODE_C1_40, .bit = 16 },
-		{ .code = CODE_C1_40, .bit =  0 },
-	},
-	[4] = {
-		{ .code = CODE_C1_40, .bit = 33 },
-		{ .code = CODE_C1_4A, .bit = 32 },
-		{ .code = CODE_C1_40, .bit = 24 },
-	},
-	[5] = {
-		{ .code = CODE_C1_4A, .bit = 25 },
-		{ .code = CODE_C1_4A, .bit = 16 },
-		{ .code = CODE_C1_45, .bit =  0 },
-	},
-	[6] = {
-		{ .code = CODE_C1_4A, .bit =  9 },
-		{ .code = CODE_C1_4A, .bit =  0 },
-		{ .code = CODE_C1_45, .bit =  8 },
-	},
-	[7] = {
-		{ .code = CODE_C1_45, .bit = 25 },
-		{ .code = CODE_C1_45, .bit = 16 },
-		{ .code = CODE_C1_45, .bit = 32 },
-	},
-};
+static void flush_retry(struct ip_usbph *ph)
+{
+	uint64_t now;
+	int i, err;
 
-/*
- * SEG0 - B  / BC  / TC / T
- * SEG1 - BR / BRX / RC / TRX / TR
- * SEG2 - BL / BLX / LC / TLX / TL
+	if (ph->flush.waiting == 0)
+		return;
+
+	now = now_ns();
+	for (i = 0; i < CODES; i++) {
+		if (!(ph->flush.waiting & (1 << i)) || now < ph->flush.retry_ns[i])
+			continue;
+
+		ph->flush.waiting &= ~(1 << i);
+		ph->stats.retries++;
+
+		/* Gone since - the reconnect replays everything */
+		if (__atomic_load_n(&ph->lost, __ATOMIC_ACQUIRE))
+			continue;
+
+		err = flush_submit(ph, i);
+		if (err < 0)
+			flush_failed(ph, i, err);
+	}
+
+	flush_complete(ph);
+}
+
+/* Earliest retry, or 0 if none
  */
-static const struct {
-	ip_usbph_char mask;
-	int seg;
-	int bit;
-} top_seg_map[14] = {
-	{ .mask = IP_USBPH_SEG_B,   .seg = 0, .bit = 0 },
-	{ .mask = IP_USBPH_SEG_BC,  .seg = 0, .bit = 1 },
-	{ .mask = IP_USBPH_SEG_TC,  .seg = 0, .bit = 2 },
-	{ .mask = IP_USBPH_SEG_T,   .seg = 0, .bit = 3 },
-	{ .mask = IP_USBPH_SEG_BR,  .seg = 1, .bit = 0 },
-	{ .mask = IP_USBPH_SEG_BRX, .seg = 1, .bit = 1 },
-	{ .mask = IP_USBPH_SEG_RC,  .seg = 1, .bit = 2 },
-	{ .mask = IP_USBPH_SEG_TRX, .seg = 1, .bit = 3 },
-	{ .mask = IP_USBPH_SEG_TR,  .seg = 1, .bit = 4 },
-	{ .mask = IP_USBPH_SEG_BL,  .seg = 2, .bit = 0 },
-	{ .mask = IP_USBPH_SEG_BLX, .seg = 2, .bit = 1 },
-	{ .mask = IP_USBPH_SEG_LC,  .seg = 2, .bit = 2 },
-	{ .mask = IP_USBPH_SEG_TLX, .seg = 2, .bit = 3 },
-	{ .mask = IP_USBPH_SEG_TL,  .seg = 2, .bit = 4 },
-};
+static uint64_t flush_retry_next(struct ip_usbph *ph)
+{
+	uint64_t next = 0;
+	int i;
 
-int ip_usbph_top_char(struct ip_usbph *ph, int index, ip_usbph_char ch)
+	for (i = 0; i < CODES; i++) {
+		if ((ph->flush.waiting & (1 << i)) &&
+		    (next == 0 || ph->flush.retry_ns[i] < next))
+			next = ph->flush.retry_ns[i];
+	}
+
+	return next;
+}
+
+/* The init packet of a reconnect has completed
+ */
+static void ph_attached(struct ip_usbph *ph, int err)
+{
+	ph->attaching = 0;
+
+	stats_latency(ph->stats.control_usec, now_ns() - ph->flush.submit_ns[SLOT_RAW]);
+	if (err != -ECANCELED)
+		stats_error(ph, err);
+
+	/* Still lost - try again at the next reconnect */
+	if (err < 0 || keys_start(ph) < 0)
+		return;
+
+	ph->stats.packets[IP_USBPH_STATS_CODES - 1]++;
+	ph->stats.bytes += 8;
+	__atomic_store_n(&ph->lost, 0, __ATOMIC_RELEASE);
+
+	/* The phone comes back blank. Send it the display once,
+	 * with everything done while it was away folded in.
+	 */
+	ph->shadow_valid = 0;
+	ph->code_mask = (1 << CODES) - 1;
+	ip_usbph_flush_async(ph, NULL, NULL);
+}
+
+void ph_flush_done(struct ip_usbph *ph, int code, int err)
+{
+	if (code == SLOT_RAW) {
+		ph_attached(ph, err);
+		return;
+	}
+
+	ph->flush.last_ns = now_ns();
+	if (ph->flush.first_ns == 0)
+		ph->flush.first_ns = ph->flush.last_ns;
+
+	stats_latency(ph->stats.control_usec, ph->flush.last_ns - ph->flush.submit_ns[code]);
+	if (err != -ECANCELED)
+		stats_error(ph, err);
+
+	ph->flush.busy &= ~(1 << code);
+
+	if (err == 0) {
+		memcpy(&ph->shadow[code][0], &ph->flush.sent[code][0], 8);
+		ph->shadow_valid |= (1 << code);
+	} else {
+		flush_failed(ph, code, err);
+	}
+
+	flush_complete(ph);
+}
+
+/* Cancel everything in flight, and drop the retries still to
+ * come, without waiting. The codes all stay dirty.
+ */
+static void flush_abort(struct ip_usbph *ph)
 {
 	int i;
 
-	if (ch & IP_USBPH_SEG_M) {
-		ch |= IP_USBPH_SEG_RC | IP_USBPH_SEG_LC;
+	if (ph->flush.waiting != 0) {
+		ph->flush.waiting = 0;
+		if (ph->flush.err == 0)
+			ph->flush.err = -ECANCELED;
 	}
 
-	for (i = 0; i < 14; i++) {
-		code_bit(ph,
-			 top_char_seg[index][top_seg_map[i].seg].code,
-			 top_char_seg[index][top_seg_map[i].seg].bit +
-			   top_seg_map[i].bit, top_seg_map[i].mask & ch);
+	for (i = 0; i < CODES; i++) {
+		if (ph->flush.busy & (1 << i))
+			ph->transport->ops->cancel(ph->transport, i);
 	}
 
-	return 0;
+	flush_complete(ph);
 }
 
-/*
- * SEG0 - T  / TL  / TLX / LC / BC  / BLX / BL
- * SEG1 - TR / TRX / TC  / RC / BRC / BR  / B
+static void flush_cancel(struct ip_usbph *ph)
+{
+	if (ph->flush.done)
+		return;
+
+	flush_abort(ph);
+	ip_usbph_flush_wait(ph);
+}
+
+/* Act on ip_usbph_flush_cancel() from another thread
  */
-static const struct {
-	ip_usbph_char mask;
-	int seg;
-	int bit;
-} bot_seg_map[14] = {
-	{ .mask = IP_USBPH_SEG_T,   .seg = 0, .bit = 0 },
-	{ .mask = IP_USBPH_SEG_TL,  .seg = 0, .bit = 1 },
-	{ .mask = IP_USBPH_SEG_TLX, .seg = 0, .bit = 2 },
-	{ .mask = IP_USBPH_SEG_LC,  .seg = 0, .bit = 3 },
-	{ .mask = IP_USBPH_SEG_BC,  .seg = 0, .bit = 4 },
-	{ .mask = IP_USBPH_SEG_BLX, .seg = 0, .bit = 5 },
-	{ .mask = IP_USBPH_SEG_BL,  .seg = 0, .bit = 6 },
-	{ .mask = IP_USBPH_SEG_TR,  .seg = 1, .bit = 0 },
-	{ .mask = IP_USBPH_SEG_TRX, .seg = 1, .bit = 1 },
-	{ .mask = IP_USBPH_SEG_TC,  .seg = 1, .bit = 2 },
-	{ .mask = IP_USBPH_SEG_RC,  .seg = 1, .bit = 3 },
-	{ .mask = IP_USBPH_SEG_BRX, .seg = 1, .bit = 4 },
-	{ .mask = IP_USBPH_SEG_BR,  .seg = 1, .bit = 5 },
-	{ .mask = IP_USBPH_SEG_B,   .seg = 1, .bit = 6 },
-};
+static void flush_check_cancel(struct ip_usbph *ph)
+{
+	if (__atomic_exchange_n(&ph->flush.cancel, 0, __ATOMIC_ACQ_REL) && !ph->flush.done)
+		flush_abort(ph);
+}
 
-static const struct {
-	code_id code;
-	int bit;
-} bot_char_seg[][2] = {
-	[0] = {
-		{ .code = CODE_C1_54, .bit = 32 },
-		{ .code = CODE_C1_59, .bit =  0 },
-	},
-	[1] = {
-		{ .code = CODE_C1_59, .bit =  8 },
-		{ .code = CODE_C1_59, .bit = 16 },
-	},
-	[2] = {
-		{ .code = CODE_C1_59, .bit = 24 },
-		{ .code = CODE_C1_59, .bit = 32 },
-	},
-	[3] = {
-		{ .code = CODE_61_5E, .bit =  0 },
-		{ .code = CODE_61_5E, .bit =  8 },
-	},
-};
+void ip_usbph_flush_cancel(struct ip_usbph *ph)
+{
+	__atomic_store_n(&ph->flush.cancel, 1, __ATOMIC_RELEASE);
+	ph->transport->ops->interrupt(ph->transport);
+}
 
-int ip_usbph_bot_char(struct ip_usbph *ph, int index, ip_usbph_char ch)
+/* Find the device at our path again, and send it the init
+ * packet. Run from the timers, so nothing here waits: the rest
+ * is done by ph_attached(), once the packet is acknowledged.
+ */
+static void ph_reconnect(struct ip_usbph *ph)
+{
+	int err;
+
+	ph->reconnect_ns = now_ns() + RECONNECT_MSEC * 1000000ULL;
+
+	/* Everything in flight has already failed. Cancel what is
+	 * left, and try again once it has all completed.
+	 */
+	__atomic_store_n(&ph->keys.stop, 1, __ATOMIC_RELEASE);
+	keys_retry_cancel(ph);
+	if (ph->keys.active)
+		ph->transport->ops->read_cancel(ph->transport);
+	if (!ph->flush.done)
+		flush_abort(ph);
+	if (ph->keys.active || !ph->flush.done)
+		return;
+
+	if (ph->transport->ops->reopen(ph->transport) < 0)
+		return;
+
+	trace(ph, IP_USBPH_TRACE_OUT, 0, init_packet);
+	ph->flush.submit_ns[SLOT_RAW] = now_ns();
+	err = ph->transport->ops->submit(ph->transport, SLOT_RAW, init_packet,
+	                                 ph->retry.timeout_msec);
+	stats_error(ph, err);
+	if (err == 0)
+		ph->attaching = 1;
+}
+
+static int ip_usbph_init(struct ip_usbph *ph)
 {
+	return ip_usbph_raw(ph, init_packet);
+}
+
+/* State snapshot, little endian:
+ *
+ *   0  magic "IPPH"
+ *   4  version
+ *   5  number of codes
+ *   6  reserved, zero
+ *   8  device path, NUL padded
+ *  40  code packets, 8 bytes each
+ *  96  CRC-32 of bytes 0..95
+ */
+#define STATE_MAGIC	"IPPH"
+#define STATE_VERSION	1
+#define STATE_PATH	8
+#define STATE_CODES	(STATE_PATH + IP_USBPH_PATH_MAX)
+#define STATE_CRC	(STATE_CODES + CODES * 8)
+#define STATE_SIZE	(STATE_CRC + 4)
+#define STATE_TEXT_MAX	(CODES * 8 * 5 + 64)	/* The old text format, with slack */
+
+static uint32_t crc32(const uint8_t *buff, size_t len)
+{
+	uint32_t crc = ~0;
 	int i;
 
-	if (ch & IP_USBPH_SEG_M) {
-		ch |= IP_USBPH_SEG_RC | IP_USBPH_SEG_LC;
+	while (len-- > 0) {
+		crc ^= *buff++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
 	}
 
-	for (i = 0; i < 14; i++) {
-		code_bit(ph,
-			 bot_char_seg[index][bot_seg_map[i].seg].code,
-			 bot_char_seg[index][bot_seg_map[i].seg].bit +
-			   bot_seg_map[i].bit, bot_seg_map[i].mask & ch);
+	return ~crc;
+}
+
+/* Save state to a fd
+ *
+ * Returns length written
+ */
+int ip_usbph_state_save(struct ip_usbph *ph, int fd)
+{
+	uint8_t buff[STATE_SIZE] = { 0 };
+	uint32_t crc;
+	ssize_t len;
+
+	if (ph->io.running) {
+		return -EBUSY;
 	}
 
-	return 0;
+	memcpy(&buff[0], STATE_MAGIC, 4);
+	buff[4] = STATE_VERSION;
+	buff[5] = CODES;
+	strncpy((char *)&buff[STATE_PATH], ph->path, IP_USBPH_PATH_MAX);
+	memcpy(&buff[STATE_CODES], ph->code_set, CODES * 8);
+	crc = htole32(crc32(buff, STATE_CRC));
+	memcpy(&buff[STATE_CRC], &crc, 4);
+
+	len = write(fd, buff, sizeof(buff));
+	if (len < 0)
+		return -errno;
+	if (len != sizeof(buff))
+		return -ENOSPC;
+
+	return len;
 }
 
-uint8_t ip_usbph_key_get(struct ip_usbph *ph, int timeout_msec)
+/* Restore state from a fd
+ *
+ * Returns length read
+ */
+/* Show the saved display packets, 8 bytes each
+ */
+static void state_apply(struct ip_usbph *ph, const uint8_t *codes)
 {
-	uint8_t code;
-	int status;
-	int err;
-	int len;
-	uint8_t report[8];
-		
-	err = libusb_interrupt_transfer(ph->usb, 0x81, report, sizeof(report), &len, timeout_msec);
-	if (err == LIBUSB_ERROR_TIMEOUT)
-		return IP_USBPH_KEY_IDLE;
+	int i;
 
-	if (err < 0)
-		return IP_USBPH_KEY_ERROR;
+	for (i = 0; i < ROWS; i++)
+		marquee_stop(ph, i);
+	anim_stop_all(ph);
+
+	/* Only the payloads are state - the headers are fixed.
+	 * Codes the device already shows are left clean.
+	 */
+	for (i = 0; i < CODES; i++) {
+		const uint8_t *payload = &codes[i * 8 + 3];
 
-	/* Skip over non-key reports */
-	if (len != sizeof(report))
-		return IP_USBPH_KEY_IDLE;
+		memcpy(&ph->code_set[i][3], payload, 5);
+		if (!(ph->shadow_valid & (1 << i)) ||
+		    memcmp(&ph->shadow[i][3], payload, 5) != 0)
+			ph->code_mask |= (1 << i);
+	}
+}
+
+/* Before snapshots, state was saved as text: every byte of the
+ * display packets as "0x%.2x", a packet to a line. 'head' is
+ * what has already been read of it.
+ */
+static int state_load_text(struct ip_usbph *ph, int fd, const uint8_t *head, size_t len)
+{
+	char text[STATE_TEXT_MAX + 1];
+	uint8_t codes[CODES * 8];
+	ssize_t n;
+	int i, pos, off = 0;
+
+	memcpy(text, head, len);
+	while (len < STATE_TEXT_MAX) {
+		n = read(fd, &text[len], STATE_TEXT_MAX - len);
+		if (n < 0)
+			return -errno;
+		if (n == 0)
+			break;
+		len += n;
+	}
+	text[len] = 0;
 
-	if (report[0] != 0x02 ||
-	    report[1] != 0x61 ||
-	    report[2] != 0x90) {
-	    	return IP_USBPH_KEY_IDLE;
+	for (i = 0; i < CODES * 8; i++) {
+		if (sscanf(&text[off], " 0x%hhx%n", &codes[i], &pos) != 1)
+			return -EINVAL;
+		off += pos;
 	}
 
-	return report[3];
+	for (i = 0; i < CODES; i++) {
+		if (memcmp(&codes[i * 8], code_set[i], 3) != 0)
+			return -EINVAL;
+	}
+
+	state_apply(ph, codes);
+
+	return len;
+}
+
+int ip_usbph_state_load(struct ip_usbph *ph, int fd)
+{
+	uint8_t buff[STATE_SIZE];
+	uint32_t crc;
+	ssize_t len;
+
+	if (ph->io.running) {
+		return -EBUSY;
+	}
+
+	len = read(fd, buff, sizeof(buff));
+	if (len < 0)
+		return -errno;
+	if (len < 4 || memcmp(&buff[0], STATE_MAGIC, 4) != 0)
+		return state_load_text(ph, fd, buff, len);
+	if (len != sizeof(buff))
+		return -EINVAL;
+
+	memcpy(&crc, &buff[STATE_CRC], 4);
+	if (buff[4] != STATE_VERSION ||
+	    buff[5] != CODES ||
+	    le32toh(crc) != crc32(buff, STATE_CRC)) {
+		return -EINVAL;
+	}
+
+	/* Another phone's snapshot */
+	if (buff[STATE_PATH] != 0 &&
+	    strncmp((char *)&buff[STATE_PATH], ph->path, IP_USBPH_PATH_MAX) != 0)
+		return -ENXIO;
+
+	state_apply(ph, &buff[STATE_CODES]);
+
+	return len;
+}
+
+int ip_usbph_backlight(struct ip_usbph *ph)
+{
+	const uint8_t backlight_on_7_sec[8] = { 0x02, 0x64, 0x12, 0x01, 0xFD, 0x00, 0x00, 0x00 };
+
+	if (io_queued(ph)) {
+		struct io_cmd cmd = { .op = IO_BACKLIGHT };
+		return io_push(ph, &cmd);
+	}
+
+	return ip_usbph_raw(ph, backlight_on_7_sec);
+}
+
+int ip_usbph_clear(struct ip_usbph *ph)
+{
+	int i;
+
+	if (io_queued(ph)) {
+		struct io_cmd cmd = { .op = IO_CLEAR };
+		return io_push(ph, &cmd);
+	}
+
+	for (i = 0; i < ROWS; i++)
+		marquee_stop(ph, i);
+	anim_stop_all(ph);
+
+	for (i = 0; i < ARRAY_SIZE(ph->code_set); i++) {
+		memset(&ph->code_set[i][3], 0, 5);
+	}
+
+	/* Codes already known to be blank are skipped by the flush */
+	ph->code_mask = (1 << CODES) - 1;
+
+	return ip_usbph_flush(ph);
+}
+
+int ip_usbph_packet_put(struct ip_usbph *ph, const uint8_t packet[8])
+{
+	int i;
+
+	if (io_queued(ph)) {
+		struct io_cmd cmd = { .op = IO_PACKET };
+
+		memcpy(cmd.u.packet, packet, 8);
+		return io_push(ph, &cmd);
+	}
+
+	for (i = 0; i < CODES; i++) {
+		if (memcmp(packet, code_set[i], 3) == 0) {
+			memcpy(&ph->code_set[i][3], &packet[3], 5);
+			ph->code_mask |= (1 << i);
+			return 0;
+		}
+	}
+
+	return ip_usbph_raw(ph, packet);
+}
+
+static inline int code_bit(struct ip_usbph *ph, code_id code, int bit, int is_on)
+{
+	uint8_t *cmd;
+
+	if (code == 0 || code >= CODE_MAX) {
+		return -EINVAL;
+	}
+
+	cmd = &ph->code_set[code-1][0];
+
+	if (is_on) {
+		cmd[3 + (bit/8)] |= 1 << (bit % 8);
+	} else {
+		cmd[3 + (bit/8)] &= ~(1 << (bit % 8));
+	}
+
+	ph->code_mask |= (1 << (code-1));
+
+	return 0;
+}
+
+int ip_usbph_flush_async(struct ip_usbph *ph, ip_usbph_flush_cb callback, void *priv)
+{
+	int i, n, err;
+
+	if (io_queued(ph)) {
+		struct io_cmd cmd = { .op = IO_FLUSH,
+		                      .u.flush = { .callback = callback, .priv = priv } };
+		return io_push(ph, &cmd);
+	}
+
+	/* Held, too soon, or behind a flush still in flight - merge
+	 * into the next flush. The callback waits for that one.
+	 */
+	if (ph->hold != 0 || !ph->flush.done ||
+	    (ph->rate.period_ns != 0 && now_ns() < ph->rate.next_ns)) {
+		if (flush_waiter(ph, callback, priv) < 0)
+			return -EAGAIN;
+		if (!ph->rate.pending)
+			ph->rate.pending = 1;
+		else
+			ph->stats.deferred++;
+		return 0;
+	}
+
+	if (flush_waiter(ph, callback, priv) < 0)
+		return -EAGAIN;
+
+	ph->rate.pending = 0;
+
+	/* While the device is away, updates just pile up in
+	 * code_set, to be replayed once it is back. Nothing
+	 * was sent, so say so.
+	 */
+	if (__atomic_load_n(&ph->lost, __ATOMIC_ACQUIRE)) {
+		flush_notify(ph, ph->flush.waiters, -ENODEV);
+		return 0;
+	}
+
+	ph->flush.err = 0;
+	ph->flush.done = 0;
+	ph->flush.carried = ph->flush.waiters;
+	ph->flush.first_ns = 0;
+	ph->flush.last_ns = 0;
+	memset(ph->flush.tries, 0, sizeof(ph->flush.tries));
+
+	/* Snapshot every dirty code, and put them all on the wire
+	 * at once, so that a full redraw costs one round trip.
+	 */
+	for (n = 0; n < CODES; n++) {
+		i = flush_order[n] - 1;
+
+		if (!(ph->code_mask & (1 << i)))
+			continue;
+
+		/* Skip packets the device already has */
+		if ((ph->shadow_valid & (1 << i)) &&
+		    memcmp(&ph->shadow[i][3], &ph->code_set[i][3], 5) == 0) {
+			ph->code_mask &= ~(1 << i);
+			ph->stats.skipped++;
+			continue;
+		}
+
+		err = flush_submit(ph, i);
+		if (err < 0) {
+			flush_failed(ph, i, err);
+			if (err == -ENODEV)
+				break;
+		}
+	}
+
+	if (ph->flush.busy != 0 || ph->flush.waiting != 0) {
+		ph->stats.flushes++;
+		if (ph->rate.period_ns != 0)
+			ph->rate.next_ns = now_ns() + ph->rate.period_ns;
+	}
+
+	/* Nothing in flight? Complete now. */
+	flush_complete(ph);
+
+	return 0;
+}
+
+int ip_usbph_flush_wait(struct ip_usbph *ph)
+{
+	int err;
+
+	/* The I/O thread owns the flush - never wait for it */
+	if (io_queued(ph))
+		return __atomic_exchange_n(&ph->io.err, 0, __ATOMIC_ACQ_REL);
+
+	while (!ph->flush.done) {
+		uint64_t next, now;
+		int wait = -1;
+
+		flush_check_cancel(ph);
+
+		/* Wake up for the next retry */
+		next = flush_retry_next(ph);
+		if (next != 0) {
+			now = now_ns();
+			wait = (next > now) ? (next - now + 999999) / 1000000 : 0;
+		}
+
+		err = ph->transport->ops->handle_events(ph->transport, wait, &ph->flush.done);
+		if (err < 0 && err != -EINTR)
+			return -EIO;
+
+		flush_retry(ph);
+	}
+
+	return ph->flush.err;
+}
+
+int ip_usbph_retry_set(struct ip_usbph *ph, const struct ip_usbph_retry *retry)
+{
+	if (retry->timeout_msec < 0 || retry->retries < 0 ||
+	    retry->retries > RETRIES_MAX || retry->backoff_msec < 0 ||
+	    retry->backoff_max_msec < 0)
+		return -EINVAL;
+
+	if (io_queued(ph)) {
+		struct io_cmd cmd = { .op = IO_RETRY, .u.retry = *retry };
+		return io_push(ph, &cmd);
+	}
+
+	ph->retry = *retry;
+	ph->retry_fixed = 1;
+
+	return 0;
+}
+
+void ip_usbph_retry_get(struct ip_usbph *ph, struct ip_usbph_retry *retry)
+{
+	*retry = ph->retry;
+}
+
+/* Use the profile's numbers for whatever the application
+ * has not set itself
+ */
+static void profile_apply(struct ip_usbph *ph)
+{
+	const struct ip_usbph_profile *p = &ph->profile;
+	unsigned msec;
+
+	if (!ph->rate.fixed && p->max_hz != 0)
+		ph->rate.period_ns = 1000000000ULL / p->max_hz;
+
+	if (ph->retry_fixed)
+		return;
+
+	/* Ten times a redraw is plenty for a phone that is
+	 * still there, but never wait less than 50 msec.
+	 */
+	msec = p->flush_usec / 100;
+	if (msec < 50)
+		msec = 50;
+	if (msec < TIMEOUT_MSEC)
+		ph->retry.timeout_msec = msec;
+
+	msec = (p->control_usec * 4 + 999) / 1000;
+	if (msec < BACKOFF_MSEC)
+		ph->retry.backoff_msec = msec;
+}
+
+/* $XDG_CACHE_HOME/ip-usbph/<path>, or the same in ~/.cache
+ */
+static int profile_file(struct ip_usbph *ph, char *file, size_t len, int create)
+{
+	const char *env;
+	int n;
+
+	if (ph->transport->ops->simulated)
+		return -ENOENT;
+
+	env = getenv("XDG_CACHE_HOME");
+	if (env != NULL && env[0] != 0) {
+		n = snprintf(file, len, "%s", env);
+	} else {
+		env = getenv("HOME");
+		if (env == NULL)
+			return -ENOENT;
+		n = snprintf(file, len, "%s/.cache", env);
+		if (create && n < len)
+			mkdir(file, 0700);
+	}
+
+	n += snprintf(file + n, (n < len) ? len - n : 0, "/ip-usbph");
+	if (create && n < len)
+		mkdir(file, 0700);
+
+	n += snprintf(file + n, (n < len) ? len - n : 0, "/%s.%s",
+	              ph->path, ph->transport->ops->name);
+	if (n >= len)
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+static int profile_load(struct ip_usbph *ph)
+{
+	struct ip_usbph_profile p;
+	char file[PATH_MAX];
+	unsigned version;
+	FILE *f;
+	int n, err;
+
+	err = profile_file(ph, file, sizeof(file), 0);
+	if (err < 0)
+		return err;
+
+	f = fopen(file, "r");
+	if (f == NULL)
+		return -errno;
+
+	n = fscanf(f, "%u %u %u %u", &version, &p.control_usec, &p.flush_usec, &p.max_hz);
+	fclose(f);
+
+	if (n != 4 || version != PROFILE_VERSION || p.max_hz == 0)
+		return -EINVAL;
+
+	ph->profile = p;
+	ph->profiled = 1;
+
+	return 0;
+}
+
+static int profile_save(struct ip_usbph *ph)
+{
+	const struct ip_usbph_profile *p = &ph->profile;
+	char file[PATH_MAX];
+	FILE *f;
+	int err;
+
+	err = profile_file(ph, file, sizeof(file), 1);
+	if (err < 0)
+		return err;
+
+	f = fopen(file, "w");
+	if (f == NULL)
+		return -errno;
+
+	fprintf(f, "%u %u %u %u\n", PROFILE_VERSION,
+	        p->control_usec, p->flush_usec, p->max_hz);
+
+	return (fclose(f) == 0) ? 0 : -errno;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint64_t median(uint64_t *sample, int n)
+{
+	qsort(sample, n, sizeof(*sample), cmp_u64);
+	return sample[n / 2];
+}
+
+/* Time control transfers one at a time, then full redraws back to
+ * back. A redraw that fails means the phone is being sent more than
+ * it takes - so leave a gap between redraws, doubling it each time,
+ * and start over.
+ */
+static int calibrate(struct ip_usbph *ph, struct ip_usbph_profile *p)
+{
+	const uint8_t *packet = &ph->code_set[CODES - 1][0];
+	uint64_t sample[CALIBRATE_SAMPLES];
+	uint64_t start, gap_ns = 0;
+	int n, err, tries;
+
+	/* Once the display is flushed, every packet sent below
+	 * is one the phone already shows.
+	 */
+	err = ip_usbph_flush(ph);
+	if (err < 0)
+		return err;
+
+	for (n = 0; n < CALIBRATE_SAMPLES; n++) {
+		start = now_ns();
+		err = ip_usbph_raw(ph, packet);
+		if (err < 0)
+			return err;
+		sample[n] = now_ns() - start;
+	}
+	p->control_usec = median(sample, CALIBRATE_SAMPLES) / 1000;
+
+	for (tries = 0; ; tries++) {
+		for (n = 0; n < CALIBRATE_SAMPLES; n++) {
+			ph->shadow_valid = 0;
+			ph->code_mask = (1 << CODES) - 1;
+
+			start = now_ns();
+			err = ip_usbph_flush(ph);
+			if (err < 0)
+				break;
+			sample[n] = now_ns() - start;
+
+			sleep_until(start + sample[n] + gap_ns);
+		}
+
+		if (n == CALIBRATE_SAMPLES)
+			break;
+
+		if (err == -ENODEV || tries == CALIBRATE_TRIES)
+			return err;
+
+		/* Start the gap at a redraw's worth */
+		gap_ns = (gap_ns == 0 && n > 0) ? sample[n - 1] : gap_ns * 2;
+		if (gap_ns == 0)
+			gap_ns = 1000000;
+	}
+
+	start = median(sample, CALIBRATE_SAMPLES);
+	p->flush_usec = start / 1000;
+	p->max_hz = 1000000000ULL / (start + gap_ns + 1);
+	if (p->max_hz == 0)
+		p->max_hz = 1;
+
+	return 0;
+}
+
+int ip_usbph_calibrate(struct ip_usbph *ph, unsigned flags)
+{
+	struct ip_usbph_retry retry = ph->retry;
+	uint64_t period_ns = ph->rate.period_ns;
+	struct ip_usbph_profile p;
+	int err;
+
+	if (ph->io.running || ph->hold != 0)
+		return -EBUSY;
+
+	if (!(flags & IP_USBPH_CALIBRATE_FORCE) && ip_usbph_profile_load(ph) == 0)
+		return 0;
+
+	/* Measure the phone, not the retries or the rate cap */
+	ph->retry.retries = 0;
+	ph->rate.period_ns = 0;
+	ph->rate.next_ns = 0;
+
+	err = calibrate(ph, &p);
+
+	ph->retry = retry;
+	ph->rate.period_ns = period_ns;
+
+	if (err < 0)
+		return err;
+
+	ph->profile = p;
+	ph->profiled = 1;
+	profile_save(ph);
+	profile_apply(ph);
+
+	return 0;
+}
+
+int ip_usbph_profile_load(struct ip_usbph *ph)
+{
+	int err;
+
+	if (ph->io.running)
+		return -EBUSY;
+
+	err = profile_load(ph);
+	if (err < 0)
+		return (err == -EINVAL) ? -ENOENT : err;
+
+	profile_apply(ph);
+
+	return 0;
+}
+
+int ip_usbph_profile_get(struct ip_usbph *ph, struct ip_usbph_profile *profile)
+{
+	if (!ph->profiled)
+		return -ENOENT;
+
+	*profile = ph->profile;
+
+	return 0;
+}
+
+/* A profile changes the rate cap and the retry policy, so a new
+ * handle only picks one up when asked to, with $IP_USBPH_CALIBRATE
+ */
+static void profile_acquire(struct ip_usbph *ph)
+{
+	if (getenv("IP_USBPH_CALIBRATE") != NULL)
+		ip_usbph_calibrate(ph, 0);
+}
+
+int ip_usbph_flush(struct ip_usbph *ph)
+{
+	int err;
+
+	if (io_queued(ph)) {
+		struct io_cmd cmd = { .op = IO_FLUSH };
+		return io_push(ph, &cmd);
+	}
+
+	/* Let any asynchronous flush drain first */
+	ip_usbph_flush_wait(ph);
+
+	err = ip_usbph_flush_async(ph, NULL, NULL);
+	if (err < 0)
+		return err;
+
+	/* Held, or too soon - the timers send it, never a sleep
+	 * here, which would stall the caller's event loop.
+	 */
+	if (ph->rate.pending)
+		return 0;
+
+	return ip_usbph_flush_wait(ph);
+}
+
+int ip_usbph_symbol(struct ip_usbph *ph, ip_usbph_sym sym, int is_on)
+{
+	if (sym < 0 || sym >= ARRAY_SIZE(font_symbol)) {
+		return -EINVAL;
+	}
+
+	if (io_queued(ph)) {
+		struct io_cmd cmd = { .op = IO_SYMBOL, .index = sym, .value = is_on };
+		return io_push(ph, &cmd);
+	}
+
+	anim_stop(ph, anim_slot(IP_USBPH_ANIM_SYMBOL, sym, NULL));
+
+	return code_bit(ph, font_symbol[sym].code, font_symbol[sym].bit, is_on);
+}
+
+static inline uint64_t packet_get(const uint8_t cmd[8])
+{
+	uint64_t w;
+
+	memcpy(&w, cmd, 8);
+	return le64toh(w);
+}
+
+static inline void packet_put(uint8_t cmd[8], uint64_t w)
+{
+	w = htole64(w);
+	memcpy(cmd, &w, 8);
+}
+
+/* Packet bits for a glyph at a position - one lookup per nibble */
+static inline uint64_t glyph_bits(const struct glyph_lut *lut, int c, unsigned glyph)
+{
+	return lut->set[c][0][(glyph >>  0) & 0xf] |
+	       lut->set[c][1][(glyph >>  4) & 0xf] |
+	       lut->set[c][2][(glyph >>  8) & 0xf] |
+	       lut->set[c][3][(glyph >> 12) & 0xf];
+}
+
+static void glyph_put(struct ip_usbph *ph, const struct glyph_lut *lut, unsigned glyph)
+{
+	int c;
+
+	for (c = 0; c < 2 && lut->code[c] != 0; c++) {
+		uint8_t *cmd = &ph->code_set[lut->code[c]-1][0];
+
+		packet_put(cmd, (packet_get(cmd) & ~lut->clear[c]) |
+		                glyph_bits(lut, c, glyph));
+		ph->code_mask |= (1 << (lut->code[c]-1));
+	}
+}
+
+int ip_usbph_top_digit(struct ip_usbph *ph, int index, ip_usbph_digit digit)
+{
+	if (index < 0 || index >= IP_USBPH_TOP_DIGITS) {
+		return -EINVAL;
+	}
+
+	if (io_queued(ph)) {
+		struct io_cmd cmd = { .op = IO_TOP_DIGIT, .index = index, .value = digit };
+		return io_push(ph, &cmd);
+	}
+
+	marquee_stop(ph, ROW_DIGIT);
+	anim_stop(ph, anim_slot(IP_USBPH_ANIM_TOP_DIGIT, index, NULL));
+	glyph_put(ph, &top_digit_lut[index], digit);
+
+	return 0;
+}
+
+int ip_usbph_top_char(struct ip_usbph *ph, int index, ip_usbph_char ch)
+{
+	if (index < 0 || index >= IP_USBPH_TOP_CHARS) {
+		return -EINVAL;
+	}
+
+	if (io_queued(ph)) {
+		struct io_cmd cmd = { .op = IO_TOP_CHAR, .index = index, .value = ch };
+		return io_push(ph, &cmd);
+	}
+
+	marquee_stop(ph, ROW_TOP);
+	anim_stop(ph, anim_slot(IP_USBPH_ANIM_TOP_CHAR, index, NULL));
+	glyph_put(ph, &top_char_lut[index], ch);
+
+	return 0;
+}
+
+int ip_usbph_bot_char(struct ip_usbph *ph, int index, ip_usbph_char ch)
+{
+	if (index < 0 || index >= IP_USBPH_BOT_CHARS) {
+		return -EINVAL;
+	}
+
+	if (io_queued(ph)) {
+		struct io_cmd cmd = { .op = IO_BOT_CHAR, .index = index, .value = ch };
+		return io_push(ph, &cmd);
+	}
+
+	marquee_stop(ph, ROW_BOT);
+	anim_stop(ph, anim_slot(IP_USBPH_ANIM_BOT_CHAR, index, NULL));
+	glyph_put(ph, &bot_char_lut[index], ch);
+
+	return 0;
+}
+
+static const struct {
+	const struct glyph_lut *lut;
+	int width;
+} rows[ROWS] = {
+	[ROW_DIGIT] = { .lut = top_digit_lut, .width = IP_USBPH_TOP_DIGITS },
+	[ROW_TOP]   = { .lut = top_char_lut,  .width = IP_USBPH_TOP_CHARS },
+	[ROW_BOT]   = { .lut = bot_char_lut,  .width = IP_USBPH_BOT_CHARS },
+};
+
+static inline unsigned row_glyph(row_id row, uint8_t c)
+{
+	return (row == ROW_DIGIT) ? ip_usbph_font_digit(c) : ip_usbph_font_char(c);
+}
+
+static void marquee_stop(struct ip_usbph *ph, row_id row)
+{
+	struct marquee *mq = &ph->marquee[row];
+
+	free(mq->word);
+	free(mq->dirty);
+	memset(mq, 0, sizeof(*mq));
+}
+
+/* Put the row's bits for the current step into the codes in 'mask'
+ */
+static void marquee_apply(struct ip_usbph *ph, struct marquee *mq, unsigned mask)
+{
+	int i;
+
+	for (i = 0; i < CODES; i++) {
+		uint8_t *cmd = &ph->code_set[i][0];
+
+		if (!(mask & (1 << i)) || mq->clear[i] == 0)
+			continue;
+
+		packet_put(cmd, (packet_get(cmd) & ~mq->clear[i]) |
+		                mq->word[mq->step][i]);
+		ph->code_mask |= (1 << i);
+	}
+}
+
+static int row_text(struct ip_usbph *ph, row_id row, const char *text)
+{
+	struct marquee *mq = &ph->marquee[row];
+	const struct glyph_lut *lut = rows[row].lut;
+	int width = rows[row].width;
+	int len = strlen(text);
+	int n, p, c, err;
+
+	if (io_queued(ph)) {
+		struct io_cmd cmd = { .op = IO_TEXT, .index = row };
+
+		cmd.u.text = strdup(text);
+		if (cmd.u.text == NULL)
+			return -ENOMEM;
+
+		err = io_push(ph, &cmd);
+		if (err < 0)
+			free(cmd.u.text);
+		return err;
+	}
+
+	marquee_stop(ph, row);
+	for (p = 0; p < width; p++)
+		anim_stop(ph, anim_slot(IP_USBPH_ANIM_TOP_DIGIT + row, p, NULL));
+
+	if (len <= width) {
+		for (p = 0; p < width; p++)
+			glyph_put(ph, &lut[p], row_glyph(row, (p < len) ? text[p] : ' '));
+		return 0;
+	}
+
+	/* Too long - precompute every scroll step */
+	mq->steps = len + MARQUEE_GAP;
+	mq->word = calloc(mq->steps, sizeof(*mq->word));
+	mq->dirty = calloc(mq->steps, sizeof(*mq->dirty));
+	if (mq->word == NULL || mq->dirty == NULL) {
+		marquee_stop(ph, row);
+		return -ENOMEM;
+	}
+
+	for (p = 0; p < width; p++) {
+		for (c = 0; c < 2 && lut[p].code[c] != 0; c++)
+			mq->clear[lut[p].code[c]-1] |= lut[p].clear[c];
+	}
+
+	for (n = 0; n < mq->steps; n++) {
+		for (p = 0; p < width; p++) {
+			int i = (n + p) % mq->steps;
+			unsigned glyph = row_glyph(row, (i < len) ? text[i] : ' ');
+
+			for (c = 0; c < 2 && lut[p].code[c] != 0; c++)
+				mq->word[n][lut[p].code[c]-1] |= glyph_bits(&lut[p], c, glyph);
+		}
+	}
+
+	for (n = 0; n < mq->steps; n++) {
+		int prev = (n + mq->steps - 1) % mq->steps;
+
+		for (c = 0; c < CODES; c++) {
+			if (mq->word[n][c] != mq->word[prev][c])
+				mq->dirty[n] |= (1 << c);
+		}
+	}
+
+	marquee_apply(ph, mq, (1 << CODES) - 1);
+	mq->next_ns = now_ns() + ph->marquee_msec * 1000000ULL;
+
+	return 0;
+}
+
+int ip_usbph_digit_text(struct ip_usbph *ph, const char *text)
+{
+	return row_text(ph, ROW_DIGIT, text);
+}
+
+int ip_usbph_top_text(struct ip_usbph *ph, const char *text)
+{
+	return row_text(ph, ROW_TOP, text);
+}
+
+int ip_usbph_bot_text(struct ip_usbph *ph, const char *text)
+{
+	return row_text(ph, ROW_BOT, text);
+}
+
+int ip_usbph_scroll_rate(struct ip_usbph *ph, int msec)
+{
+	if (msec <= 0)
+		return -EINVAL;
+
+	if (io_queued(ph)) {
+		struct io_cmd cmd = { .op = IO_SCROLL_RATE, .value = msec };
+		return io_push(ph, &cmd);
+	}
+
+	ph->marquee_msec = msec;
+
+	return 0;
+}
+
+/* Slot of an animation target, and its glyph table if 'lut' is
+ * not NULL (NULL for a symbol). Returns -EINVAL for a bad target.
+ */
+static int anim_slot(ip_usbph_anim_target target, int index, const struct glyph_lut **lut)
+{
+	int slot = ARRAY_SIZE(font_symbol);
+	row_id row, r;
+
+	if (lut != NULL)
+		*lut = NULL;
+
+	if (target == IP_USBPH_ANIM_SYMBOL)
+		return (index >= 0 && index < ARRAY_SIZE(font_symbol)) ? index : -EINVAL;
+
+	if (target < IP_USBPH_ANIM_TOP_DIGIT || target > IP_USBPH_ANIM_BOT_CHAR)
+		return -EINVAL;
+
+	/* Position targets are in row order */
+	row = ROW_DIGIT + (target - IP_USBPH_ANIM_TOP_DIGIT);
+	if (index < 0 || index >= rows[row].width)
+		return -EINVAL;
+
+	if (lut != NULL)
+		*lut = &rows[row].lut[index];
+
+	for (r = ROW_DIGIT; r < row; r++)
+		slot += rows[r].width;
+
+	return slot + index;
+}
+
+/* Precompute every keyframe as the target's bits in each packet.
+ * Needs nothing from the handle, so it runs in the caller's thread.
+ */
+static int anim_build(struct anim *an, int slot, const struct glyph_lut *lut,
+                      const struct ip_usbph_keyframe *frames, int count, int loop)
+{
+	int n, c;
+
+	memset(an, 0, sizeof(*an));
+
+	an->key = calloc(count, sizeof(*an->key));
+	if (an->key == NULL)
+		return -ENOMEM;
+	an->steps = count;
+	an->loop = loop;
+
+	if (lut == NULL) {
+		an->clear[font_symbol[slot].code-1] = PACKET_BIT(font_symbol[slot].bit);
+	} else {
+		for (c = 0; c < 2 && lut->code[c] != 0; c++)
+			an->clear[lut->code[c]-1] |= lut->clear[c];
+	}
+
+	for (n = 0; n < count; n++) {
+		struct anim_key *key = &an->key[n];
+
+		key->hold_ns = frames[n].msec * 1000000ULL;
+
+		if (lut == NULL) {
+			if (frames[n].value)
+				key->word[font_symbol[slot].code-1] = PACKET_BIT(font_symbol[slot].bit);
+			continue;
+		}
+
+		for (c = 0; c < 2 && lut->code[c] != 0; c++)
+			key->word[lut->code[c]-1] |= glyph_bits(lut, c, frames[n].value);
+	}
+
+	for (n = 0; n < count; n++) {
+		int prev = (n + count - 1) % count;
+
+		for (c = 0; c < CODES; c++) {
+			if (an->key[n].word[c] != an->key[prev].word[c])
+				an->key[n].dirty |= (1 << c);
+		}
+	}
+
+	return 0;
+}
+
+/* Put the target's bits for the current keyframe into the codes in 'mask'
+ */
+static void anim_apply(struct ip_usbph *ph, struct anim *an, unsigned mask)
+{
+	int i;
+
+	for (i = 0; i < CODES; i++) {
+		uint8_t *cmd = &ph->code_set[i][0];
+
+		if (!(mask & (1 << i)) || an->clear[i] == 0)
+			continue;
+
+		packet_put(cmd, (packet_get(cmd) & ~an->clear[i]) |
+		                an->key[an->step].word[i]);
+		ph->code_mask |= (1 << i);
+	}
+}
+
+static void anim_stop(struct ip_usbph *ph, int slot)
+{
+	if (slot < 0 || !(ph->anim_mask & (1ULL << slot)))
+		return;
+
+	free(ph->anim[slot].key);
+	memset(&ph->anim[slot], 0, sizeof(ph->anim[slot]));
+	ph->anim_mask &= ~(1ULL << slot);
+}
+
+static void anim_stop_all(struct ip_usbph *ph)
+{
+	while (ph->anim_mask != 0)
+		anim_stop(ph, __builtin_ctzll(ph->anim_mask));
+}
+
+/* Take over a built animation, and show its first keyframe
+ */
+static void anim_start(struct ip_usbph *ph, int slot, const struct anim *an)
+{
+	anim_stop(ph, slot);
+
+	/* A position can't scroll and animate at once */
+	if (slot >= ARRAY_SIZE(font_symbol)) {
+		row_id row = ROW_DIGIT;
+		int index = slot - ARRAY_SIZE(font_symbol);
+
+		while (index >= rows[row].width)
+			index -= rows[row++].width;
+		marquee_stop(ph, row);
+	}
+
+	ph->anim[slot] = *an;
+	ph->anim_mask |= (1ULL << slot);
+
+	anim_apply(ph, &ph->anim[slot], (1 << CODES) - 1);
+	ph->anim[slot].next_ns = now_ns() + an->key[0].hold_ns;
+
+	if (!an->loop && an->steps == 1)
+		anim_stop(ph, slot);
+}
+
+int ip_usbph_animate(struct ip_usbph *ph, ip_usbph_anim_target target, int index,
+                     const struct ip_usbph_keyframe *frames, int count, int loop)
+{
+	const struct glyph_lut *lut;
+	struct anim an;
+	int slot, n, err;
+
+	slot = anim_slot(target, index, &lut);
+	if (slot < 0)
+		return slot;
+
+	if (count <= 0)
+		return -EINVAL;
+
+	for (n = 0; n < count; n++) {
+		if (frames[n].msec <= 0)
+			return -EINVAL;
+	}
+
+	err = anim_build(&an, slot, lut, frames, count, loop);
+	if (err < 0)
+		return err;
+
+	if (io_queued(ph)) {
+		struct io_cmd cmd = { .op = IO_ANIMATE, .index = slot };
+
+		cmd.u.anim = malloc(sizeof(an));
+		if (cmd.u.anim == NULL) {
+			free(an.key);
+			return -ENOMEM;
+		}
+		*cmd.u.anim = an;
+
+		err = io_push(ph, &cmd);
+		if (err < 0) {
+			free(an.key);
+			free(cmd.u.anim);
+		}
+		return err;
+	}
+
+	anim_start(ph, slot, &an);
+
+	return 0;
+}
+
+int ip_usbph_blink(struct ip_usbph *ph, ip_usbph_anim_target target, int index,
+                   unsigned value, int on_msec, int off_msec)
+{
+	const struct ip_usbph_keyframe frames[2] = {
+		{ .value = value, .msec = on_msec },
+		{ .value = 0, .msec = off_msec },
+	};
+
+	return ip_usbph_animate(ph, target, index, frames, 2, 1);
+}
+
+int ip_usbph_cycle(struct ip_usbph *ph, ip_usbph_anim_target target, int index,
+                   const unsigned *values, int count, int msec)
+{
+	struct ip_usbph_keyframe *frames;
+	int n, err;
+
+	if (count <= 0)
+		return -EINVAL;
+
+	frames = calloc(count, sizeof(*frames));
+	if (frames == NULL)
+		return -ENOMEM;
+
+	for (n = 0; n < count; n++) {
+		frames[n].value = values[n];
+		frames[n].msec = msec;
+	}
+
+	err = ip_usbph_animate(ph, target, index, frames, count, 1);
+	free(frames);
+
+	return err;
+}
+
+int ip_usbph_animate_stop(struct ip_usbph *ph, ip_usbph_anim_target target, int index)
+{
+	int slot;
+
+	slot = anim_slot(target, index, NULL);
+	if (slot < 0)
+		return slot;
+
+	if (io_queued(ph)) {
+		struct io_cmd cmd = { .op = IO_ANIMATE, .index = slot, .u.anim = NULL };
+		return io_push(ph, &cmd);
+	}
+
+	anim_stop(ph, slot);
+
+	return 0;
+}
+
+int ip_usbph_flush_hold(struct ip_usbph *ph, int hold)
+{
+	if (io_queued(ph)) {
+		struct io_cmd cmd = { .op = IO_FLUSH_HOLD, .value = hold };
+		return io_push(ph, &cmd);
+	}
+
+	if (hold) {
+		ph->hold++;
+		return 0;
+	}
+
+	if (ph->hold == 0)
+		return -EINVAL;
+
+	ph->hold--;
+
+	return 0;
+}
+
+int ip_usbph_flush_rate(struct ip_usbph *ph, int hz)
+{
+	if (hz < 0)
+		return -EINVAL;
+
+	if (io_queued(ph)) {
+		struct io_cmd cmd = { .op = IO_FLUSH_RATE, .value = hz };
+		return io_push(ph, &cmd);
+	}
+
+	ph->rate.period_ns = hz ? 1000000000ULL / hz : 0;
+	ph->rate.fixed = 1;
+
+	/* A slower rate applies from the next flush on */
+	if (ph->rate.period_ns == 0)
+		ph->rate.next_ns = 0;
+
+	return 0;
+}
+
+/* Advance any scrolling text and animations that are due, and
+ * flush them, along with anything held back by the rate cap.
+ * Retries of failed packets and key reads, and reconnects, are
+ * started from here too. Run from the non-blocking calls, so nothing here
+ * may wait on the device.
+ */
+static void timer_run(struct ip_usbph *ph)
+{
+	uint64_t now = now_ns();
+	uint64_t period = ph->marquee_msec * 1000000ULL;
+	uint64_t mask;
+	int row, due = 0;
+
+	if (__atomic_load_n(&ph->lost, __ATOMIC_ACQUIRE) && !ph->attaching &&
+	    now >= ph->reconnect_ns)
+		ph_reconnect(ph);
+
+	if (ph->keys.retry_ns != 0 && now >= ph->keys.retry_ns)
+		keys_resubmit(ph);
+
+	flush_check_cancel(ph);
+	flush_retry(ph);
+
+	for (row = 0; row < ROWS; row++) {
+		struct marquee *mq = &ph->marquee[row];
+
+		if (mq->steps == 0 || now < mq->next_ns)
+			continue;
+
+		mq->step = (mq->step + 1) % mq->steps;
+		marquee_apply(ph, mq, mq->dirty[mq->step]);
+
+		mq->next_ns += period;
+		if (mq->next_ns <= now)
+			mq->next_ns = now + period;
+		due = 1;
+	}
+
+	/* Every animation due now goes out in the same flush */
+	for (mask = ph->anim_mask; mask != 0; mask &= mask - 1) {
+		int slot = __builtin_ctzll(mask);
+		struct anim *an = &ph->anim[slot];
+
+		if (now < an->next_ns)
+			continue;
+
+		an->step = (an->step + 1) % an->steps;
+		anim_apply(ph, an, an->key[an->step].dirty);
+		if (an->key[an->step].dirty != 0)
+			due = 1;
+
+		/* A one-shot animation stays on its last keyframe */
+		if (!an->loop && an->step == an->steps - 1) {
+			anim_stop(ph, slot);
+			continue;
+		}
+
+		an->next_ns += an->key[an->step].hold_ns;
+		if (an->next_ns <= now)
+			an->next_ns = now + an->key[an->step].hold_ns;
+	}
+
+	if (ph->rate.pending && ph->hold == 0 && now >= ph->rate.next_ns)
+		due = 1;
+
+	if (!due)
+		return;
+
+	/* Never wait for the flush in flight - go out after it.
+	 * While held, just leave the steps pending.
+	 */
+	if (!ph->flush.done || ph->hold != 0) {
+		ph->rate.pending = 1;
+		return;
+	}
+
+	ip_usbph_flush_async(ph, NULL, NULL);
+}
+
+/* Milliseconds until timer_run() has work, or -1 if never
+ */
+static int timer_next(struct ip_usbph *ph)
+{
+	uint64_t now, next = 0;
+	uint64_t mask;
+	int row;
+
+	if (__atomic_load_n(&ph->lost, __ATOMIC_ACQUIRE) && !ph->attaching)
+		next = ph->reconnect_ns;
+
+	/* Behind a flush in flight, its completion is the wakeup.
+	 * Without a rate cap, the pending flush is due at once.
+	 */
+	if (ph->rate.pending && ph->flush.done && ph->hold == 0) {
+		uint64_t slot = (ph->rate.next_ns != 0) ? ph->rate.next_ns : 1;
+
+		if (next == 0 || slot < next)
+			next = slot;
+	}
+
+	if (ph->keys.retry_ns != 0 && (next == 0 || ph->keys.retry_ns < next))
+		next = ph->keys.retry_ns;
+
+	if (ph->flush.waiting != 0) {
+		uint64_t retry = flush_retry_next(ph);
+
+		if (next == 0 || retry < next)
+			next = retry;
+	}
+
+	for (row = 0; row < ROWS; row++) {
+		struct marquee *mq = &ph->marquee[row];
+
+		if (mq->steps != 0 && (next == 0 || mq->next_ns < next))
+			next = mq->next_ns;
+	}
+
+	for (mask = ph->anim_mask; mask != 0; mask &= mask - 1) {
+		struct anim *an = &ph->anim[__builtin_ctzll(mask)];
+
+		if (next == 0 || an->next_ns < next)
+			next = an->next_ns;
+	}
+
+	if (next == 0)
+		return -1;
+
+	now = now_ns();
+	if (next <= now)
+		return 0;
+
+	return (next - now + 999999) / 1000000;
+}
+
+
+static inline void frame_glyph(uint64_t w[CODES], const struct glyph_lut *lut, unsigned glyph)
+{
+	int c;
+
+	for (c = 0; c < 2 && lut->code[c] != 0; c++)
+		w[lut->code[c]-1] |= glyph_bits(lut, c, glyph);
+}
+
+/* Render an entire frame into a set of packets, in one pass.
+ */
+static void frame_render(const struct ip_usbph_frame *frame, uint8_t set[7][8])
+{
+	uint64_t w[CODES];
+	int i;
+
+	for (i = 0; i < CODES; i++)
+		w[i] = packet_get(&code_set[i][0]);
+
+	for (i = 0; i < IP_USBPH_TOP_DIGITS; i++)
+		frame_glyph(w, &top_digit_lut[i], frame->digit[i]);
+
+	for (i = 0; i < IP_USBPH_TOP_CHARS; i++)
+		frame_glyph(w, &top_char_lut[i], frame->top[i]);
+
+	for (i = 0; i < IP_USBPH_BOT_CHARS; i++)
+		frame_glyph(w, &bot_char_lut[i], frame->bot[i]);
+
+	for (i = 0; i < ARRAY_SIZE(font_symbol); i++) {
+		if (frame->symbols & IP_USBPH_SYMBOL_BIT(i))
+			w[font_symbol[i].code-1] |= PACKET_BIT(font_symbol[i].bit);
+	}
+
+	for (i = 0; i < CODES; i++)
+		packet_put(&set[i][0], w[i]);
+}
+
+int ip_usbph_frame_commit(struct ip_usbph *ph, const struct ip_usbph_frame *frame, unsigned *torn_usec)
+{
+	int i, err;
+
+	if (io_queued(ph)) {
+		struct io_cmd cmd = { .op = IO_FRAME, .u.frame = *frame };
+
+		if (torn_usec != NULL)
+			*torn_usec = 0;
+		return io_push(ph, &cmd);
+	}
+
+	/* Let any asynchronous flush drain first, so that the
+	 * whole frame goes out in a single burst.
+	 */
+	ip_usbph_flush_wait(ph);
+
+	for (i = 0; i < ROWS; i++)
+		marquee_stop(ph, i);
+	anim_stop_all(ph);
+
+	frame_render(frame, ph->code_set);
+	ph->code_mask = (1 << CODES) - 1;
+
+	/* Nothing is in flight, and a flush that sends nothing - held,
+	 * rate capped, or with the device away - leaves these alone.
+	 */
+	ph->flush.first_ns = 0;
+	ph->flush.last_ns = 0;
+
+	err = ip_usbph_flush(ph);
+
+	if (torn_usec != NULL)
+		*torn_usec = (ph->flush.last_ns - ph->flush.first_ns) / 1000;
+
+	return err;
+}
+
+static int io_push(struct ip_usbph *ph, const struct io_cmd *cmd)
+{
+	unsigned head = ph->io.head;
+
+	if (head - __atomic_load_n(&ph->io.tail, __ATOMIC_ACQUIRE) == IO_QUEUE)
+		return -EAGAIN;
+
+	ph->io.ring[head % IO_QUEUE] = *cmd;
+	__atomic_store_n(&ph->io.head, head + 1, __ATOMIC_RELEASE);
+
+	/* Rendering is only buffered - wait for something that
+	 * needs the wire before waking the I/O thread.
+	 */
+	if (cmd->op >= IO_CLEAR)
+		ph->transport->ops->interrupt(ph->transport);
+
+	return 0;
+}
+
+static int io_run(struct ip_usbph *ph, struct io_cmd *cmd)
+{
+	switch (cmd->op) {
+	case IO_SYMBOL:
+		return ip_usbph_symbol(ph, cmd->index, cmd->value);
+	case IO_TOP_DIGIT:
+		return ip_usbph_top_digit(ph, cmd->index, cmd->value);
+	case IO_TOP_CHAR:
+		return ip_usbph_top_char(ph, cmd->index, cmd->value);
+	case IO_BOT_CHAR:
+		return ip_usbph_bot_char(ph, cmd->index, cmd->value);
+	case IO_TEXT: {
+		int err = row_text(ph, cmd->index, cmd->u.text);
+		free(cmd->u.text);
+		return err;
+	}
+	case IO_SCROLL_RATE:
+		return ip_usbph_scroll_rate(ph, cmd->value);
+	case IO_FLUSH_RATE:
+		return ip_usbph_flush_rate(ph, cmd->value);
+	case IO_RETRY:
+		return ip_usbph_retry_set(ph, &cmd->u.retry);
+	case IO_ANIMATE:
+		if (cmd->u.anim == NULL) {
+			anim_stop(ph, cmd->index);
+			return 0;
+		}
+		anim_start(ph, cmd->index, cmd->u.anim);
+		free(cmd->u.anim);
+		return 0;
+	case IO_FRAME:
+		return ip_usbph_frame_commit(ph, &cmd->u.frame, NULL);
+	case IO_CLEAR:
+		return ip_usbph_clear(ph);
+	case IO_BACKLIGHT:
+		return ip_usbph_backlight(ph);
+	case IO_PACKET:
+		return ip_usbph_packet_put(ph, cmd->u.packet);
+	case IO_FLUSH_HOLD:
+		return ip_usbph_flush_hold(ph, cmd->value);
+	case IO_FLUSH:
+		if (cmd->u.flush.callback == NULL)
+			return ip_usbph_flush(ph);
+		ip_usbph_flush_wait(ph);
+		return ip_usbph_flush_async(ph, cmd->u.flush.callback, cmd->u.flush.priv);
+	}
+
+	return -EINVAL;
+}
+
+static void *io_thread(void *priv)
+{
+	struct ip_usbph *ph = priv;
+
+	for (;;) {
+		unsigned head = __atomic_load_n(&ph->io.head, __ATOMIC_ACQUIRE);
+		unsigned tail = ph->io.tail;
+		int wait;
+
+		for (; tail != head; tail++) {
+			int err = io_run(ph, &ph->io.ring[tail % IO_QUEUE]);
+			if (err < 0)
+				__atomic_store_n(&ph->io.err, err, __ATOMIC_RELEASE);
+			__atomic_store_n(&ph->io.tail, tail + 1, __ATOMIC_RELEASE);
+		}
+
+		if (__atomic_load_n(&ph->io.stop, __ATOMIC_ACQUIRE) &&
+		    __atomic_load_n(&ph->io.head, __ATOMIC_ACQUIRE) == tail)
+			break;
+
+		timer_run(ph);
+
+		wait = timer_next(ph);
+		if (wait < 0 || wait > IO_IDLE_MSEC)
+			wait = IO_IDLE_MSEC;
+
+		ph->transport->ops->handle_events(ph->transport, wait, NULL);
+	}
+
+	ip_usbph_flush_wait(ph);
+
+	return NULL;
+}
+
+int ip_usbph_thread_start(struct ip_usbph *ph)
+{
+	int err;
+
+	/* The I/O thread would run the other handles' completions */
+	if (ph->io.running || ph->transport->shared)
+		return -EBUSY;
+
+	ph->io.stop = 0;
+	ph->io.err = 0;
+	ph->io.head = 0;
+	ph->io.tail = 0;
+
+	ip_usbph_flush_wait(ph);
+
+	/* 'running' must be set before the thread looks at it */
+	ph->io.running = 1;
+	err = pthread_create(&ph->io.thread, NULL, io_thread, ph);
+	if (err != 0) {
+		ph->io.running = 0;
+		return -err;
+	}
+
+	return 0;
+}
+
+int ip_usbph_thread_stop(struct ip_usbph *ph)
+{
+	if (!ph->io.running)
+		return 0;
+
+	__atomic_store_n(&ph->io.stop, 1, __ATOMIC_RELEASE);
+	ph->transport->ops->interrupt(ph->transport);
+	pthread_join(ph->io.thread, NULL);
+	ph->io.running = 0;
+
+	return ph->io.err;
+}
+
+static void keys_push(struct ip_usbph *ph, uint8_t report)
+{
+	unsigned head = ph->keys.head;
+	struct ip_usbph_key_event *ev;
+
+	if (head - __atomic_load_n(&ph->keys.tail, __ATOMIC_ACQUIRE) == KEY_QUEUE) {
+		ph->keys.dropped++;
+		return;
+	}
+
+	ev = &ph->keys.ring[head % KEY_QUEUE];
+	ev->keycode = report & ~IP_USBPH_KEY_PRESSED;
+	ev->pressed = (report & IP_USBPH_KEY_PRESSED) ? 1 : 0;
+	ev->monotonic_ns = now_ns();
+	__atomic_store_n(&ph->keys.head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Retry the report read after a backoff, from the timers
+ */
+static void keys_backoff(struct ip_usbph *ph)
+{
+	ph->keys.retry_ns = now_ns() + retry_backoff_ns(ph, ph->keys.tries);
+	if (ph->keys.tries < KEY_RETRY_SHIFT)
+		ph->keys.tries++;
+}
+
+static void keys_resubmit(struct ip_usbph *ph)
+{
+	int err;
+
+	ph->keys.retry_ns = 0;
+
+	err = ph->transport->ops->read(ph->transport);
+	if (err == 0)
+		return;
+
+	stats_error(ph, err);
+	if (err == -ENODEV) {
+		ph_lost(ph);
+		__atomic_store_n(&ph->keys.active, 0, __ATOMIC_RELEASE);
+		return;
+	}
+
+	keys_backoff(ph);
+}
+
+/* A read waiting out its backoff has nothing to cancel
+ */
+static void keys_retry_cancel(struct ip_usbph *ph)
+{
+	if (ph->keys.retry_ns != 0) {
+		ph->keys.retry_ns = 0;
+		__atomic_store_n(&ph->keys.active, 0, __ATOMIC_RELEASE);
+	}
+}
+
+void ph_key_done(struct ip_usbph *ph, int err, const uint8_t *report)
+{
+	if (err == 0 && report != NULL) {
+		trace(ph, IP_USBPH_TRACE_IN, 0, report);
+
+		/* Skip over non-key reports */
+		if (report[0] == 0x02 &&
+		    report[1] == 0x61 &&
+		    report[2] == 0x90 &&
+		    report[3] != IP_USBPH_KEY_IDLE) {
+			keys_push(ph, report[3]);
+			ph->stats.key_reports++;
+		}
+	} else if (err != -ECANCELED) {
+		stats_error(ph, err);
+	}
+
+	if (err == -ENODEV)
+		ph_lost(ph);
+
+	if (err == 0)
+		ph->keys.tries = 0;
+
+	if (__atomic_load_n(&ph->keys.stop, __ATOMIC_ACQUIRE) ||
+	    err == -ENODEV || err == -ECANCELED) {
+		__atomic_store_n(&ph->keys.active, 0, __ATOMIC_RELEASE);
+	} else if (err == 0 || err == -ETIMEDOUT) {
+		keys_resubmit(ph);
+	} else {
+		/* A stall, overflow or I/O error - the phone is still
+		 * there, so read again once it has had a moment.
+		 */
+		keys_backoff(ph);
+	}
+
+	__atomic_store_n(&ph->keys.event, 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&ph->keys.lock);
+	pthread_cond_broadcast(&ph->keys.wake);
+	pthread_mutex_unlock(&ph->keys.lock);
+}
+
+/* Threaded mode: wait up to 'msec' for the I/O thread to
+ * complete a key read, rather than run the transport here.
+ */
+static void keys_wait(struct ip_usbph *ph, unsigned msec)
+{
+	uint64_t due = now_ns() + msec * 1000000ULL;
+	struct timespec ts = {
+		.tv_sec = due / 1000000000ULL,
+		.tv_nsec = due % 1000000000ULL,
+	};
+
+	pthread_mutex_lock(&ph->keys.lock);
+	while (!__atomic_load_n(&ph->keys.event, __ATOMIC_ACQUIRE) &&
+	       pthread_cond_timedwait(&ph->keys.wake, &ph->keys.lock, &ts) == 0)
+		;
+	pthread_mutex_unlock(&ph->keys.lock);
+}
+
+static int keys_start(struct ip_usbph *ph)
+{
+	int err;
+
+	ph->keys.stop = 0;
+	ph->keys.tries = 0;
+	ph->keys.retry_ns = 0;
+
+	err = ph->transport->ops->read(ph->transport);
+	if (err < 0)
+		return (err == -ENODEV) ? -ENODEV : -EIO;
+
+	ph->keys.active = 1;
+
+	return 0;
+}
+
+static void keys_stop(struct ip_usbph *ph)
+{
+	__atomic_store_n(&ph->keys.stop, 1, __ATOMIC_RELEASE);
+	keys_retry_cancel(ph);
+	if (ph->keys.active) {
+		ph->transport->ops->read_cancel(ph->transport);
+		while (__atomic_load_n(&ph->keys.active, __ATOMIC_ACQUIRE))
+			ph->transport->ops->handle_events(ph->transport, -1, NULL);
+	}
+}
+
+int ip_usbph_keys_read(struct ip_usbph *ph, struct ip_usbph_key_event *events, int max)
+{
+	unsigned head, tail;
+	uint64_t now;
+	int n;
+
+	/* Pick up anything that has already completed */
+	if (!ph->io.running) {
+		timer_run(ph);
+		ph->transport->ops->handle_events(ph->transport, 0, NULL);
+	}
+
+	head = __atomic_load_n(&ph->keys.head, __ATOMIC_ACQUIRE);
+	tail = ph->keys.tail;
+	now = now_ns();
+	for (n = 0; n < max && tail != head; n++, tail++) {
+		events[n] = ph->keys.ring[tail % KEY_QUEUE];
+		stats_latency(ph->stats.key_usec, now - events[n].monotonic_ns);
+	}
+	__atomic_store_n(&ph->keys.tail, tail, __ATOMIC_RELEASE);
+
+	if (n == 0 && !__atomic_load_n(&ph->keys.active, __ATOMIC_ACQUIRE) &&
+	    !__atomic_load_n(&ph->lost, __ATOMIC_ACQUIRE))
+		return -EIO;
+
+	return n;
+}
+
+int ip_usbph_get_pollfds(struct ip_usbph *ph, struct pollfd *fds, int max)
+{
+	return ph->transport->ops->get_pollfds(ph->transport, fds, max);
+}
+
+void ph_pollfd(struct ip_usbph *ph, int fd, short events)
+{
+	if (ph->pollfd_cb != NULL)
+		ph->pollfd_cb(fd, events, ph->pollfd_priv);
+}
+
+void ip_usbph_set_pollfd_notifier(struct ip_usbph *ph, ip_usbph_pollfd_cb callback, void *priv)
+{
+	ph->pollfd_cb = callback;
+	ph->pollfd_priv = priv;
+
+	ph->transport->ops->set_pollfd_notifier(ph->transport, callback != NULL);
+}
+
+int ip_usbph_next_timeout(struct ip_usbph *ph)
+{
+	int msec, err;
+
+	if (ph->io.running)
+		return -1;
+
+	msec = ph->transport->ops->next_timeout(ph->transport);
+
+	err = timer_next(ph);
+	if (err >= 0 && (msec < 0 || err < msec))
+		msec = err;
+
+	return msec;
+}
+
+int ip_usbph_handle_events_nonblocking(struct ip_usbph *ph)
+{
+	int err;
+
+	if (ph->io.running)
+		return -EBUSY;
+
+	err = ph->transport->ops->handle_events(ph->transport, 0, NULL);
+	if (err < 0 && err != -EINTR)
+		return -EIO;
+
+	timer_run(ph);
+
+	return 0;
+}
+
+uint8_t ip_usbph_key_get(struct ip_usbph *ph, int timeout_msec)
+{
+	struct ip_usbph_key_event ev;
+	uint64_t deadline = 0;
+	int err;
+	int wait;
+
+	if (timeout_msec > 0)
+		deadline = now_ns() + timeout_msec * 1000000ULL;
+
+	/* Wait in slices, so that scrolling text keeps moving */
+	for (;;) {
+		unsigned slice = IO_IDLE_MSEC;
+
+		__atomic_store_n(&ph->keys.event, 0, __ATOMIC_RELEASE);
+
+		err = ip_usbph_keys_read(ph, &ev, 1);
+		if (err < 0)
+			return IP_USBPH_KEY_ERROR;
+
+		if (err == 1)
+			return ev.keycode | (ev.pressed ? IP_USBPH_KEY_PRESSED : 0);
+
+		if (deadline != 0) {
+			uint64_t now = now_ns();
+
+			if (now >= deadline)
+				return IP_USBPH_KEY_IDLE;
+			if ((deadline - now) / 1000000 < slice)
+				slice = (deadline - now + 999999) / 1000000;
+		}
+
+		/* In threaded mode, only the I/O thread may run the
+		 * transport and the timers - its completions touch
+		 * the flush state.
+		 */
+		if (ph->io.running) {
+			keys_wait(ph, slice);
+			continue;
+		}
+
+		wait = timer_next(ph);
+		if (wait >= 0 && wait < slice)
+			slice = wait;
+
+		ph->transport->ops->handle_events(ph->transport, slice, &ph->keys.event);
+	}
+}
+
+int ip_usbph_stats_get(struct ip_usbph *ph, struct ip_usbph_stats *stats)
+{
+	*stats = ph->stats;
+
+	return 0;
+}
+
+void ip_usbph_stats_reset(struct ip_usbph *ph)
+{
+	memset(&ph->stats, 0, sizeof(ph->stats));
 }
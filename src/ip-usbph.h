@@ -9,6 +9,7 @@
 #define IP_USBPH_H
 
 #include <stdint.h>
+#include <poll.h>
 
 /* Symbols
  */
@@ -118,13 +119,88 @@ typedef enum {
 struct ip_usbph *ip_usbph_acquire(int index);
 void ip_usbph_release(struct ip_usbph *ph);
 
-/* Save state to a fd
+/* Physical location of the device, as "bus-port.port..."
+ */
+#define IP_USBPH_PATH_MAX	32
+const char *ip_usbph_path(struct ip_usbph *ph);
+
+/* How display packets reach the device: "usb" (control transfers),
+ * "usb-interrupt" (the interrupt OUT endpoint, where the phone has
+ * one, unless $IP_USBPH_OUT is "control"), "hidraw", "sim" or "null".
+ */
+const char *ip_usbph_transport_name(struct ip_usbph *ph);
+
+/*
+ * hidraw devices.
+ *
+ * ip_usbph_hidraw_acquire() is ip_usbph_acquire() through the
+ * kernel's HID driver, at /dev/hidrawN, rather than libusb. The
+ * driver stays bound, so the phone's input device stays too, and
+ * other processes can still open the phone. Phones are matched by
+ * vendor and product in sysfs, in hidraw number order.
+ *
+ * ip_usbph_hidraw_new() wraps an open file descriptor: a phone's
+ * hidraw node, or a socketpair() end standing in for one, with
+ * the path "fd". Display reports are written 8 bytes each, those
+ * of a flush in one writev(), and key reports read 8 bytes at a
+ * time - so the stand-in's other end sees a stream of reports.
+ * A stand-in's profile is never cached. Once a handle is returned, it owns 'fd', and closes it on
+ * release.
+ *
+ * ip_usbph_acquire() returns ip_usbph_hidraw_acquire(index) if
+ * $IP_USBPH_TRANSPORT is "hidraw".
+ */
+struct ip_usbph *ip_usbph_hidraw_acquire(int index);
+struct ip_usbph *ip_usbph_hidraw_new(int fd);
+
+/* Non-zero unless the device has gone away. A lost device is
+ * looked for again at the same path, and the display replayed
+ * once it is back - see ip_usbph(3).
+ */
+int ip_usbph_connected(struct ip_usbph *ph);
+
+/*
+ * Shared device context.
+ *
+ * One libusb context for any number of phones. The bus is
+ * enumerated once, and hotplug (where libusb supports it)
+ * keeps the device list up to date from then on.
+ *
+ * ip_usbph_ctx_devices() copies up to 'max' device paths,
+ * and returns the number of devices. The hotplug callback
+ * is called from event handling (ip_usbph_ctx_handle_events(),
+ * or that of any device in the context), and must not acquire
+ * or release devices itself.
+ *
+ * Event handling on any device of the context runs every
+ * device's completions and timers, so a context and all its
+ * devices must be driven from one thread. ip_usbph_thread_start()
+ * returns -EBUSY for them.
+ *
+ * Release all devices before ip_usbph_ctx_free().
+ */
+struct ip_usbph_ctx;
+typedef void (*ip_usbph_hotplug_cb)(struct ip_usbph_ctx *ctx, const char *path, int arrived, void *priv);
+
+struct ip_usbph_ctx *ip_usbph_ctx_new(void);
+void ip_usbph_ctx_free(struct ip_usbph_ctx *ctx);
+int ip_usbph_ctx_devices(struct ip_usbph_ctx *ctx, char (*paths)[IP_USBPH_PATH_MAX], int max);
+struct ip_usbph *ip_usbph_ctx_acquire(struct ip_usbph_ctx *ctx, const char *path);
+void ip_usbph_ctx_set_hotplug(struct ip_usbph_ctx *ctx, ip_usbph_hotplug_cb callback, void *priv);
+int ip_usbph_ctx_handle_events(struct ip_usbph_ctx *ctx, int timeout_msec);
+
+/* Save state to a fd, as a single binary snapshot
  *
  * Returns length written
  */
 int ip_usbph_state_save(struct ip_usbph *ph, int fd);
 
-/* Restore state from a fd
+/* Restore state from a fd. Only codes that differ from what
+ * the device shows are marked for the next flush. The text
+ * format of earlier versions is read too.
+ *
+ * Returns length read, -EINVAL for a bad snapshot, or -ENXIO
+ * for one saved from a phone at another path
  */
 int ip_usbph_state_load(struct ip_usbph *ph, int fd);
 
@@ -168,12 +244,441 @@ int ip_usbph_top_char(struct ip_usbph *ph, int index, ip_usbph_char ch);
 int ip_usbph_bot_char(struct ip_usbph *ph, int index, ip_usbph_char ch);
 
 /*
- * Flush new characters to the display
+ * Render a string on a whole row, padded with blanks.
+ *
+ * Strings longer than the row scroll as a marquee, one
+ * position per ip_usbph_scroll_rate() msec (default 300).
+ * The library advances and flushes the marquee itself
+ * while it waits for keys in ip_usbph_key_get().
+ *
+ * Any other change to the row stops the marquee.
+ */
+int ip_usbph_digit_text(struct ip_usbph *ph, const char *text);
+int ip_usbph_top_text(struct ip_usbph *ph, const char *text);
+int ip_usbph_bot_text(struct ip_usbph *ph, const char *text);
+int ip_usbph_scroll_rate(struct ip_usbph *ph, int msec);
+
+/*
+ * Animation of a single symbol, digit or character position.
+ *
+ * The target steps through 'count' keyframes, each shown for
+ * its own 'msec'. A keyframe's 'value' is 0 or 1 for a symbol,
+ * and a glyph from ip_usbph_font_digit() or ip_usbph_font_char()
+ * for a position. With 'loop' the animation repeats until it is
+ * stopped, otherwise it stops on its last keyframe.
+ *
+ * Keyframes are precomputed as the target's bits in each packet,
+ * and all animations run off the same timer as scrolling text -
+ * those that step together are sent in one flush, with only the
+ * packets they change. The first keyframe is shown by the next
+ * flush.
+ *
+ * Any other change to the target stops its animation, as do
+ * text on its row, ip_usbph_clear() and ip_usbph_frame_commit().
+ * Animating a position stops a marquee on its row.
+ */
+typedef enum {
+	IP_USBPH_ANIM_SYMBOL,	/* 'index' is an ip_usbph_sym */
+	IP_USBPH_ANIM_TOP_DIGIT,
+	IP_USBPH_ANIM_TOP_CHAR,
+	IP_USBPH_ANIM_BOT_CHAR,
+} ip_usbph_anim_target;
+
+struct ip_usbph_keyframe {
+	unsigned value;
+	int msec;
+};
+
+int ip_usbph_animate(struct ip_usbph *ph, ip_usbph_anim_target target, int index,
+                     const struct ip_usbph_keyframe *frames, int count, int loop);
+
+/* 'value' for on_msec, then blank for off_msec, until stopped */
+int ip_usbph_blink(struct ip_usbph *ph, ip_usbph_anim_target target, int index,
+                   unsigned value, int on_msec, int off_msec);
+
+/* Each of 'count' values for msec in turn, until stopped */
+int ip_usbph_cycle(struct ip_usbph *ph, ip_usbph_anim_target target, int index,
+                   const unsigned *values, int count, int msec);
+
+/* Stop an animation, leaving the target showing its keyframe */
+int ip_usbph_animate_stop(struct ip_usbph *ph, ip_usbph_anim_target target, int index);
+
+/*
+ * Flush new characters to the display, and wait for them.
+ * A flush held, or deferred by the rate cap, returns 0 at once.
  */
 int ip_usbph_flush(struct ip_usbph *ph);
 
-/* Get keycode and is-up mask for a key.
+/*
+ * Flush new characters to the display, without waiting.
+ *
+ * All changed packets are put on the wire at the same time.
+ * 'callback' (if not NULL) is called with 0 or a -errno once
+ * all of them have completed, from within whichever library
+ * call is servicing USB events (ie ip_usbph_flush_wait()).
+ *
+ * A flush behind one still in flight is deferred until it
+ * completes, as under the rate cap. The callback of a deferred
+ * flush is called once the flush that carries its update
+ * completes; while the device is away, with -ENODEV.
+ *
+ * Returns -EAGAIN if too many callbacks are already waiting
+ * on deferred flushes.
+ */
+typedef void (*ip_usbph_flush_cb)(struct ip_usbph *ph, int err, void *priv);
+int ip_usbph_flush_async(struct ip_usbph *ph, ip_usbph_flush_cb callback, void *priv);
+
+/*
+ * Cap flushes at 'hz' per second (0, the default, is uncapped).
+ *
+ * A flush less than 1/hz sec after the last one that sent
+ * anything returns 0 at once, and only marks the display pending;
+ * none sleeps for the slot. At the next slot, the library flushes
+ * whatever the display shows by then - so the latest update wins,
+ * and those in between are never sent. That flush is run from wherever the scrolling
+ * text is (see ip_usbph_key_get() and the event loop calls below),
+ * and by ip_usbph_release(), so no update is lost.
+ */
+int ip_usbph_flush_rate(struct ip_usbph *ph, int hz);
+
+/*
+ * Hold every flush (hold != 0), or drop a hold (hold == 0).
+ *
+ * While any hold is taken, flushes - the application's, and those
+ * of scrolling text and animations - return 0 at once and only
+ * mark the display pending, as under the rate cap. Retries of a
+ * flush already in flight resend what it sent. Dropping the last
+ * hold sends nothing itself; the next flush, or the timers, send
+ * whatever the display shows by then. Holds nest, so that several
+ * writers can each build an update of their own.
+ *
+ * Returns 0, or -EINVAL to drop a hold none is taken.
+ */
+int ip_usbph_flush_hold(struct ip_usbph *ph, int hold);
+
+/*
+ * Wait for an asynchronous flush to complete.
+ *
+ * Returns the status of the last flush.
+ */
+int ip_usbph_flush_wait(struct ip_usbph *ph);
+
+/*
+ * Transfer timeout and retries.
+ *
+ * No transfer waits for the device longer than 'timeout_msec'
+ * (0 is forever). A display packet that fails or times out stays
+ * dirty, and is sent again on its own, with the display's latest
+ * content, 'backoff_msec' later, doubling on each try up to
+ * 'backoff_max_msec'. After 'retries' tries it is left for the
+ * next flush, and the flush completes with the error. Other
+ * packets of the flush are not held up, and nothing is redrawn
+ * that the device already has.
+ *
+ * The defaults are a 1000 msec timeout, and 3 retries from 20
+ * msec up to 500 msec. ip_usbph_retry_set() returns -EINVAL for
+ * a negative field, or more than 16 retries.
+ */
+struct ip_usbph_retry {
+	int timeout_msec;
+	int retries;
+	int backoff_msec;
+	int backoff_max_msec;
+};
+
+int ip_usbph_retry_set(struct ip_usbph *ph, const struct ip_usbph_retry *retry);
+void ip_usbph_retry_get(struct ip_usbph *ph, struct ip_usbph_retry *retry);
+
+/*
+ * Give up on the flush in flight, and any retries it has still
+ * to make. Its packets stay dirty for the next flush, and it
+ * completes with -ECANCELED.
+ *
+ * May be called from any thread, to bound how long another one
+ * waits on the device.
+ */
+void ip_usbph_flush_cancel(struct ip_usbph *ph);
+
+/*
+ * Device profile.
+ *
+ * ip_usbph_calibrate() measures how fast this phone, behind this
+ * hub, takes display packets: the round trip of one control
+ * transfer, how long a full pipelined redraw takes, and how many
+ * redraws a second it takes back to back without an error. It
+ * only resends what the display shows, so nothing flickers, and
+ * takes a fraction of a second on a healthy phone.
+ *
+ * The profile is cached per ip_usbph_path() and
+ * ip_usbph_transport_name(), so it is only measured once (unless
+ * IP_USBPH_CALIBRATE_FORCE): ip_usbph_calibrate() applies the
+ * cached one if there is one. ip_usbph_profile_load() applies the
+ * cached profile without ever measuring. Nothing is applied unless
+ * asked for - or, if $IP_USBPH_CALIBRATE is set, by acquiring the
+ * device, which then calibrates it as ip_usbph_calibrate(ph, 0).
+ *
+ * A profile sets the flush rate cap to 'max_hz', and the transfer
+ * timeout and retry backoff from the measured times - unless the
+ * application has already set them itself.
+ *
+ * ip_usbph_calibrate() returns 0, -EBUSY in threaded mode or while
+ * flushes are held, or the error that stopped it. ip_usbph_profile_load() returns 0, -EBUSY
+ * in threaded mode, or -ENOENT if nothing usable is cached.
+ * ip_usbph_profile_get() returns -ENOENT if the handle has no
+ * profile.
+ */
+struct ip_usbph_profile {
+	unsigned control_usec;	/* One control transfer, round trip */
+	unsigned flush_usec;	/* Full redraw, all packets in flight */
+	unsigned max_hz;	/* Full redraws a second without errors */
+};
+
+#define IP_USBPH_CALIBRATE_FORCE	(1 << 0)	/* Ignore the cache */
+
+int ip_usbph_calibrate(struct ip_usbph *ph, unsigned flags);
+int ip_usbph_profile_load(struct ip_usbph *ph);
+int ip_usbph_profile_get(struct ip_usbph *ph, struct ip_usbph_profile *profile);
+
+/*
+ * Whole display frame.
+ *
+ * 'symbols' is a mask of IP_USBPH_SYMBOL_BIT(sym)
+ */
+#define IP_USBPH_SYMBOL_BIT(sym)	(1UL << (sym))
+
+struct ip_usbph_frame {
+	ip_usbph_digit digit[IP_USBPH_TOP_DIGITS];
+	ip_usbph_char  top[IP_USBPH_TOP_CHARS];
+	ip_usbph_char  bot[IP_USBPH_BOT_CHARS];
+	uint32_t       symbols;
+};
+
+/*
+ * Replace the entire display with 'frame', and flush it.
+ *
+ * Only changed packets are sent, all in a single burst.
+ * If 'torn_usec' is not NULL, it is set to the time between
+ * the first and the last packet being acknowledged - ie how
+ * long the display showed a mix of old and new content - or 0
+ * if nothing was sent (held, rate capped, or no device).
+ */
+int ip_usbph_frame_commit(struct ip_usbph *ph, const struct ip_usbph_frame *frame, unsigned *torn_usec);
+
+/*
+ * Threaded mode.
+ *
+ * ip_usbph_thread_start() hands the device over to a library
+ * owned I/O thread. From then on, the display calls (symbol,
+ * digit, char, text, scroll and flush rate, animation, retry
+ * policy, frame, clear, backlight and flush) only queue a command
+ * and return at once, with 0 or -EAGAIN if the queue is full. They
+ * must all be made from the same application thread.
+ *
+ * Errors seen by the I/O thread are returned (and cleared) by
+ * ip_usbph_flush_wait(), which never blocks in this mode. The
+ * state save/load calls return -EBUSY while the thread runs.
+ *
+ * ip_usbph_thread_start() returns -EBUSY if the thread is already
+ * running, or for a device from ip_usbph_ctx_acquire().
+ *
+ * ip_usbph_thread_stop() runs any queued commands, stops the
+ * thread, and returns the last error it saw.
+ */
+int ip_usbph_thread_start(struct ip_usbph *ph);
+int ip_usbph_thread_stop(struct ip_usbph *ph);
+
+/* Get keycode and is-up mask for a key. In threaded mode, this
+ * sleeps until the I/O thread has read one.
  */
 uint8_t ip_usbph_key_get(struct ip_usbph *ph, int timeout_sec);
 
+/*
+ * Key events.
+ *
+ * Key reports are collected in the background into a ring
+ * of events, stamped with CLOCK_MONOTONIC when they arrived.
+ */
+struct ip_usbph_key_event {
+	uint8_t  keycode;	/* IP_USBPH_KEY_*, without IP_USBPH_KEY_PRESSED */
+	uint8_t  pressed;
+	uint64_t monotonic_ns;
+};
+
+/* Drain up to 'max' key events, without waiting.
+ *
+ * Returns the number of events read, or -EIO if the
+ * keypad is no longer being read (ie device unplugged).
+ * A read that fails any other way (a stall, an overflow)
+ * is retried after the ip_usbph_retry_set() backoff, and keys
+ * arrive again once it succeeds.
+ */
+int ip_usbph_keys_read(struct ip_usbph *ph, struct ip_usbph_key_event *events, int max);
+
+/*
+ * External event loop integration.
+ *
+ * Poll the file descriptors from ip_usbph_get_pollfds(), for
+ * no longer than ip_usbph_next_timeout() msec (-1 is forever),
+ * then call ip_usbph_handle_events_nonblocking(). Flushes, key
+ * events and scrolling text all complete from there. It never
+ * waits on the device: updates due while a flush is in flight
+ * go out once it completes. Over hidraw, though, writing a
+ * flush's reports is synchronous, and blocks until the driver
+ * has sent them.
+ *
+ * ip_usbph_get_pollfds() returns the number of descriptors
+ * (only the count if 'fds' is NULL), or -ENOSPC if more
+ * than 'max'. Descriptors can come and go; the notifier is
+ * called with events == 0 when one is removed.
+ *
+ * Not available in threaded mode.
+ */
+int ip_usbph_get_pollfds(struct ip_usbph *ph, struct pollfd *fds, int max);
+int ip_usbph_next_timeout(struct ip_usbph *ph);
+int ip_usbph_handle_events_nonblocking(struct ip_usbph *ph);
+
+typedef void (*ip_usbph_pollfd_cb)(int fd, short events, void *priv);
+void ip_usbph_set_pollfd_notifier(struct ip_usbph *ph, ip_usbph_pollfd_cb callback, void *priv);
+
+/*
+ * Transfer statistics, kept per handle.
+ *
+ * packets[] is indexed by display code (0 to 6), with any
+ * other packet (init, backlight) counted in the last entry.
+ * errors[] is indexed by the negated libusb_error code
+ * (1 is LIBUSB_ERROR_IO), with anything else in entry 0.
+ *
+ * Histogram bucket 'n' counts latencies of 2^n to 2^(n+1)-1
+ * usec; the first bucket also has anything faster, the last
+ * anything slower. Control transfer latency is from submit
+ * to completion, key latency from the report arriving to the
+ * application reading it.
+ */
+#define IP_USBPH_STATS_CODES	8
+#define IP_USBPH_STATS_ERRORS	13
+#define IP_USBPH_STATS_BUCKETS	24
+
+struct ip_usbph_stats {
+	uint64_t packets[IP_USBPH_STATS_CODES];
+	uint64_t bytes;		/* Sent */
+	uint64_t flushes;	/* Flushes that sent anything */
+	uint64_t skipped;	/* Packets the device already had */
+	uint64_t deferred;	/* Flushes merged into a later one */
+	uint64_t retries;	/* Transfers sent again after failing */
+	uint64_t key_reports;
+	uint64_t errors[IP_USBPH_STATS_ERRORS];
+	uint64_t control_usec[IP_USBPH_STATS_BUCKETS];
+	uint64_t key_usec[IP_USBPH_STATS_BUCKETS];
+};
+
+/* Copy out the statistics. In threaded mode, the copy may be
+ * a little behind, and not all counters from the same instant.
+ */
+int ip_usbph_stats_get(struct ip_usbph *ph, struct ip_usbph_stats *stats);
+void ip_usbph_stats_reset(struct ip_usbph *ph);
+
+/*
+ * Raw packet access.
+ *
+ * A display code packet (02 C1 40 ... 02 61 5E) replaces that
+ * code's buffer, to be sent by the next flush. Anything else
+ * is sent to the device at once.
+ */
+int ip_usbph_packet_put(struct ip_usbph *ph, const uint8_t packet[8]);
+
+/*
+ * Packet tracing.
+ *
+ * The trace sink is called for every packet sent to the device
+ * (as it is submitted), and every report read from it. 'code'
+ * is the display code, 1 to 7, or 0 for any other packet. The
+ * sink is called from event handling, so it must not call back
+ * into the library.
+ */
+#define IP_USBPH_TRACE_OUT	0
+#define IP_USBPH_TRACE_IN	1
+
+struct ip_usbph_trace {
+	uint64_t monotonic_ns;
+	uint8_t dir;
+	uint8_t code;
+	uint8_t packet[8];
+};
+
+typedef void (*ip_usbph_trace_cb)(const struct ip_usbph_trace *rec, void *priv);
+void ip_usbph_trace_set(struct ip_usbph *ph, ip_usbph_trace_cb callback, void *priv);
+
+/*
+ * Built-in trace sink: a ring of the last 'records' packets,
+ * spooled to 'fd' (if not -1) in the trace file format.
+ *
+ * Use ip_usbph_tracer_sink() as the callback, and the tracer
+ * as its 'priv'. The ring is written out whenever it is half
+ * full, and by ip_usbph_tracer_sync(). ip_usbph_tracer_read()
+ * copies out the most recent records, oldest first.
+ *
+ * The file is a 16 byte header ("IPTR", version 1, zeros), then
+ * 24 byte little endian records: monotonic_ns(8), dir(1),
+ * code(1), zeros(6), packet(8).
+ */
+#define IP_USBPH_TRACE_HEADER	16
+#define IP_USBPH_TRACE_RECORD	24
+
+struct ip_usbph_tracer;
+
+struct ip_usbph_tracer *ip_usbph_tracer_new(unsigned records, int fd);
+void ip_usbph_tracer_free(struct ip_usbph_tracer *tracer);
+void ip_usbph_tracer_sink(const struct ip_usbph_trace *rec, void *priv);
+int ip_usbph_tracer_read(struct ip_usbph_tracer *tracer, struct ip_usbph_trace *recs, int max);
+int ip_usbph_tracer_sync(struct ip_usbph_tracer *tracer);
+
+/* Trace file parsing. ip_usbph_trace_check() returns 0 for a
+ * good header, -EINVAL otherwise.
+ */
+int ip_usbph_trace_check(const uint8_t header[IP_USBPH_TRACE_HEADER]);
+void ip_usbph_trace_decode(const uint8_t raw[IP_USBPH_TRACE_RECORD], struct ip_usbph_trace *rec);
+
+/*
+ * Transports without a phone.
+ *
+ * ip_usbph_null_new() returns a handle that completes every
+ * transfer at once, and never reports a key.
+ *
+ * ip_usbph_sim_new() returns a simulated phone. It decodes the
+ * display packets it is sent back into a frame, read with
+ * ip_usbph_sim_frame(); a character's IP_USBPH_SEG_M reads back
+ * as IP_USBPH_SEG_LC | IP_USBPH_SEG_RC. Every transfer takes
+ * ip_usbph_sim_latency() usec (0 by default), one after the
+ * other, as on the bus. ip_usbph_sim_turnaround() adds 'usec'
+ * (0 by default) before each transfer completes, as the phone
+ * answers it; transfers overlap there, so a pipelined flush
+ * waits for one turnaround and a transfer at a time for one
+ * each. ip_usbph_sim_keys() queues scripted key
+ * reports, each 'delay_msec' after the one before it, or -ENOSPC
+ * if too many are already queued.
+ *
+ * ip_usbph_sim_fail() makes the next 'count' transfers of display
+ * code 'code' (0 to 6, or -1 for any transfer) fail with 'err'.
+ * -ETIMEDOUT fails once the transfer's timeout has passed, and
+ * a transfer without one hangs, like a wedged phone.
+ *
+ * ip_usbph_acquire() returns one of these, rather than a USB
+ * device, if $IP_USBPH_TRANSPORT is "null" or "sim".
+ *
+ * The ip_usbph_sim_*() calls return -EINVAL for any handle not
+ * from ip_usbph_sim_new().
+ */
+struct ip_usbph_sim_key {
+	unsigned delay_msec;
+	uint8_t key;	/* IP_USBPH_KEY_*, with IP_USBPH_KEY_PRESSED */
+};
+
+struct ip_usbph *ip_usbph_null_new(void);
+struct ip_usbph *ip_usbph_sim_new(void);
+int ip_usbph_sim_latency(struct ip_usbph *ph, unsigned usec);
+int ip_usbph_sim_turnaround(struct ip_usbph *ph, unsigned usec);
+int ip_usbph_sim_keys(struct ip_usbph *ph, const struct ip_usbph_sim_key *keys, int n);
+int ip_usbph_sim_fail(struct ip_usbph *ph, int code, int count, int err);
+int ip_usbph_sim_frame(struct ip_usbph *ph, struct ip_usbph_frame *frame);
+
 #endif /* IP_USBPH_H */
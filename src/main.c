@@ -9,427 +9,387 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <errno.h>
 #include <limits.h>
 
+#include <sys/socket.h>
+#include <sys/un.h>
+
 #include "argv.h"
-#include "ip-usbph.h"
+#include "commands.h"
 
 #define ARRAY_SIZE(x) (sizeof(x)/sizeof(x[0]))
+#define USB_FDS		16	/* Most libusb file descriptors */
 
-const char *keymap[0x20] = {
-	[IP_USBPH_KEY_0] = "0",
-	[IP_USBPH_KEY_1] = "1",
-	[IP_USBPH_KEY_2] = "2",
-	[IP_USBPH_KEY_3] = "3",
-	[IP_USBPH_KEY_4] = "4",
-	[IP_USBPH_KEY_5] = "5",
-	[IP_USBPH_KEY_6] = "6",
-	[IP_USBPH_KEY_7] = "7",
-	[IP_USBPH_KEY_8] = "8",
-	[IP_USBPH_KEY_9] = "9",
-	[IP_USBPH_KEY_YES] = "YES",
-	[IP_USBPH_KEY_NO] = "NO",
-	[IP_USBPH_KEY_VOL_UP] = "VOL+",
-	[IP_USBPH_KEY_VOL_DOWN] = "VOL-",
-	[IP_USBPH_KEY_UP] = "UP",
-	[IP_USBPH_KEY_DOWN] = "DOWN",
-	[IP_USBPH_KEY_S] = "S",
-	[IP_USBPH_KEY_C] = "C",
-	[IP_USBPH_KEY_ASTERISK] = "*",
-	[IP_USBPH_KEY_HASH] = "#",
-};
-
-struct {
-	const char *name;
-	ip_usbph_sym symbol;
-} symbols[] = {
-	{ .name = "Down", .symbol = IP_USBPH_SYMBOL_DOWN },
-	{ .name = "Up", .symbol = IP_USBPH_SYMBOL_UP },
-	{ .name = "Sat", .symbol = IP_USBPH_SYMBOL_SAT },
-	{ .name = "Colon", .symbol = IP_USBPH_SYMBOL_COLON },
-	{ .name = "Fri", .symbol = IP_USBPH_SYMBOL_FRI },
-	{ .name = "Thu", .symbol = IP_USBPH_SYMBOL_THU },
-	{ .name = "M_and_D", .symbol = IP_USBPH_SYMBOL_M_AND_D },
-	{ .name = "Tue", .symbol = IP_USBPH_SYMBOL_TUE },
-	{ .name = "Wed", .symbol = IP_USBPH_SYMBOL_WED },
-	{ .name = "Mon", .symbol = IP_USBPH_SYMBOL_MON },
-	{ .name = "Sun", .symbol = IP_USBPH_SYMBOL_SUN },
-	{ .name = "Out", .symbol = IP_USBPH_SYMBOL_OUT },
-	{ .name = "In", .symbol = IP_USBPH_SYMBOL_IN },
-	{ .name = "New", .symbol = IP_USBPH_SYMBOL_NEW },
-	{ .name = "Mute", .symbol = IP_USBPH_SYMBOL_MUTE },
-	{ .name = "Lock", .symbol = IP_USBPH_SYMBOL_LOCK },
-	{ .name = "Man", .symbol = IP_USBPH_SYMBOL_MAN },
-	{ .name = "Balance", .symbol = IP_USBPH_SYMBOL_BALANCE },
-	{ .name = "Decimal", .symbol = IP_USBPH_SYMBOL_DECIMAL },
-};
-
-static int cmd_backlight(struct ip_usbph *ph, int argc, char **argv)
-{
-	if (argc > 1) {
-		return -EINVAL;
-	}
+/* Connection to ip-usbphd, if it is running */
+static int daemon_fd = -1;
+static FILE *daemon_in;
 
-	return ip_usbph_backlight(ph);
+/* Otherwise, the device is ours */
+static struct session session;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage:\n"
+			"%s <command>\n\n",
+			prog);
+	command_usage(stderr);
+	fprintf(stderr, "shell                     Shell mode\n");
+	fprintf(stderr, "pipe                      Pipe mode\n");
+	fprintf(stderr, "pipe --binary             Binary framed pipe mode\n");
 }
 
-static int cmd_symbols(struct ip_usbph *ph, int argc, char **argv)
+static int daemon_connect(void)
 {
-	int i;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	command_socket(addr.sun_path, sizeof(addr.sun_path));
 
-	if (argc > 1) {
-		return -EINVAL;
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -errno;
 	}
 
-	for (i = 0; i < ARRAY_SIZE(symbols); i++) {
-		printf("%s\n", symbols[i].name);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    (daemon_in = fdopen(dup(fd), "r")) == NULL) {
+		close(fd);
+		return -ENOENT;
 	}
 
+	daemon_fd = fd;
 	return 0;
 }
 
-static int cmd_symbol(struct ip_usbph *ph, int argc, char **argv)
+static int remote_line(const char *line, int len);
+
+/* Send a command to the daemon, copying its output to stdout
+ */
+static int remote(int argc, char **argv)
 {
-	int onoff = -EINVAL;
-	int i;
-	int err;
+	char line[1024];
+	int len;
 
-	if (argc != 3) {
-		return -EINVAL;
+	/* Quote every argument, so that the daemon splits
+	 * the line exactly as we did.
+	 */
+	len = argv_join(line, sizeof(line) - 1, argc, argv);
+	if (len < 0) {
+		return len;
 	}
+	line[len++] = '\n';
 
-	if (strcasecmp(argv[2],"on") == 0) {
-		onoff = 1;
-	}
+	return remote_line(line, len);
+}
 
-	if (strcasecmp(argv[2],"off") == 0) {
-		onoff = 0;
-	}
+/* Send a line to the daemon, and copy its output to stdout
+ */
+static int remote_line(const char *line, int len)
+{
+	int c, err;
 
-	if (onoff < 0) {
-		return onoff;
+	if (write(daemon_fd, line, len) != len) {
+		return -EPIPE;
 	}
 
-	for (i = 0; i < ARRAY_SIZE(symbols); i++) {
-		if (strcasecmp(argv[1], symbols[i].name) == 0) {
-			err = ip_usbph_symbol(ph, symbols[i].symbol, onoff);
-			ip_usbph_flush(ph);
-			return err;
+	/* Output, a NUL, then the result */
+	while ((c = fgetc(daemon_in)) != 0) {
+		if (c == EOF) {
+			return -EPIPE;
 		}
+		putchar(c);
+	}
+	fflush(stdout);
+
+	/* Not "%d\n" - that would wait for the next reply */
+	if (fscanf(daemon_in, "%d", &err) != 1 || fgetc(daemon_in) != '\n') {
+		return -EPIPE;
 	}
 
-	return -EINVAL;
+	return err;
 }
 
-static int cmd_digit(struct ip_usbph *ph, int argc, char **argv)
+/* No daemon - talk to the device directly
+ */
+static void local_open(void)
 {
-	int i;
-	char *cp = argv[1];
-
-	if (argc != 2) {
-		return -EINVAL;
-	}
-
-	for (i = 0; cp[i] != 0; i++) {
-		if (!isxdigit(cp[i]) && !isspace(cp[i])) {
-			return -EINVAL;
+	if (session.ph == NULL) {
+		session.ph = ip_usbph_acquire(0);
+		if (session.ph == NULL) {
+			fprintf(stderr, "Can't find the IP-USBPH device. Is it plugged in?\n");
+			exit(EXIT_FAILURE);
 		}
-	}
+		session.out = stdout;
 
-	if (i > 11) {
-		return -ENAMETOOLONG;
+		rc_load(session.ph);
 	}
+}
 
-	for (i = 0; cp[i] != 0; i++) {
-		ip_usbph_top_digit(ph, i, ip_usbph_font_digit(cp[i]));
-	}
+static int local(const struct command *cmd, int argc, char **argv)
+{
+	local_open();
 
-	for (; i < 11; i++) {
-		ip_usbph_top_digit(ph, i, 0);
-	}
-	
-	return ip_usbph_flush(ph);
+	return cmd->cmd(&session, argc, argv);
 }
 
-static int cmd_top(struct ip_usbph *ph, int argc, char **argv)
+static int command(int argc, char **argv)
 {
-	int i;
-	char *cp = argv[1];
+	int err;
+	const struct command *cmd;
 
-	if (argc != 2) {
-		return -EINVAL;
+	if (argc == 0) {
+		return 0;
 	}
 
-	if (strlen(cp) > 8) {
-		return -ENAMETOOLONG;
+	cmd = command_find(argv[0]);
+	if (cmd == NULL) {
+		usage(argv[0]);
+		return 0;
 	}
 
-	for (i = 0; cp[i] != 0; i++) {
-		ip_usbph_top_char(ph, i, ip_usbph_font_char(cp[i]));
+	if (daemon_fd >= 0) {
+		err = remote(argc, argv);
+	} else {
+		err = local(cmd, argc, argv);
 	}
 
-	for (; i < 8; i++) {
-		ip_usbph_top_char(ph, i, 0);
+	if (err < 0) {
+		if (err == -ETIMEDOUT) {
+			/* Do nothing */
+		} else if (err == -EINVAL) {
+			fprintf(stderr, "Invalid arguments.\n");
+		} else if (err == -ENAMETOOLONG) {
+			fprintf(stderr, "String too long for command.\n");
+		} else {
+			errno = -err;
+			perror(argv[0]);
+		}
 	}
 
-	return ip_usbph_flush(ph);
+	return err;
 }
 
-static int cmd_bot(struct ip_usbph *ph, int argc, char **argv)
+/* Wait for stdin, running the device's events and timers
+ * meanwhile, and flushing held updates as their coalescing
+ * window closes. Returns 1 once stdin is ready, 0 if it is
+ * not yet, or -errno.
+ */
+static int input_wait(void)
 {
-	int i;
-	char *cp = argv[1];
-
-	if (argc != 2) {
-		return -EINVAL;
-	}
+	struct pollfd fds[1 + USB_FDS];
+	int n = 1, nusb, wait, left;
+
+	fds[0].fd = STDIN_FILENO;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+
+	wait = session_timeout(&session);
+	if (session.ph != NULL) {
+		nusb = ip_usbph_get_pollfds(session.ph, &fds[1], USB_FDS);
+		if (nusb > 0) {
+			n += nusb;
+		}
 
-	if (strlen(cp) > 4) {
-		return -ENAMETOOLONG;
+		left = ip_usbph_next_timeout(session.ph);
+		if (left >= 0 && (wait < 0 || left < wait)) {
+			wait = left;
+		}
 	}
 
-	for (i = 0; cp[i] != 0; i++) {
-		ip_usbph_bot_char(ph, i, ip_usbph_font_char(cp[i]));
+	n = poll(fds, n, wait);
+	if (n < 0 && errno != EINTR) {
+		return -errno;
 	}
 
-	for (; i < 4; i++) {
-		ip_usbph_bot_char(ph, i, 0);
+	if (session.ph != NULL) {
+		ip_usbph_handle_events_nonblocking(session.ph);
 	}
+	session_run(&session);
 
-	return ip_usbph_flush(ph);
+	return (n > 0 && fds[0].revents != 0);
 }
 
-static int cmd_keys(struct ip_usbph *ph, int argc, char **argv)
+/* Next line from stdin, or NULL at the end. Held updates
+ * are flushed as their coalescing window closes, even while
+ * the input is idle.
+ */
+static char *line_next(void)
 {
-	int i;
+	static char buff[1024];
+	static size_t len, used;
+	char *nl;
+	ssize_t n;
+
+	len -= used;
+	memmove(buff, buff + used, len);
+	used = 0;
+
+	for (;;) {
+		nl = memchr(buff, '\n', len);
+		if (nl != NULL) {
+			*nl = 0;
+			used = nl - buff + 1;
+			return buff;
+		}
 
-	if (argc > 1) {
-		return -EINVAL;
-	}
+		if (len == sizeof(buff) - 1) {
+			break;
+		}
 
-	for (i = 0; i < ARRAY_SIZE(keymap); i++) {
-		if (keymap[i] == NULL) {
+		n = input_wait();
+		if (n < 0) {
+			break;
+		}
+		if (n == 0) {
 			continue;
 		}
-		printf("%s\n", keymap[i]);
-	}
-
-	return 0;
-}
-
-static int cmd_key(struct ip_usbph *ph, int argc, char **argv)
-{
-	int timeout = -1;
-	uint8_t key;
-
-	if (argc > 2) {
-		return -EINVAL;
-	}
-
-	if (argc == 2) {
-		timeout = strtol(argv[1], NULL, 0);
-	}
 
-	while ((key = ip_usbph_key_get(ph, timeout)) != IP_USBPH_KEY_ERROR) {
-		if (key == IP_USBPH_KEY_IDLE)
+		n = read(STDIN_FILENO, buff + len, sizeof(buff) - 1 - len);
+		if (n < 0 && errno == EINTR) {
 			continue;
-
-		if ((key & IP_USBPH_KEY_PRESSED) != 0) {
-			printf("%s\n", keymap[key & 0x1f]);
-			fflush(stdout);
-			return 0;
 		}
+		if (n <= 0) {
+			break;
+		}
+		len += n;
 	}
 
-	printf("KEY: IO error\n");
-	fflush(stdout);
-	return -EIO;
-}
-
-static int cmd_clear(struct ip_usbph *ph, int argc, char **argv)
-{
-	if (argc > 1) {
-		return -EINVAL;
+	/* Unterminated last line, or one too long */
+	if (len == 0) {
+		return NULL;
 	}
 
-	return ip_usbph_clear(ph);
+	buff[len] = 0;
+	used = len;
+	return buff;
 }
 
-struct {
-	const char *name;
-	const char *help;
-	int (*cmd)(struct ip_usbph *ph, int argc, char **argv);
-} cmds[] = {
-	{ .name = "backlight", .help = "backlight                 Turn the backlight on for 7 seconds",
-	  .cmd = cmd_backlight, },
-	{ .name = "clear",     .help = "clear                     Clear the display",
-	  .cmd = cmd_clear, },
-	{ .name = "symbols",   .help = "symbols                   List all symbols",
-	  .cmd = cmd_symbols, },
-	{ .name = "symbol",    .help = "symbol <name> on|off      Turn on/off a symbol",
-	  .cmd = cmd_symbol, },
-	{ .name = "digit",     .help = "digit <digits>            Display digits on the digit line",
-	  .cmd = cmd_digit, },
-	{ .name = "top",       .help = "top <string>              Display characters on the top character line",
-	  .cmd = cmd_top, },
-	{ .name = "bot",       .help = "bot <string>              Display characters on the top character line",
-	  .cmd = cmd_bot, },
-	{ .name = "key",       .help = "key [timeout]             Wait for a keystroke, optional timeout in msec",
-	  .cmd = cmd_key, },
-	{ .name = "keys",      .help = "keys                      List all key names",
-	  .cmd = cmd_keys },
-};
-
-static void usage(const char *prog)
-{
-	int i;
-
-	fprintf(stderr, "Usage:\n"
-			"%s <command>\n\n",
-			prog);
-	for (i = 0; i < ARRAY_SIZE(cmds); i++) {
-		fprintf(stderr, "%s\n", cmds[i].help);
-	}
-	fprintf(stderr, "shell                     Shell mode\n");
-	fprintf(stderr, "pipe                      Pipe mode\n");
-}
-
-static void rc_load(struct ip_usbph *ph)
-{
-	char rcfile[PATH_MAX];
-	int fd;
-
-	snprintf(rcfile, sizeof(rcfile), "%s/.ip-usbphrc", getenv("HOME"));
-	fd = open(rcfile, O_RDONLY);
-	if (fd >= 0) {
-		ip_usbph_state_load(ph, fd);
-		close(fd);
-	}
-}
-
-static void rc_save(struct ip_usbph *ph)
+/* Binary frames on stdin, applied as they arrive. Whatever
+ * one read() brings in is flushed together.
+ */
+static int pipe_binary(void)
 {
-	char rcfile[PATH_MAX];
-	char rcfile_new[PATH_MAX];
-	int fd;
+	static uint8_t buff[65536];
+	size_t len = 0, used;
+	ssize_t n;
+	int err;
 
-	snprintf(rcfile, sizeof(rcfile_new), "%s/.ip-usbphrc", getenv("HOME"));
-	snprintf(rcfile_new, sizeof(rcfile_new), "%s/.ip-usbphrc~", getenv("HOME"));
-	rename(rcfile, rcfile_new);
-	fd = open(rcfile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
-	if (fd < 0) {
-		rename(rcfile_new, rcfile);
-	} else {
-		ip_usbph_state_save(ph, fd);
-		close(fd);
-	}
-}
+	if (daemon_fd >= 0) {
+		/* The daemon parses - just pass the bytes on */
+		err = remote_line("binary\n", 7);
+		if (err < 0) {
+			return err;
+		}
 
-static int command(struct ip_usbph **pph, int argc, char **argv)
-{
-	int i, err;
-	struct ip_usbph *ph = *pph;
-	int (*cmd)(struct ip_usbph *ph, int argc, char **argv) = NULL;
+		while ((n = read(STDIN_FILENO, buff, sizeof(buff))) != 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n < 0 || write(daemon_fd, buff, n) != n) {
+				return -EPIPE;
+			}
+		}
 
-	if (argc == 0) {
 		return 0;
 	}
 
-	for (i = 0; i < ARRAY_SIZE(cmds); i++) {
-		if (strcmp(argv[0],cmds[i].name) == 0) {
-			cmd = cmds[i].cmd;
-			break;
-		}
-	}
+	local_open();
 
-	if (cmd == NULL) {
-		usage(argv[0]);
-		return 0;
-	}
+	for (;;) {
+		err = input_wait();
+		if (err < 0) {
+			/* poll() failed, other than by a signal */
+			return err;
+		}
+		if (err == 0) {
+			/* Timed out or interrupted - stdin is not ready */
+			continue;
+		}
 
-	if (ph == NULL) {
-		ph = ip_usbph_acquire(0);
-		if (ph == NULL) {
-			fprintf(stderr, "Can't find the IP-USBPH device. Is it plugged in?\n");
-			exit(EXIT_FAILURE);
+		n = read(STDIN_FILENO, buff + len, sizeof(buff) - len);
+		if (n < 0 && errno == EINTR) {
+			continue;
 		}
-		*pph = ph;
+		if (n <= 0) {
+			break;
+		}
+		len += n;
 
-		rc_load(ph);
-	}
+		used = command_frames(&session, buff, len);
+		len -= used;
+		memmove(buff, buff + used, len);
 
-	err = cmd(ph, argc, argv);
-	if (err < 0) {
-		if (err == -ETIMEDOUT) {
-			/* Do nothing */
-		} else if (err == -EINVAL) {
-			fprintf(stderr, "Invalid arguments.\n");
-		} else if (err == -ENAMETOOLONG) {
-			fprintf(stderr, "String too long for command.\n");
-		} else {
-			errno = -err;
-			perror(argv[0]);
+		/* No frame is this long, so the stream is garbled */
+		if (len == sizeof(buff)) {
+			return -EPROTO;
 		}
 	}
 
-	return err;
+	return (n < 0) ? -errno : 0;
 }
 
 int main(int argc, char **argv)
 {
-	struct ip_usbph *ph = NULL;
-	int err;
+	int err = 0;
 
 	if (argc < 2) {
 		usage(argv[0]);
 	}
 
-	if (argc == 2 && (strcmp(argv[1], "shell") == 0 || strcmp(argv[1], "pipe") == 0)) {
+	daemon_connect();
+
+	if (argc == 3 && strcmp(argv[1], "pipe") == 0 && strcmp(argv[2], "--binary") == 0) {
+		err = pipe_binary();
+		if (err < 0) {
+			fprintf(stderr, "%s\n", strerror(-err));
+		}
+	} else if (argc == 2 && (strcmp(argv[1], "shell") == 0 || strcmp(argv[1], "pipe") == 0)) {
 		int pipe_mode = (strcmp(argv[1], "pipe") == 0);
 
 		for (;;) {
-			char buff[256];
+			char *args[ARGV_MAX];
+			int nargs;
 			char *s;
 
 			if (! pipe_mode) {
 				printf("ip-usbph> ");
+				fflush(stdout);
 			};
-			buff[0] = 0;
-			s = fgets(buff, sizeof(buff), stdin);
-			if (s == NULL || buff[0] == 0) {
-				return EXIT_SUCCESS;
+			s = line_next();
+			if (s == NULL || s[0] == 0) {
+				err = 0;
+				break;
 			}
 
-			err = argv_from(buff, &argc, &argv);
-			if (err < 0) {
-				return EXIT_FAILURE;
+			nargs = argv_split(s, args, ARGV_MAX);
+			if (nargs < 0) {
+				err = nargs;
+				break;
 			}
 	
-			if (argc == 0 || strcmp(argv[0], "exit") == 0) {
-				return EXIT_SUCCESS;
+			if (nargs == 0 || strcmp(args[0], "exit") == 0) {
+				err = 0;
+				break;
 			}
 
-			err = command(&ph, argc, argv);
+			err = command(nargs, args);
 			if (err < 0) {
 				fprintf(stderr, "%s\n", strerror(-err));
 			}
-			argv_free(argc, argv);
 		}
 	} else {
-		err = command(&ph, argc-1, &argv[1]);
+		err = command(argc-1, &argv[1]);
 	}
 
-	if (ph != NULL) {
-		rc_save(ph);
-		ip_usbph_release(ph);
+	if (session.ph != NULL) {
+		session_sync(&session);
+		trace_stop(session.ph);
+		rc_save(session.ph);
+		ip_usbph_release(session.ph);
 	}
 
 	return (err == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
-
-
@@ -0,0 +1,135 @@
+/*
+ * Copyright 2007, Jason McMullan
+ * Author: Jason McMullan <jason.mcmullan@gmail.com>
+ *
+ * Licensed under the LGPL v2
+ */
+
+/*
+ * Generates the per-position glyph lookup tables (ip-usbph-glyphtab.h)
+ * from the segment maps in ip-usbph-segmap.h
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <strings.h>
+
+#include "ip-usbph.h"
+#include "ip-usbph-private.h"
+#include "ip-usbph-segmap.h"
+
+struct lut {
+	int code[2];
+	uint64_t clear[2];
+	uint64_t seg[16][2];	/* Packet bits for each glyph bit */
+};
+
+static void lut_seg(struct lut *lut, int gbit, code_id code, int bit)
+{
+	int c;
+
+	for (c = 0; c < 2; c++) {
+		if (lut->code[c] == code || lut->code[c] == 0)
+			break;
+	}
+
+	if (c == 2) {
+		fprintf(stderr, "mkglyphtab: glyph spans more than two packets\n");
+		exit(EXIT_FAILURE);
+	}
+
+	lut->code[c] = code;
+	lut->clear[c] |= PACKET_BIT(bit);
+	lut->seg[gbit][c] |= PACKET_BIT(bit);
+}
+
+static void lut_emit(const char *name, const struct lut *lut, int count)
+{
+	int i, c, n, v, b;
+
+	printf("static const struct glyph_lut %s[%d] = {\n", name, count);
+	for (i = 0; i < count; i++, lut++) {
+		printf("\t[%d] = {\n", i);
+		printf("\t\t.code = { %d, %d },\n", lut->code[0], lut->code[1]);
+		printf("\t\t.clear = { 0x%016llxULL, 0x%016llxULL },\n",
+		       (unsigned long long)lut->clear[0],
+		       (unsigned long long)lut->clear[1]);
+		printf("\t\t.set = {\n");
+		for (c = 0; c < 2; c++) {
+			printf("\t\t\t[%d] = {\n", c);
+			for (n = 0; n < 4; n++) {
+				printf("\t\t\t\t{");
+				for (v = 0; v < 16; v++) {
+					uint64_t bits = 0;
+
+					for (b = 0; b < 4; b++) {
+						if (v & (1 << b))
+							bits |= lut->seg[n * 4 + b][c];
+					}
+					printf("%s0x%llxULL,", (v % 4) ? " " : "\n\t\t\t\t  ",
+					       (unsigned long long)bits);
+				}
+				printf("\n\t\t\t\t},\n");
+			}
+			printf("\t\t\t},\n");
+		}
+		printf("\t\t},\n");
+		printf("\t},\n");
+	}
+	printf("};\n\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct lut top_digit[IP_USBPH_TOP_DIGITS] = {};
+	struct lut top_char[IP_USBPH_TOP_CHARS] = {};
+	struct lut bot_char[IP_USBPH_BOT_CHARS] = {};
+	int i, j;
+
+	for (i = 0; i < IP_USBPH_TOP_DIGITS; i++) {
+		for (j = 0; j < 8; j++) {
+			if (xref_digit_segment[i][j].code == 0)
+				continue;
+			lut_seg(&top_digit[i], j, xref_digit_segment[i][j].code,
+			                          xref_digit_segment[i][j].bit);
+		}
+	}
+
+	/* IP_USBPH_SEG_M on a character lights both LC and RC */
+	for (i = 0; i < IP_USBPH_TOP_CHARS; i++) {
+		for (j = 0; j < 14; j++) {
+			ip_usbph_char mask = top_seg_map[j].mask;
+			code_id code = top_char_seg[i][top_seg_map[j].seg].code;
+			int bit = top_char_seg[i][top_seg_map[j].seg].bit +
+			          top_seg_map[j].bit;
+
+			lut_seg(&top_char[i], ffs(mask) - 1, code, bit);
+			if (mask & (IP_USBPH_SEG_LC | IP_USBPH_SEG_RC))
+				lut_seg(&top_char[i], ffs(IP_USBPH_SEG_M) - 1, code, bit);
+		}
+	}
+
+	for (i = 0; i < IP_USBPH_BOT_CHARS; i++) {
+		for (j = 0; j < 14; j++) {
+			ip_usbph_char mask = bot_seg_map[j].mask;
+			code_id code = bot_char_seg[i][bot_seg_map[j].seg].code;
+			int bit = bot_char_seg[i][bot_seg_map[j].seg].bit +
+			          bot_seg_map[j].bit;
+
+			lut_seg(&bot_char[i], ffs(mask) - 1, code, bit);
+			if (mask & (IP_USBPH_SEG_LC | IP_USBPH_SEG_RC))
+				lut_seg(&bot_char[i], ffs(IP_USBPH_SEG_M) - 1, code, bit);
+		}
+	}
+
+	printf("/* Generated by mkglyphtab - do not edit */\n\n");
+	printf("#ifndef IP_USBPH_GLYPHTAB_H\n");
+	printf("#define IP_USBPH_GLYPHTAB_H\n\n");
+	lut_emit("top_digit_lut", top_digit, IP_USBPH_TOP_DIGITS);
+	lut_emit("top_char_lut", top_char, IP_USBPH_TOP_CHARS);
+	lut_emit("bot_char_lut", bot_char, IP_USBPH_BOT_CHARS);
+	printf("#endif /* IP_USBPH_GLYPHTAB_H */\n");
+
+	return 0;
+}
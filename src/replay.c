@@ -0,0 +1,197 @@
+/*
+ * Copyright 2009, Jason McMullan
+ * Author: Jason McMullan <jason.mcmullan@gmail.com>
+ *
+ * Licensed under the LGPL v2
+ */
+
+/*
+ * ip-usbph-replay - play a packet trace back
+ *
+ * Packets sent close together in the trace (within the group
+ * window) are flushed together, as the original flush did.
+ * Widening the window shows what coalescing would have saved.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "ip-usbph.h"
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ULL,
+		.tv_nsec = ns % 1000000000ULL,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* Whole trace file, header checked
+ */
+static uint8_t *trace_load(const char *name, size_t *plen)
+{
+	uint8_t *buff = NULL;
+	size_t len = 0, size = 0;
+	ssize_t n;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	for (;;) {
+		if (len == size) {
+			uint8_t *tmp;
+
+			size = size ? size * 2 : 65536;
+			tmp = realloc(buff, size);
+			if (tmp == NULL)
+				break;
+			buff = tmp;
+		}
+
+		n = read(fd, buff + len, size - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		len += n;
+	}
+
+	close(fd);
+
+	if (len < IP_USBPH_TRACE_HEADER || ip_usbph_trace_check(buff) < 0) {
+		free(buff);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	*plen = len;
+	return buff;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage:\n"
+			"%s [-n] [-f] [-g <msec>] <trace>\n\n"
+			"-n                        Null device - no phone needed\n"
+			"-f                        As fast as possible, not at the original timing\n"
+			"-g <msec>                 Flush packets within msec of each other together (1)\n",
+			prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct ip_usbph *ph;
+	struct ip_usbph_trace rec;
+	struct ip_usbph_stats st;
+	uint64_t sent = 0;
+	uint64_t group_ns = 1000000;
+	uint64_t first_ns = 0, start_ns, batch_ns = 0;
+	unsigned long packets = 0, flushes = 0;
+	int null = 0, fast = 0;
+	int c, i, pending = 0;
+	uint8_t *buff;
+	size_t len, pos;
+
+	while ((c = getopt(argc, argv, "nfg:")) != -1) {
+		switch (c) {
+		case 'n':
+			null = 1;
+			break;
+		case 'f':
+			fast = 1;
+			break;
+		case 'g':
+			group_ns = strtoul(optarg, NULL, 0) * 1000000ULL;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	buff = trace_load(argv[optind], &len);
+	if (buff == NULL) {
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	ph = null ? ip_usbph_null_new() : ip_usbph_acquire(0);
+	if (ph == NULL) {
+		fprintf(stderr, "Can't find the IP-USBPH device. Is it plugged in?\n");
+		return EXIT_FAILURE;
+	}
+	ip_usbph_stats_reset(ph);
+
+	start_ns = now_ns();
+
+	for (pos = IP_USBPH_TRACE_HEADER; pos + IP_USBPH_TRACE_RECORD <= len;
+	     pos += IP_USBPH_TRACE_RECORD) {
+		ip_usbph_trace_decode(&buff[pos], &rec);
+		if (rec.dir != IP_USBPH_TRACE_OUT)
+			continue;
+
+		if (first_ns == 0)
+			first_ns = rec.monotonic_ns;
+
+		/* End of a group - flush it */
+		if (pending && rec.monotonic_ns - batch_ns >= group_ns) {
+			ip_usbph_flush(ph);
+			flushes++;
+			pending = 0;
+		}
+
+		if (!fast)
+			sleep_until(start_ns + (rec.monotonic_ns - first_ns));
+
+		if (!pending)
+			batch_ns = rec.monotonic_ns;
+
+		ip_usbph_packet_put(ph, rec.packet);
+		packets++;
+		pending |= (rec.code != 0);
+	}
+
+	if (pending) {
+		ip_usbph_flush(ph);
+		flushes++;
+	}
+
+	printf("%lu packets, %lu flushes, %.3f sec\n",
+	       packets, flushes, (now_ns() - start_ns) / 1e9);
+
+	ip_usbph_stats_get(ph, &st);
+	for (i = 0; i < IP_USBPH_STATS_CODES; i++)
+		sent += st.packets[i];
+	printf("%llu packets sent, %llu skipped, %llu flushes\n",
+	       (unsigned long long)sent, (unsigned long long)st.skipped,
+	       (unsigned long long)st.flushes);
+
+	ip_usbph_release(ph);
+
+	free(buff);
+
+	return EXIT_SUCCESS;
+}
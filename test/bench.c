@@ -0,0 +1,425 @@
+/*
+ * Copyright 2009, Jason McMullan <jason.mcmullan@gmail.com>
+ *
+ * Licensed under the LGPL v2
+ */
+
+/*
+ * Microbenchmarks for the rendering, flush and parsing paths.
+ *
+ * Each benchmark is run for at least the minimum time, and
+ * reported one per line as
+ *
+ *   Benchmark<name> <iterations> <ns> ns/op <allocs> allocs/op
+ *
+ * the format benchstat and friends compare. Display benchmarks
+ * run against the null transport, so no phone is needed.
+ *
+ * The USB benchmarks redraw a real phone, once over each way of
+ * sending it reports, and add a packets/s column. They are skipped
+ * without a phone, or with one lacking that path.
+ *
+ * The Sim benchmarks send the same seven packets a redraw takes to
+ * a simulated phone, whose every transfer waits on a USB frame for
+ * its answer: one packet at a time through the control path, and
+ * all at once as a pipelined flush.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "ip-usbph.h"
+#include "argv.h"
+
+#define ARRAY_SIZE(x) (sizeof(x)/sizeof(x[0]))
+
+/* The simulated phone: an 8 byte control transfer's share of a
+ * full speed bus, and an answer in the next 1ms USB frame.
+ */
+#define SIM_BUS_USEC		50
+#define SIM_TURNAROUND_USEC	1000
+
+/* Count every allocation, the library's included
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocs;
+
+void *malloc(size_t size)
+{
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+static struct ip_usbph *ph;
+static int state_fd = -1;
+static volatile unsigned sink;
+
+static const char *lines[] = {
+	"top \"HELLO\"",
+	"bot 'a b'",
+	"digit 0123\\ 456789",
+	"symbol Mute on",
+	"coalesce 50",
+	"commit",
+};
+
+static void bench_font_char(long n)
+{
+	long i;
+
+	for (i = 0; i < n; i++)
+		sink += ip_usbph_font_char(i & 0x7f);
+}
+
+static void bench_font_digit(long n)
+{
+	long i;
+
+	for (i = 0; i < n; i++)
+		sink += ip_usbph_font_digit(i & 0x7f);
+}
+
+static void bench_top_char(long n)
+{
+	long i;
+
+	for (i = 0; i < n; i++)
+		ip_usbph_top_char(ph, i % IP_USBPH_TOP_CHARS, ip_usbph_font_char('A' + i % 26));
+}
+
+static void bench_bot_char(long n)
+{
+	long i;
+
+	for (i = 0; i < n; i++)
+		ip_usbph_bot_char(ph, i % IP_USBPH_BOT_CHARS, ip_usbph_font_char('A' + i % 26));
+}
+
+static void bench_top_digit(long n)
+{
+	long i;
+
+	for (i = 0; i < n; i++)
+		ip_usbph_top_digit(ph, i % IP_USBPH_TOP_DIGITS, ip_usbph_font_digit('0' + i % 10));
+}
+
+/* Whole screen, alternating, so that every flush sends it all
+ */
+static void render_screen(long i)
+{
+	static const char *screen[2][3] = {
+		{ "12345678901", "HELLO", "ABCD" },
+		{ "09876543210", "WORLD", "WXYZ" },
+	};
+	const char **s = screen[i & 1];
+
+	ip_usbph_digit_text(ph, s[0]);
+	ip_usbph_top_text(ph, s[1]);
+	ip_usbph_bot_text(ph, s[2]);
+	ip_usbph_symbol(ph, IP_USBPH_SYMBOL_MUTE, i & 1);
+}
+
+static void bench_render_flush(long n)
+{
+	long i;
+
+	for (i = 0; i < n; i++) {
+		render_screen(i);
+		ip_usbph_flush(ph);
+	}
+}
+
+/* A redraw's seven packets, each sent and answered before the
+ * next - packets the library does not buffer go out this way.
+ */
+static void bench_sim_serial(long n)
+{
+	static const uint8_t packet[8] = { 0x02 };
+	long i;
+	int j;
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < 7; j++)
+			ip_usbph_packet_put(ph, packet);
+	}
+}
+
+/* The same seven packets, in flight together
+ */
+static void bench_sim_pipelined(long n)
+{
+	long i;
+
+	for (i = 0; i < n; i++) {
+		render_screen(i);
+		ip_usbph_flush_async(ph, NULL, NULL);
+		ip_usbph_flush_wait(ph);
+	}
+}
+
+/* Text longer than the row, precomputed as a marquee
+ */
+static void bench_marquee_text(long n)
+{
+	long i;
+
+	for (i = 0; i < n; i++)
+		ip_usbph_top_text(ph, (i & 1) ? "SCROLLING TEXT" : "MORE SCROLLING");
+	ip_usbph_top_text(ph, "");
+}
+
+static void bench_frame_commit(long n)
+{
+	struct ip_usbph_frame frame[2];
+	long i;
+	int j;
+
+	memset(frame, 0, sizeof(frame));
+	for (j = 0; j < IP_USBPH_TOP_DIGITS; j++)
+		frame[1].digit[j] = ip_usbph_font_digit('8');
+	for (j = 0; j < IP_USBPH_TOP_CHARS; j++)
+		frame[1].top[j] = ip_usbph_font_char('W');
+	for (j = 0; j < IP_USBPH_BOT_CHARS; j++)
+		frame[1].bot[j] = ip_usbph_font_char('M');
+
+	for (i = 0; i < n; i++)
+		ip_usbph_frame_commit(ph, &frame[i & 1], NULL);
+}
+
+static void bench_state_save(long n)
+{
+	long i;
+
+	for (i = 0; i < n; i++) {
+		lseek(state_fd, 0, SEEK_SET);
+		ip_usbph_state_save(ph, state_fd);
+	}
+}
+
+static void bench_state_load(long n)
+{
+	long i;
+
+	lseek(state_fd, 0, SEEK_SET);
+	ip_usbph_state_save(ph, state_fd);
+
+	for (i = 0; i < n; i++) {
+		lseek(state_fd, 0, SEEK_SET);
+		ip_usbph_state_load(ph, state_fd);
+	}
+}
+
+static void bench_argv_split(long n)
+{
+	char *args[ARGV_MAX];
+	char line[256];
+	long i;
+
+	for (i = 0; i < n; i++) {
+		/* Pipe mode splits its read buffer in place - copy,
+		 * so that every pass sees the same line.
+		 */
+		strcpy(line, lines[i % ARRAY_SIZE(lines)]);
+		sink += argv_split(line, args, ARGV_MAX);
+	}
+}
+
+static const struct bench {
+	const char *name;
+	void (*run)(long n);
+	const char *transport;	/* Phone over this, or NULL for the null device */
+} benches[] = {
+	{ "FontChar", bench_font_char },
+	{ "FontDigit", bench_font_digit },
+	{ "TopChar", bench_top_char },
+	{ "BotChar", bench_bot_char },
+	{ "TopDigit", bench_top_digit },
+	{ "RenderFlush", bench_render_flush },
+	{ "MarqueeText", bench_marquee_text },
+	{ "FrameCommit", bench_frame_commit },
+	{ "StateSave", bench_state_save },
+	{ "StateLoad", bench_state_load },
+	{ "ArgvSplit", bench_argv_split },
+	{ "SimSerial", bench_sim_serial, "sim" },
+	{ "SimPipelined", bench_sim_pipelined, "sim" },
+	{ "USBControl", bench_render_flush, "usb" },
+	{ "USBInterrupt", bench_render_flush, "usb-interrupt" },
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Grow the iteration count until one run takes 'min_ns'
+ */
+static void bench_run(const struct bench *b, uint64_t min_ns)
+{
+	struct ip_usbph_stats st;
+	uint64_t ns, packets;
+	unsigned long a;
+	long n = 1;
+	int i;
+
+	for (;;) {
+		ip_usbph_stats_reset(ph);
+		a = allocs;
+		ns = now_ns();
+		b->run(n);
+		ns = now_ns() - ns;
+		a = allocs - a;
+
+		if (ns >= min_ns || n >= (1L << 40))
+			break;
+
+		/* Aim a little past the minimum, at most 100x per step */
+		if (ns < min_ns / 100)
+			n *= 100;
+		else
+			n = n * 1.2 * min_ns / ns + 1;
+	}
+
+	printf("Benchmark%s\t%ld\t%.2f ns/op\t%.2f allocs/op",
+	       b->name, n, (double)ns / n, (double)a / n);
+
+	if (b->transport != NULL) {
+		ip_usbph_stats_get(ph, &st);
+		for (packets = 0, i = 0; i < IP_USBPH_STATS_CODES; i++)
+			packets += st.packets[i];
+		printf("\t%.0f packets/s", packets * 1e9 / ns);
+	}
+
+	printf("\n");
+	fflush(stdout);
+}
+
+/* The first phone, sending its reports the benchmark's way - or
+ * NULL to skip it.
+ */
+static struct ip_usbph *bench_phone(const struct bench *b)
+{
+	struct ip_usbph *phone;
+
+	if (strcmp(b->transport, "sim") == 0) {
+		phone = ip_usbph_sim_new();
+		if (phone != NULL) {
+			ip_usbph_sim_latency(phone, SIM_BUS_USEC);
+			ip_usbph_sim_turnaround(phone, SIM_TURNAROUND_USEC);
+		}
+		return phone;
+	}
+
+	if (strcmp(b->transport, "usb") == 0)
+		setenv("IP_USBPH_OUT", "control", 1);
+	else
+		unsetenv("IP_USBPH_OUT");
+
+	phone = ip_usbph_acquire(0);
+	if (phone == NULL)
+		return NULL;
+
+	if (strcmp(ip_usbph_transport_name(phone), b->transport) != 0) {
+		ip_usbph_release(phone);
+		return NULL;
+	}
+
+	/* Measure the phone, not a cached rate cap */
+	ip_usbph_flush_rate(phone, 0);
+
+	return phone;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage:\n"
+			"%s [-t <msec>] [<name>...]\n\n"
+			"-t <msec>                 Minimum time per benchmark (1000)\n"
+			"<name>                    Only run benchmarks whose names contain this\n",
+			prog);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t min_ns = 1000000000ULL;
+	char path[] = "/tmp/ip-usbph-bench.XXXXXX";
+	struct ip_usbph *null;
+	int c, i, j;
+
+	while ((c = getopt(argc, argv, "t:")) != -1) {
+		switch (c) {
+		case 't':
+			min_ns = strtoul(optarg, NULL, 0) * 1000000ULL;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	ph = ip_usbph_null_new();
+	if (ph == NULL) {
+		fprintf(stderr, "Can't create the null device\n");
+		return EXIT_FAILURE;
+	}
+	null = ph;
+
+	state_fd = mkstemp(path);
+	if (state_fd < 0) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+	unlink(path);
+
+	for (i = 0; i < ARRAY_SIZE(benches); i++) {
+		for (j = optind; j < argc; j++) {
+			if (strstr(benches[i].name, argv[j]) != NULL)
+				break;
+		}
+		if (optind < argc && j == argc)
+			continue;
+
+		if (benches[i].transport != NULL) {
+			ph = bench_phone(&benches[i]);
+			if (ph == NULL) {
+				fprintf(stderr, "Benchmark%s: no %s phone, skipped\n",
+				        benches[i].name, benches[i].transport);
+				ph = null;
+				continue;
+			}
+		}
+
+		ip_usbph_clear(ph);
+		bench_run(&benches[i], min_ns);
+
+		if (ph != null) {
+			ip_usbph_release(ph);
+			ph = null;
+		}
+	}
+
+	close(state_fd);
+	ip_usbph_release(ph);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2009, Jason McMullan <jason.mcmullan@gmail.com>
+ *
+ * Licensed under the LGPL v2
+ */
+
+/*
+ * argv_join() must quote a command so that argv_split() - as the
+ * daemon runs it - gives back exactly the same arguments.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "argv.h"
+
+#define ARRAY_SIZE(x) (sizeof(x)/sizeof(x[0]))
+
+static int failed;
+
+static void round_trip(int argc, char **argv)
+{
+	char line[1024];
+	char *args[ARGV_MAX];
+	int i, n;
+
+	n = argv_join(line, sizeof(line), argc, argv);
+	if (n < 0) {
+		printf("FAIL: join of %d arguments: %s\n", argc, strerror(-n));
+		failed++;
+		return;
+	}
+
+	n = argv_split(line, args, ARGV_MAX);
+	if (n != argc) {
+		printf("FAIL: %d arguments came back as %d\n", argc, n);
+		failed++;
+		return;
+	}
+
+	for (i = 0; i < argc; i++) {
+		if (strcmp(args[i], argv[i]) != 0) {
+			printf("FAIL: argument %d \"%s\" came back as \"%s\"\n",
+			       i, argv[i], args[i]);
+			failed++;
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	char *empty[] = { "top", "" };
+	char *empties[] = { "", "", "" };
+	char *spaces[] = { "top", " a b ", "\t" };
+	char *quotes[] = { "bot", "'", "\"", "\\", "it's \"x\"\\" };
+	char *plain[] = { "symbol", "Mute", "on" };
+	char *newline[] = { "top", "a\nb" };
+	char line[8];
+	int err;
+
+	round_trip(ARRAY_SIZE(empty), empty);
+	round_trip(ARRAY_SIZE(empties), empties);
+	round_trip(ARRAY_SIZE(spaces), spaces);
+	round_trip(ARRAY_SIZE(quotes), quotes);
+	round_trip(ARRAY_SIZE(plain), plain);
+
+	err = argv_join(line, sizeof(line), ARRAY_SIZE(newline), newline);
+	if (err != -EINVAL) {
+		printf("FAIL: newline joined as %d\n", err);
+		failed++;
+	}
+
+	err = argv_join(line, sizeof(line), ARRAY_SIZE(plain), plain);
+	if (err != -ENAMETOOLONG) {
+		printf("FAIL: overlong line joined as %d\n", err);
+		failed++;
+	}
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
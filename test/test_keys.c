@@ -0,0 +1,90 @@
+/*
+ * Copyright 2009, Jason McMullan <jason.mcmullan@gmail.com>
+ *
+ * Licensed under the LGPL v2
+ */
+
+/*
+ * In threaded mode, ip_usbph_key_get() must wait for the I/O
+ * thread, and never run the transport itself: every flush
+ * completion has to happen on the I/O thread, which owns the
+ * flush state. Keys are scripted on a simulated phone, while
+ * flushes are queued alongside them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ip-usbph.h"
+
+#define KEYS	40
+
+static pthread_t app;
+static int flushed, wrong_thread;
+
+static void flush_done(struct ip_usbph *ph, int err, void *priv)
+{
+	if (pthread_equal(pthread_self(), app))
+		wrong_thread++;
+	flushed++;
+}
+
+int main(int argc, char **argv)
+{
+	struct ip_usbph_sim_key script[KEYS];
+	struct ip_usbph *ph;
+	char text[8];
+	uint8_t key;
+	int i, failed = 0;
+
+	app = pthread_self();
+
+	ph = ip_usbph_sim_new();
+	if (ph == NULL) {
+		printf("FAIL: no simulated phone\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Slow enough that flushes are in flight as keys arrive */
+	ip_usbph_sim_latency(ph, 200);
+
+	for (i = 0; i < KEYS; i++) {
+		script[i].delay_msec = 2;
+		script[i].key = IP_USBPH_KEY_0 + i % 10;
+		if (i & 1)
+			script[i].key |= IP_USBPH_KEY_PRESSED;
+	}
+
+	if (ip_usbph_thread_start(ph) < 0) {
+		printf("FAIL: can't start the I/O thread\n");
+		return EXIT_FAILURE;
+	}
+
+	ip_usbph_sim_keys(ph, script, KEYS);
+
+	for (i = 0; i < KEYS; i++) {
+		snprintf(text, sizeof(text), "K%d", i);
+		ip_usbph_top_text(ph, text);
+		ip_usbph_flush_async(ph, flush_done, NULL);
+
+		key = ip_usbph_key_get(ph, 1000);
+		if (key != script[i].key) {
+			printf("FAIL: key %d read as 0x%02x, not 0x%02x\n",
+			       i, key, script[i].key);
+			failed++;
+			break;
+		}
+	}
+
+	ip_usbph_thread_stop(ph);
+	ip_usbph_release(ph);
+
+	if (wrong_thread != 0) {
+		printf("FAIL: %d of %d flushes completed on the application thread\n",
+		       wrong_thread, flushed);
+		failed++;
+	}
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}